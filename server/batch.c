@@ -0,0 +1,211 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <openssl/evp.h>
+
+#include "batch.h"
+#include "budget.h"
+#include "catalog.h"
+#include "chunk_store.h"
+#include "compress.h"
+#include "replication.h"
+#include "upload.h"
+#include "users.h"
+#include "utils.h"
+
+#define SAVE_FAILED "550 could not save file\n"
+
+struct batch_t *batch_new(struct user_configuration_t *user, unsigned int count)
+{
+    struct batch_t *batch = (struct batch_t *)calloc(1, sizeof(struct batch_t) + count * sizeof(struct batch_file_t));
+    if (batch == NULL) return NULL;
+
+    batch->data = evbuffer_new();
+    if (batch->data == NULL) {
+        free(batch);
+        return NULL;
+    }
+
+    if (build_path(batch->repository_path, "%s/%s", configuration.repository_root, user->repository) != 0) {
+        evbuffer_free(batch->data);
+        free(batch);
+        return NULL;
+    }
+
+    budget_watch(batch->data);
+    batch->user = user;
+    user_table_retain(user->table);
+    batch->count = count;
+    uploads_in_progress++;
+    return batch;
+}
+
+void batch_free(struct batch_t *batch)
+{
+    user_table_release(batch->user->table);
+    budget_unwatch(batch->data);
+    evbuffer_free(batch->data);
+    free(batch);
+    uploads_in_progress--;
+}
+
+// Lets go of a batch when its session ends.
+void batch_release(struct batch_t *batch)
+{
+    batch->client = NULL;
+    if (!batch->storing) batch_free(batch);
+}
+
+static int write_chunked(struct chunker_t *chunker, const unsigned char *data, size_t length)
+{
+    while (length > 0) {
+        size_t n = chunker_space(chunker);
+        if (n > length) n = length;
+
+        memcpy(chunker_tail(chunker), data, n);
+        if (chunker_update(chunker, n) != 0) return -1;
+        data += n;
+        length -= n;
+    }
+    return chunker_finish(chunker);
+}
+
+// Checks one file and writes it to a temporary file, in whichever form the
+// user's versions take. Returns the file's response if that's as far as it
+// goes, or NULL if it is ready to be moved into the repository.
+static const char *stage_file(struct batch_t *batch, struct batch_file_t *file, const char *repository_path, EVP_MD_CTX *digest, struct chunker_t **chunker)
+{
+    char current_path[PATH_MAX], temp_path[PATH_MAX];
+    unsigned char md[EVP_MAX_MD_SIZE];
+    unsigned int md_length;
+    struct stat st;
+    int fd, n;
+
+    if (build_path(current_path, "%s/current.%s", repository_path, file->filename) != 0) return SAVE_FAILED;
+
+    if (*file->expected_hash && version_matches(current_path, file->expected_hash)) return "258 file unchanged\n";
+    if (!batch->user->versioning_enabled && (lstat(current_path, &st) == 0 || errno != ENOENT)) return "520 file already exists\n";
+
+    // The data is all here already, so the hash can be checked before
+    // anything is written.
+    unsigned char *data = evbuffer_pullup(batch->data, file->length);
+    if (data == NULL && file->length > 0) return SAVE_FAILED;
+
+    if (!EVP_DigestInit_ex(digest, EVP_sha256(), NULL) || !EVP_DigestUpdate(digest, data, file->length) || !EVP_DigestFinal_ex(digest, md, &md_length)) return SAVE_FAILED;
+    hex_encode(file->hash, md, md_length);
+    if (*file->expected_hash && strcasecmp(file->expected_hash, file->hash)) return "530 file hash does not match hash supplied by client\n";
+
+    file->number = next_upload_number();
+    if (build_path(temp_path, "%s/tmp/%d.%d", configuration.repository_root, getpid(), file->number) != 0) return SAVE_FAILED;
+    if ((fd = open(temp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0640)) == -1) return SAVE_FAILED;
+
+    if (batch->user->deduplication_enabled) {
+        if (*chunker == NULL) n = (*chunker = chunker_new(configuration.repository_root, fd)) == NULL ? -1 : 0;
+        else n = chunker_reset(*chunker, fd);
+        if (n == 0) n = write_chunked(*chunker, data, file->length);
+    }
+    else if (batch->user->compression_level) {
+        n = compress_data(fd, batch->user->compression_level, data, file->length);
+    }
+    else {
+        n = write_all(fd, data, file->length);
+    }
+
+    if (close(fd) != 0 || n != 0) {
+        unlink(temp_path); // ignore result
+        return SAVE_FAILED;
+    }
+    return NULL;
+}
+
+// Moves a staged file into the repository as its new current version, the
+// same way a SAVE does.
+static const char *commit_file(struct batch_t *batch, struct batch_file_t *file, const char *repository_path, struct catalog_t *catalog)
+{
+    char current_path[PATH_MAX], temp_path[PATH_MAX], version_path[PATH_MAX];
+    struct stat st;
+
+    if (build_path(temp_path, "%s/tmp/%d.%d", configuration.repository_root, getpid(), file->number) != 0) return SAVE_FAILED;
+    if (build_path(current_path, "%s/current.%s", repository_path, file->filename) != 0 ||
+            build_path(version_path, "%s/%d.%d.%d.%s", repository_path, getpid(), file->number, (int)time(NULL), file->filename) != 0) {
+        unlink(temp_path); // ignore result
+        return SAVE_FAILED;
+    }
+
+    // The same name may come up twice in a batch.
+    if (!batch->user->versioning_enabled && (lstat(current_path, &st) == 0 || errno != ENOENT)) {
+        unlink(temp_path); // ignore result
+        return "520 file already exists\n";
+    }
+
+    if (rename(temp_path, version_path) != 0) {
+        unlink(temp_path); // ignore result
+        return SAVE_FAILED;
+    }
+    write_cached_digest(version_path, file->hash); // ignore result; a later PUT will rehash
+    if (catalog) catalog_add(catalog, strrchr(version_path, '/') + 1, file->length, file->hash); // ignore result
+    replication_add(batch->user, strrchr(version_path, '/') + 1, file->filename, file->length, file->hash);
+
+    if (symlink(version_path, temp_path) != 0) return SAVE_FAILED;
+    if (rename(temp_path, current_path) != 0) {
+        unlink(temp_path); // ignore result
+        return SAVE_FAILED;
+    }
+    return "259 file saved\n";
+}
+
+// Stores every file in the batch, as a DISK_CALL. All the files are staged
+// first, so that with 'durable saves' a single syncfs() covers their data
+// before any of them is renamed into place; the caller then waits for a
+// group commit of the repository directory as for a single SAVE.
+int batch_store(void *arg)
+{
+    struct batch_t *batch = (struct batch_t *)arg;
+    const char *repository_path = batch->repository_path;
+    char temp_path[PATH_MAX];
+    struct chunker_t *chunker = NULL;
+    unsigned int i;
+    int staged = 0;
+
+    EVP_MD_CTX *digest = EVP_MD_CTX_new();
+    if (digest == NULL) return -1;
+
+    for (i = 0; i < batch->count; i++) {
+        struct batch_file_t *file = &batch->files[i];
+        if (file->response) continue;
+
+        file->response = stage_file(batch, file, repository_path, digest, &chunker);
+        evbuffer_drain(batch->data, file->length);
+        if (file->response == NULL) staged++;
+    }
+
+    EVP_MD_CTX_free(digest);
+    if (chunker) chunker_free(chunker);
+
+    if (staged > 0 && configuration.durable_saves) {
+        int fd = open(repository_path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        int n = fd == -1 ? -1 : syncfs(fd);
+        if (fd != -1) close(fd);
+
+        if (n != 0) {
+            for (i = 0; i < batch->count; i++) {
+                if (batch->files[i].response) continue;
+                batch->files[i].response = SAVE_FAILED;
+                if (build_path(temp_path, "%s/tmp/%d.%d", configuration.repository_root, getpid(), batch->files[i].number) == 0) unlink(temp_path); // ignore result
+            }
+            return 0;
+        }
+    }
+
+    struct catalog_t *catalog = catalog_open(batch->user->repository);
+    for (i = 0; i < batch->count; i++) {
+        if (batch->files[i].response == NULL) batch->files[i].response = commit_file(batch, &batch->files[i], repository_path, catalog);
+    }
+    return 0;
+}
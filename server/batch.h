@@ -0,0 +1,55 @@
+#ifndef __BATCH_H
+#define __BATCH_H
+
+#include <limits.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+#include <event2/buffer.h>
+#include "configuration.h"
+#include "constants.h"
+#include "digest.h"
+
+#define MAX_BATCH_FILES 1024
+#define MAX_BATCH_FILE_SIZE (1024 * 1024)
+#define MAX_BATCH_SIZE (16 * 1024 * 1024)
+
+// One file in an MPUT batch. `response` is what the client is told about
+// it: set as the batch arrives if the entry is no good, and by batch_store()
+// otherwise.
+struct batch_file_t
+{
+    char filename[MAX_FILENAME_LENGTH + 1];
+    char expected_hash[DIGEST_HEX_LENGTH + 1];
+    char hash[DIGEST_HEX_LENGTH + 1];
+    size_t length;
+    int number;
+    const char *response;
+};
+
+// A batch of small files sent with MPUT. The event loop collects the
+// payloads in `data`, then a single disk job stores every file; the session
+// waits for the lot and answers once. A batch whose session ends while it is
+// being stored is freed when the job completes.
+struct batch_t
+{
+    struct user_configuration_t *user;
+    struct client_data_t *client;
+    struct disk_t *disk;
+    char repository_path[PATH_MAX];
+    unsigned int count;
+    unsigned int entries;
+    size_t remaining;
+    size_t size;
+    struct evbuffer *data;
+    int storing;
+    uint64_t started;
+    struct batch_file_t files[];
+};
+
+struct batch_t *batch_new(struct user_configuration_t *user, unsigned int count);
+void batch_free(struct batch_t *batch);
+void batch_release(struct batch_t *batch);
+int batch_store(void *arg);
+
+#endif
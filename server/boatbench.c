@@ -0,0 +1,695 @@
+// Load generator for boatd. Starts a boatd against a throwaway repository
+// root with a freshly made self-signed certificate, runs concurrent
+// USER/PASS/PUT/BLOCK/SAVE sessions against it for a fixed time, and reports
+// throughput, handshakes per second, per-command latency percentiles and
+// the server's CPU time per gigabyte received. Everything happens on the
+// loopback interface, so it can run offline as a regression gate:
+//
+//   ./boatbench -s ./boatd -c 16 -d 10 -f 1048576 -b 262144
+//
+// It exits with status 1 if any session fails.
+#define _GNU_SOURCE
+#include <errno.h>
+#include <ftw.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/pem.h>
+#include <openssl/rand.h>
+#include <openssl/ssl.h>
+#include <openssl/x509.h>
+
+#define BENCH_USER "bench"
+#define BENCH_PASSWORD "benchmark"
+#define DATA_POOL_SIZE (16 * 1024 * 1024)
+
+enum { OP_HANDSHAKE = 0, OP_USER, OP_PASS, OP_PUT, OP_BLOCK, OP_SAVE, OP_FILE, OP_COUNT };
+static const char *op_names[OP_COUNT] = { "handshake", "USER", "PASS", "PUT", "BLOCK", "SAVE", "whole file" };
+
+struct options_t
+{
+    const char *boatd;
+    int connections;
+    int duration;
+    int files_per_session;
+    size_t file_size;
+    size_t block_size;
+    size_t small_file_size;
+    int small_file_percent;
+    int pipelined;
+    int unique_data;
+    int compressible_data;
+    int worker_threads;
+    int keep;
+    int resume_sessions;
+    char *extra[32];
+    int extra_count;
+};
+
+struct samples_t
+{
+    uint64_t *values;
+    size_t count;
+    size_t capacity;
+};
+
+struct bench_thread_t
+{
+    int id;
+    pthread_t thread;
+    unsigned int seed;
+    unsigned char *block;
+    struct samples_t samples[OP_COUNT];
+    unsigned long long bytes;
+    unsigned long long files;
+    unsigned long long sessions;
+    unsigned long long resumed;
+    unsigned long long errors;
+    SSL_SESSION *session;
+};
+
+// A TLS connection with a small read buffer for reply lines.
+struct connection_t
+{
+    int fd;
+    SSL *ssl;
+    char in[4096];
+    int start;
+    int end;
+};
+
+static struct options_t options;
+static SSL_CTX *client_ctx;
+static unsigned short port;
+static unsigned char *data_pool;
+static uint64_t deadline;
+static char work_dir[64];
+
+static uint64_t now_ns(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static void record(struct bench_thread_t *thread, int op, uint64_t started)
+{
+    struct samples_t *samples = &thread->samples[op];
+
+    if (samples->count == samples->capacity) {
+        samples->capacity = samples->capacity ? samples->capacity * 2 : 1024;
+        samples->values = (uint64_t *)realloc(samples->values, samples->capacity * sizeof(uint64_t));
+        if (samples->values == NULL) {
+            fprintf(stderr, "out of memory\n");
+            exit(1);
+        }
+    }
+    samples->values[samples->count++] = now_ns() - started;
+}
+
+static int send_all(struct connection_t *conn, const void *data, size_t length)
+{
+    while (length > 0) {
+        int n = SSL_write(conn->ssl, data, length > INT_MAX ? INT_MAX : (int)length);
+        if (n <= 0) return -1;
+        data = (const char *)data + n;
+        length -= n;
+    }
+    return 0;
+}
+
+static int read_line(struct connection_t *conn, char *line, size_t size)
+{
+    size_t length = 0;
+
+    for (;;) {
+        while (conn->start < conn->end) {
+            char c = conn->in[conn->start++];
+            if (c == '\n') {
+                line[length] = 0;
+                return 0;
+            }
+            if (length + 1 < size) line[length++] = c;
+        }
+
+        int n = SSL_read(conn->ssl, conn->in, sizeof(conn->in));
+        if (n <= 0) return -1;
+        conn->start = 0;
+        conn->end = n;
+    }
+}
+
+// Reads a reply and checks that it starts with `code`.
+static int expect(struct connection_t *conn, const char *code, const char *context)
+{
+    char line[256];
+
+    if (read_line(conn, line, sizeof(line)) != 0) {
+        fprintf(stderr, "connection lost waiting for a reply to %s\n", context);
+        return -1;
+    }
+    if (strncmp(line, code, strlen(code))) {
+        fprintf(stderr, "unexpected reply to %s: %s\n", context, line);
+        return -1;
+    }
+    return 0;
+}
+
+static int command(struct bench_thread_t *thread, struct connection_t *conn, int op, const char *line, const char *code)
+{
+    char buffer[PATH_MAX + 64];
+    uint64_t started = now_ns();
+
+    snprintf(buffer, sizeof(buffer), "%s\n", line);
+    if (send_all(conn, buffer, strlen(buffer)) != 0 || expect(conn, code, line) != 0) return -1;
+    if (op >= 0) record(thread, op, started);
+    return 0;
+}
+
+static int connect_to_server(struct bench_thread_t *thread, struct connection_t *conn)
+{
+    struct sockaddr_in sin;
+    int one = 1;
+    uint64_t started = now_ns();
+
+    memset(conn, 0, sizeof(*conn));
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_port = htons(port);
+    sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    conn->fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (conn->fd == -1) return -1;
+    setsockopt(conn->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (connect(conn->fd, (struct sockaddr *)&sin, sizeof(sin)) == -1) {
+        fprintf(stderr, "could not connect to boatd: %s\n", strerror(errno));
+        return -1;
+    }
+
+    conn->ssl = SSL_new(client_ctx);
+    if (conn->ssl == NULL) return -1;
+    SSL_set_fd(conn->ssl, conn->fd);
+    if (thread->session) SSL_set_session(conn->ssl, thread->session);
+    if (SSL_connect(conn->ssl) != 1) {
+        fprintf(stderr, "TLS handshake failed\n");
+        ERR_print_errors_fp(stderr);
+        return -1;
+    }
+    record(thread, OP_HANDSHAKE, started);
+    if (SSL_session_reused(conn->ssl)) thread->resumed++;
+
+    return expect(conn, "220", "connecting");
+}
+
+// Says goodbye properly, without which OpenSSL won't resume the session.
+static void disconnect(struct connection_t *conn)
+{
+    if (conn->ssl) {
+        SSL_shutdown(conn->ssl);
+        SSL_free(conn->ssl);
+    }
+    if (conn->fd > 0) close(conn->fd);
+}
+
+static const unsigned char *next_block(struct bench_thread_t *thread, size_t length)
+{
+    if (options.unique_data) {
+        RAND_bytes(thread->block, length);
+        return thread->block;
+    }
+    return data_pool + rand_r(&thread->seed) % (DATA_POOL_SIZE - length + 1);
+}
+
+// Something like a SQL dump.
+static void fill_with_text(unsigned char *data, size_t length)
+{
+    unsigned int seed = 1, row = 0;
+    size_t offset = 0;
+    char line[128];
+
+    while (offset < length) {
+        int n = snprintf(line, sizeof(line), "INSERT INTO events VALUES (%u, %u, 'user%u', 'event %u', %u.%02u);\n",
+                row, rand_r(&seed) % 100000, rand_r(&seed) % 1000, rand_r(&seed) % 50, rand_r(&seed) % 10000, rand_r(&seed) % 100);
+        if ((size_t)n > length - offset) n = length - offset;
+        memcpy(data + offset, line, n);
+        offset += n;
+        row++;
+    }
+}
+
+static int put_file(struct bench_thread_t *thread, struct connection_t *conn, const char *filename, size_t size)
+{
+    char line[PATH_MAX + 64];
+    uint64_t started = now_ns();
+    size_t offset, length;
+
+    snprintf(line, sizeof(line), "PUT %s", filename);
+    if (command(thread, conn, OP_PUT, line, "255") != 0) return -1;
+
+    // Pipelined blocks are acknowledged in batches, so only the file as a
+    // whole is timed.
+    if (options.pipelined) {
+        for (offset = 0; offset < size; offset += length) {
+            length = size - offset < options.block_size ? size - offset : options.block_size;
+            snprintf(line, sizeof(line), "BLOCK %zu\n", length);
+            if (send_all(conn, line, strlen(line)) != 0 || send_all(conn, next_block(thread, length), length) != 0) return -1;
+        }
+        if (send_all(conn, "SAVE\n", 5) != 0) return -1;
+
+        for (;;) {
+            if (read_line(conn, line, sizeof(line)) != 0) {
+                fprintf(stderr, "connection lost waiting for a reply to SAVE\n");
+                return -1;
+            }
+            if (!strncmp(line, "259", 3)) break;
+            if (strncmp(line, "257", 3)) {
+                fprintf(stderr, "unexpected reply to pipelined upload: %s\n", line);
+                return -1;
+            }
+        }
+    }
+    else {
+        for (offset = 0; offset < size; offset += length) {
+            uint64_t block_started = now_ns();
+            length = size - offset < options.block_size ? size - offset : options.block_size;
+            snprintf(line, sizeof(line), "BLOCK %zu", length);
+            if (command(thread, conn, -1, line, "256") != 0) return -1;
+            if (send_all(conn, next_block(thread, length), length) != 0 || expect(conn, "257", "block data") != 0) return -1;
+            record(thread, OP_BLOCK, block_started);
+        }
+        if (command(thread, conn, OP_SAVE, "SAVE", "259") != 0) return -1;
+    }
+
+    record(thread, OP_FILE, started);
+    thread->bytes += size;
+    thread->files++;
+    return 0;
+}
+
+static int run_session(struct bench_thread_t *thread)
+{
+    struct connection_t conn;
+    char filename[64];
+    int i, result = -1;
+
+    if (connect_to_server(thread, &conn) != 0) goto done;
+    if (command(thread, &conn, OP_USER, "USER " BENCH_USER, "251") != 0) goto done;
+    if (command(thread, &conn, OP_PASS, "PASS " BENCH_PASSWORD, "252") != 0) goto done;
+    if (options.pipelined && command(thread, &conn, -1, "PIPELINE", "262") != 0) goto done;
+
+    for (i = 0; i < options.files_per_session && now_ns() < deadline; i++) {
+        size_t size = options.file_size;
+        if (options.small_file_percent && (int)(rand_r(&thread->seed) % 100) < options.small_file_percent) size = options.small_file_size;
+
+        snprintf(filename, sizeof(filename), "bench-%d-%d", thread->id, i);
+        if (put_file(thread, &conn, filename, size) != 0) goto done;
+    }
+
+    if (command(thread, &conn, -1, "QUIT", "221") != 0) goto done;
+    result = 0;
+
+    // By now any TLS 1.3 ticket has arrived with the replies.
+    if (options.resume_sessions) {
+        if (thread->session) SSL_SESSION_free(thread->session);
+        thread->session = SSL_get1_session(conn.ssl);
+    }
+
+done:
+    disconnect(&conn);
+    thread->sessions++;
+    return result;
+}
+
+static void *bench_thread(void *arg)
+{
+    struct bench_thread_t *thread = (struct bench_thread_t *)arg;
+
+    while (now_ns() < deadline) {
+        if (run_session(thread) != 0) {
+            thread->errors++;
+            break;
+        }
+    }
+    return NULL;
+}
+
+// Makes a self-signed RSA certificate for boatd.
+static int make_certificate(const char *key_file, const char *cert_file)
+{
+    EVP_PKEY *key = EVP_RSA_gen(2048);
+    X509 *cert = X509_new();
+    FILE *file;
+    int result = -1;
+
+    if (key == NULL || cert == NULL) goto done;
+
+    ASN1_INTEGER_set(X509_get_serialNumber(cert), 1);
+    X509_gmtime_adj(X509_getm_notBefore(cert), 0);
+    X509_gmtime_adj(X509_getm_notAfter(cert), 24 * 60 * 60);
+    X509_set_pubkey(cert, key);
+    X509_NAME_add_entry_by_txt(X509_get_subject_name(cert), "CN", MBSTRING_ASC, (const unsigned char *)"localhost", -1, -1, 0);
+    X509_set_issuer_name(cert, X509_get_subject_name(cert));
+    if (!X509_sign(cert, key, EVP_sha256())) goto done;
+
+    if ((file = fopen(key_file, "w")) == NULL) goto done;
+    if (!PEM_write_PrivateKey(file, key, NULL, NULL, 0, NULL, NULL)) {
+        fclose(file);
+        goto done;
+    }
+    fclose(file);
+
+    if ((file = fopen(cert_file, "w")) == NULL) goto done;
+    if (!PEM_write_X509(file, cert)) {
+        fclose(file);
+        goto done;
+    }
+    fclose(file);
+    result = 0;
+
+done:
+    X509_free(cert);
+    EVP_PKEY_free(key);
+    return result;
+}
+
+// Produces a 'user password' value: an 8 character salt followed by the hex
+// HMAC-SHA256 of the salt keyed with the password, as command_pass checks it.
+static void hash_password(const char *password, char *out)
+{
+    static const char alphabet[] = "abcdefghijklmnopqrstuvwxyz0123456789";
+    unsigned char random[8], digest[EVP_MAX_MD_SIZE];
+    unsigned int digest_length, i;
+
+    RAND_bytes(random, sizeof(random));
+    for (i = 0; i < sizeof(random); i++) out[i] = alphabet[random[i] % (sizeof(alphabet) - 1)];
+    HMAC(EVP_sha256(), password, strlen(password), (unsigned char *)out, sizeof(random), digest, &digest_length);
+    for (i = 0; i < digest_length; i++) sprintf(out + sizeof(random) + i * 2, "%02x", digest[i]);
+}
+
+static unsigned short free_port(void)
+{
+    struct sockaddr_in sin;
+    socklen_t length = sizeof(sin);
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (fd == -1 || bind(fd, (struct sockaddr *)&sin, sizeof(sin)) == -1 || getsockname(fd, (struct sockaddr *)&sin, &length) == -1) {
+        if (fd != -1) close(fd);
+        return 0;
+    }
+    close(fd);
+    return ntohs(sin.sin_port);
+}
+
+static int write_configuration(const char *config_file)
+{
+    char password[8 + 64 + 1];
+    FILE *file = fopen(config_file, "w");
+    int i;
+
+    if (file == NULL) return -1;
+    hash_password(BENCH_PASSWORD, password);
+
+    fprintf(file, "listen address = 127.0.0.1\n");
+    fprintf(file, "listen port = %d\n", port);
+    fprintf(file, "repository root = %s/repository\n", work_dir);
+    fprintf(file, "ssl key file = %s/key.pem\n", work_dir);
+    fprintf(file, "ssl cert file = %s/cert.pem\n", work_dir);
+    fprintf(file, "worker threads = %d\n", options.worker_threads);
+    fprintf(file, "user = " BENCH_USER "\n");
+    fprintf(file, "user password = %s\n", password);
+    fprintf(file, "user repository = " BENCH_USER "\n");
+    fprintf(file, "user versioning enabled = yes\n");
+    for (i = 0; i < options.extra_count; i++) fprintf(file, "%s\n", options.extra[i]);
+
+    return fclose(file) == 0 ? 0 : -1;
+}
+
+static pid_t start_server(void)
+{
+    char config_file[PATH_MAX];
+    pid_t pid;
+    int i;
+
+    snprintf(config_file, sizeof(config_file), "%s/boat.conf", work_dir);
+    if (write_configuration(config_file) != 0) {
+        fprintf(stderr, "could not write configuration to %s\n", work_dir);
+        return -1;
+    }
+
+    pid = fork();
+    if (pid == -1) return -1;
+    if (pid == 0) {
+        execl(options.boatd, options.boatd, config_file, (char *)NULL);
+        fprintf(stderr, "could not run %s: %s\n", options.boatd, strerror(errno));
+        _exit(127);
+    }
+
+    // Wait for it to start listening.
+    for (i = 0; i < 200; i++) {
+        struct sockaddr_in sin;
+        int fd = socket(AF_INET, SOCK_STREAM, 0), status;
+
+        memset(&sin, 0, sizeof(sin));
+        sin.sin_family = AF_INET;
+        sin.sin_port = htons(port);
+        sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        if (connect(fd, (struct sockaddr *)&sin, sizeof(sin)) == 0) {
+            close(fd);
+            return pid;
+        }
+        close(fd);
+
+        if (waitpid(pid, &status, WNOHANG) == pid) {
+            fprintf(stderr, "boatd exited during startup\n");
+            return -1;
+        }
+        usleep(50000);
+    }
+
+    fprintf(stderr, "boatd did not start listening on port %d\n", port);
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+    return -1;
+}
+
+static int remove_entry(const char *path, const struct stat *st, int flag, struct FTW *ftw)
+{
+    remove(path);
+    return 0;
+}
+
+static int compare_samples(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static double percentile(const struct samples_t *samples, double q)
+{
+    size_t i = (size_t)(q * samples->count);
+    if (i >= samples->count) i = samples->count - 1;
+    return samples->values[i] / 1e6;
+}
+
+static double seconds(struct timeval tv)
+{
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr,
+            "usage: %s [options]\n"
+            "  -s <path>     boatd binary to run (default ./boatd)\n"
+            "  -c <n>        concurrent connections (default 8)\n"
+            "  -d <seconds>  how long to run (default 10)\n"
+            "  -n <n>        files uploaded per session before reconnecting (default 10)\n"
+            "  -f <bytes>    file size (default 1048576)\n"
+            "  -b <bytes>    block size (default 262144)\n"
+            "  -m <pct>:<bytes>  make <pct>%% of files <bytes> long instead\n"
+            "  -p            pipeline blocks\n"
+            "  -u            send unique random data rather than a shared pool\n"
+            "  -x            fill the shared pool with text that compresses about 5:1\n"
+            "  -t <n>        boatd worker threads (default 1)\n"
+            "  -o <line>     append a line to boatd's configuration, e.g.\n"
+            "                -o 'zero copy uploads = yes'; user options apply to the bench user\n"
+            "  -r            resume TLS sessions when reconnecting\n"
+            "  -k            keep the temporary repository\n",
+            name);
+}
+
+int main(int argc, char **argv)
+{
+    struct bench_thread_t *threads;
+    struct samples_t totals[OP_COUNT];
+    struct rusage server_usage, client_usage;
+    unsigned long long bytes = 0, files = 0, sessions = 0, resumed = 0, errors = 0;
+    uint64_t started, elapsed;
+    pid_t pid;
+    int c, i, op, status;
+
+    memset(&options, 0, sizeof(options));
+    options.boatd = "./boatd";
+    options.connections = 8;
+    options.duration = 10;
+    options.files_per_session = 10;
+    options.file_size = 1048576;
+    options.block_size = 262144;
+    options.worker_threads = 1;
+
+    while ((c = getopt(argc, argv, "s:c:d:n:f:b:m:puxt:o:rkh")) != -1) {
+        switch (c) {
+            case 's': options.boatd = optarg; break;
+            case 'c': options.connections = atoi(optarg); break;
+            case 'd': options.duration = atoi(optarg); break;
+            case 'n': options.files_per_session = atoi(optarg); break;
+            case 'f': options.file_size = strtoull(optarg, NULL, 10); break;
+            case 'b': options.block_size = strtoull(optarg, NULL, 10); break;
+            case 'm':
+                if (sscanf(optarg, "%d:%zu", &options.small_file_percent, &options.small_file_size) != 2) {
+                    usage(argv[0]);
+                    return 2;
+                }
+                break;
+            case 'p': options.pipelined = 1; break;
+            case 'u': options.unique_data = 1; break;
+            case 'x': options.compressible_data = 1; break;
+            case 't': options.worker_threads = atoi(optarg); break;
+            case 'o':
+                if (options.extra_count == sizeof(options.extra) / sizeof(options.extra[0])) {
+                    fprintf(stderr, "too many -o options\n");
+                    return 2;
+                }
+                options.extra[options.extra_count++] = optarg;
+                break;
+            case 'r': options.resume_sessions = 1; break;
+            case 'k': options.keep = 1; break;
+            default: usage(argv[0]); return 2;
+        }
+    }
+
+    if (options.connections < 1 || options.duration < 1 || options.files_per_session < 1 || options.worker_threads < 1 ||
+            options.block_size < 1 || options.block_size > 10485760 || options.small_file_percent < 0 || options.small_file_percent > 100) {
+        usage(argv[0]);
+        return 2;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+
+    snprintf(work_dir, sizeof(work_dir), "/tmp/boatbench.XXXXXX");
+    if (mkdtemp(work_dir) == NULL) {
+        fprintf(stderr, "could not create a temporary directory: %s\n", strerror(errno));
+        return 1;
+    }
+
+    char key_file[PATH_MAX], cert_file[PATH_MAX];
+    snprintf(key_file, sizeof(key_file), "%s/key.pem", work_dir);
+    snprintf(cert_file, sizeof(cert_file), "%s/cert.pem", work_dir);
+    if (make_certificate(key_file, cert_file) != 0) {
+        fprintf(stderr, "could not make a certificate\n");
+        return 1;
+    }
+
+    port = free_port();
+    if (port == 0 || (pid = start_server()) == -1) return 1;
+
+    client_ctx = SSL_CTX_new(TLS_client_method());
+    SSL_CTX_set_min_proto_version(client_ctx, TLS1_2_VERSION);
+    SSL_CTX_set_verify(client_ctx, SSL_VERIFY_NONE, NULL);
+
+    data_pool = (unsigned char *)malloc(DATA_POOL_SIZE);
+    threads = (struct bench_thread_t *)calloc(options.connections, sizeof(struct bench_thread_t));
+    if (data_pool == NULL || threads == NULL || RAND_bytes(data_pool, DATA_POOL_SIZE) != 1) {
+        fprintf(stderr, "could not set up test data\n");
+        return 1;
+    }
+    if (options.compressible_data) fill_with_text(data_pool, DATA_POOL_SIZE);
+
+    started = now_ns();
+    deadline = started + (uint64_t)options.duration * 1000000000;
+    for (i = 0; i < options.connections; i++) {
+        threads[i].id = i;
+        threads[i].seed = i + 1;
+        if (options.unique_data && (threads[i].block = (unsigned char *)malloc(options.block_size)) == NULL) return 1;
+        if (pthread_create(&threads[i].thread, NULL, bench_thread, &threads[i]) != 0) {
+            fprintf(stderr, "could not start thread %d\n", i);
+            return 1;
+        }
+    }
+    for (i = 0; i < options.connections; i++) pthread_join(threads[i].thread, NULL);
+    elapsed = now_ns() - started;
+
+    kill(pid, SIGTERM);
+    wait4(pid, &status, 0, &server_usage);
+    getrusage(RUSAGE_SELF, &client_usage);
+
+    memset(totals, 0, sizeof(totals));
+    for (i = 0; i < options.connections; i++) {
+        bytes += threads[i].bytes;
+        files += threads[i].files;
+        sessions += threads[i].sessions;
+        resumed += threads[i].resumed;
+        if (threads[i].session) SSL_SESSION_free(threads[i].session);
+        errors += threads[i].errors;
+        for (op = 0; op < OP_COUNT; op++) {
+            struct samples_t *from = &threads[i].samples[op], *to = &totals[op];
+            to->values = (uint64_t *)realloc(to->values, (to->count + from->count + 1) * sizeof(uint64_t));
+            memcpy(to->values + to->count, from->values, from->count * sizeof(uint64_t));
+            to->count += from->count;
+            free(from->values);
+        }
+    }
+
+    double wall = elapsed / 1e9;
+    double server_cpu = seconds(server_usage.ru_utime) + seconds(server_usage.ru_stime);
+    double client_cpu = seconds(client_usage.ru_utime) + seconds(client_usage.ru_stime);
+
+    printf("connections    %d, %s, %d boatd worker thread%s\n", options.connections, options.pipelined ? "pipelined" : "lockstep",
+            options.worker_threads, options.worker_threads == 1 ? "" : "s");
+    printf("files          %zu bytes in %zu byte blocks", options.file_size, options.block_size);
+    if (options.small_file_percent) printf(", %d%% of them %zu bytes", options.small_file_percent, options.small_file_size);
+    printf("\n");
+    printf("elapsed        %.2f s\n", wall);
+    printf("sessions       %llu (%.1f handshakes/s", sessions, totals[OP_HANDSHAKE].count / wall);
+    if (options.resume_sessions) printf(", %llu resumed", resumed);
+    printf(")\n");
+    printf("files saved    %llu (%.1f/s)\n", files, files / wall);
+    printf("throughput     %.1f MB/s\n", bytes / wall / 1e6);
+    printf("boatd cpu      %.2f s", server_cpu);
+    if (bytes) printf(" (%.2f s/GB)", server_cpu / (bytes / 1e9));
+    printf("\n");
+    printf("client cpu     %.2f s\n", client_cpu);
+    printf("errors         %llu\n\n", errors);
+
+    printf("%-12s %10s %10s %10s %10s  (ms)\n", "", "count", "p50", "p99", "p99.9");
+    for (op = 0; op < OP_COUNT; op++) {
+        if (totals[op].count == 0) continue;
+        qsort(totals[op].values, totals[op].count, sizeof(uint64_t), compare_samples);
+        printf("%-12s %10zu %10.3f %10.3f %10.3f\n", op_names[op], totals[op].count,
+                percentile(&totals[op], 0.5), percentile(&totals[op], 0.99), percentile(&totals[op], 0.999));
+    }
+
+    if (options.keep) printf("\nrepository kept in %s\n", work_dir);
+    else nftw(work_dir, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+
+    return errors ? 1 : 0;
+}
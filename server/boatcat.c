@@ -0,0 +1,54 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "chunk_store.h"
+#include "compress.h"
+
+// Writes a stored version to standard output. Versions uploaded by users
+// with deduplication enabled are manifests and are reassembled from the
+// chunk store, compressed versions are decompressed, and anything else is
+// copied as is.
+int main(int argc, char **argv)
+{
+    if (argc != 3) {
+        fprintf(stderr, "usage: %s <repository root> <version file>\n", argv[0]);
+        return 2;
+    }
+
+    if (is_manifest(argv[2])) {
+        if (materialize_manifest(argv[1], argv[2], STDOUT_FILENO) != 0) {
+            fprintf(stderr, "could not reassemble '%s': %s\n", argv[2], strerror(errno));
+            return 1;
+        }
+        return 0;
+    }
+
+    if (is_compressed(argv[2], NULL)) {
+        if (decompress_file(argv[2], STDOUT_FILENO) != 0) {
+            fprintf(stderr, "could not decompress '%s': %s\n", argv[2], strerror(errno));
+            return 1;
+        }
+        return 0;
+    }
+
+    int fd = open(argv[2], O_RDONLY);
+    if (fd == -1) {
+        fprintf(stderr, "could not open '%s': %s\n", argv[2], strerror(errno));
+        return 1;
+    }
+
+    char buffer[65536];
+    ssize_t n;
+    while ((n = read(fd, buffer, sizeof(buffer))) > 0) {
+        if (write(STDOUT_FILENO, buffer, n) != n) {
+            fprintf(stderr, "error writing output: %s\n", strerror(errno));
+            return 1;
+        }
+    }
+    close(fd);
+
+    return n == 0 ? 0 : 1;
+}
@@ -1,110 +1,223 @@
 #include <assert.h>
-#include <ctype.h>
+#include <signal.h>
+#include <unistd.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 
 #include <openssl/ssl.h>
 #include <event.h>
 #include <event2/listener.h>
+#include <event2/thread.h>
 
+#include "budget.h"
+#include "catalog.h"
 #include "client_data.h"
 #include "commands.h"
+#include "compress.h"
 #include "configuration.h"
+#include "constants.h"
+#include "delta.h"
+#include "diskio.h"
+#include "metrics.h"
+#include "parser.h"
+#include "pool.h"
+#include "ratelimit.h"
+#include "replication.h"
+#include "retention.h"
+#include "tickets.h"
+#include "upload.h"
+#include "users.h"
 #include "utils.h"
+#include "worker.h"
+#include "zerocopy.h"
 
-static void ssl_readcb(struct bufferevent *bev, void *data)
+static void command_quit(struct client_data_t *client_data, struct bufferevent *bev, char *args)
 {
-    struct evbuffer *in = bufferevent_get_input(bev);
-    struct client_data_t *client_data = (struct client_data_t *)data;
+    bufferevent_write0(bev, "221 bye\n");
+    close_client(bev, client_data);
+}
 
-    if (client_data->state == STATE_DATA) {
-        int bytes = evbuffer_write_atmost(in, client_data->fd, client_data->incoming_data_size);
-        if (bytes == -1) {
-            system_error(bev, client_data);
-            return;
-        }
-        client_data->incoming_data_size -= bytes;
+#define IN(state) (1u << (state))
+#define ANY_STATE (~0u)
 
-        if (client_data->incoming_data_size == 0) {
-            bufferevent_write0(bev, "257 block received\n");
-            client_data->state = STATE_PUT;
-        }
-    }
-    else {
-        char *line, *args;
+// Which states each command is allowed in. A multiplexed session's streams
+// upload while it is authenticated, so it takes BLOCK and SAVE then too.
+static const struct
+{
+    void (*handler)(struct client_data_t *client_data, struct bufferevent *bev, char *args);
+    unsigned int states;
+    unsigned int multiplexed_states;
+} dispatch[COMMAND_COUNT] = {
+    [COMMAND_QUIT] = { command_quit, ANY_STATE, ANY_STATE },
+    [COMMAND_USER] = { command_user, IN(STATE_INIT), IN(STATE_INIT) },
+    [COMMAND_PASS] = { command_pass, IN(STATE_WAITING_FOR_PASSWORD), IN(STATE_WAITING_FOR_PASSWORD) },
+    [COMMAND_PIPELINE] = { command_pipeline, IN(STATE_AUTHENTICATED) | IN(STATE_PUT), IN(STATE_AUTHENTICATED) | IN(STATE_PUT) },
+    [COMMAND_MULTIPLEX] = { command_multiplex, IN(STATE_AUTHENTICATED), 0 },
+    [COMMAND_PUT] = { command_put, IN(STATE_AUTHENTICATED), IN(STATE_AUTHENTICATED) },
+    [COMMAND_MPUT] = { command_mput, IN(STATE_AUTHENTICATED), IN(STATE_AUTHENTICATED) },
+    [COMMAND_GET] = { command_get, IN(STATE_AUTHENTICATED), IN(STATE_AUTHENTICATED) },
+    [COMMAND_LIST] = { command_list, IN(STATE_AUTHENTICATED), IN(STATE_AUTHENTICATED) },
+    [COMMAND_VERSIONS] = { command_versions, IN(STATE_AUTHENTICATED), IN(STATE_AUTHENTICATED) },
+    [COMMAND_DELTA] = { command_delta, IN(STATE_AUTHENTICATED), IN(STATE_AUTHENTICATED) },
+    [COMMAND_SIGNATURE] = { command_signature, IN(STATE_AUTHENTICATED), IN(STATE_AUTHENTICATED) },
+    [COMMAND_RESUME] = { command_resume, IN(STATE_AUTHENTICATED), IN(STATE_AUTHENTICATED) },
+    [COMMAND_BLOCK] = { command_block, IN(STATE_PUT), IN(STATE_PUT) | IN(STATE_AUTHENTICATED) },
+    [COMMAND_SAVE] = { command_save, IN(STATE_PUT), IN(STATE_PUT) | IN(STATE_AUTHENTICATED) },
+};
 
-        while ((line = evbuffer_readline(in))) {
-            args = line;
-            while (*args && *args != ' ') {
-                *args = toupper(*args);
-                args++;
+static void ssl_readcb(struct bufferevent *bev, void *data)
+{
+    struct evbuffer *in = bufferevent_get_input(bev);
+    struct client_data_t *client_data = (struct client_data_t *)data;
+    char line[MAX_COMMAND_LENGTH + 1], *args;
+    enum command command;
+    unsigned int states;
+    int n;
+
+    // Commands, BLOCK payloads and the files in an MPUT batch may arrive back
+    // to back, so keep going until the input buffer runs dry.
+    while (client_data->state != STATE_CLOSING && client_data->state != STATE_OPENING && client_data->state != STATE_SENDING && client_data->state != STATE_SAVING) {
+        if (client_data->state == STATE_DATA) {
+            // A multiplexed stream's BLOCK can arrive before its file is
+            // open, and the upload's compressor, disk writes or delta, or
+            // the session as a whole, may need to catch up. Stop reading
+            // until they do; upload_ready(), compression_cb, block_written
+            // or delta_continue() picks up again from here. The same goes
+            // for the server as a whole, which wait_for_memory() watches.
+            struct upload_t *upload = client_data->upload;
+            if (upload && upload->opening) {
+                client_data->backlogged = upload;
+                bufferevent_disable(bev, EV_READ);
+                return;
             }
-            if (*args) *(args++) = 0;
 
-            if (!strcmp(line, "QUIT")) {
-                bufferevent_write0(bev, "221 bye\n");
-                free_client_data(client_data);
-                bufferevent_free(bev);
+            if (receive_block_data(client_data, in) == -1) {
+                system_error(bev, client_data);
+                return;
             }
 
-            else if (!strcmp(line, "USER") && client_data->state == STATE_INIT) {
-                command_user(client_data, bev, args);
+            if (upload && session_backlogged(client_data, upload)) {
+                client_data->backlogged = upload;
+                bufferevent_disable(bev, EV_READ);
+                return;
             }
 
-            else if (!strcmp(line, "PASS") && client_data->state == STATE_WAITING_FOR_PASSWORD) {
-                command_pass(client_data, bev, args);
+            if (client_data->incoming_data_size > 0 && over_memory_budget()) {
+                if (wait_for_memory(client_data) != 0) system_error(bev, client_data);
+                return;
             }
 
-            else if (!strcmp(line, "PUT") && client_data->state == STATE_AUTHENTICATED) {
-                command_put(client_data, bev, args);
+            if (client_data->incoming_data_size > 0) {
+                zerocopy_start(client_data, bev);
+                return;
             }
 
-            else if (!strcmp(line, "BLOCK") && client_data->state == STATE_PUT) {
-                command_block(client_data, bev, args);
-            }
+            block_received(client_data, bev);
+            continue;
+        }
 
-            else if (!strcmp(line, "SAVE") && client_data->state == STATE_PUT) {
-                command_save(client_data, bev, args);
+        if (client_data->state == STATE_BATCH) {
+            if (receive_batch_data(client_data, in) == -1) {
+                system_error(bev, client_data);
+                return;
+            }
+            if (client_data->batch->remaining > 0) {
+                if (over_memory_budget() && wait_for_memory(client_data) != 0) system_error(bev, client_data);
+                break;
             }
 
-            else {
-                bufferevent_write0(bev, "500 unknown command or inappropriate command for current state\n");
+            if (client_data->batch->entries == client_data->batch->count) {
+                batch_received(client_data, bev);
+                continue;
             }
         }
+
+        if (client_data->state == STATE_BATCH) n = read_command_line(in, line, sizeof(line));
+        else n = read_command(in, line, sizeof(line), &command, &args);
+        if (n == 0) break;
+        if (n == -1) {
+            bufferevent_write0(bev, "500 command line is too long, disconnecting\n");
+            close_client(bev, client_data);
+            return;
+        }
+
+        if (client_data->state == STATE_BATCH) {
+            batch_entry(client_data, bev, line);
+            continue;
+        }
+
+        // Acknowledge pipelined blocks before answering anything else so that
+        // responses stay in order.
+        if (command != COMMAND_BLOCK) send_block_acknowledgement(client_data, bev);
+
+        // Replies about streams would land in the middle of the file.
+        states = client_data->multiplexed ? dispatch[command].multiplexed_states : dispatch[command].states;
+        if (command == COMMAND_GET && client_data->stream_count > 0) states = 0;
+
+        if (states & IN(client_data->state)) {
+            dispatch[command].handler(client_data, bev, args);
+        }
+        else {
+            bufferevent_write0(bev, "500 unknown command or inappropriate command for current state\n");
+            if (client_data->pipelined && command == COMMAND_BLOCK) close_client(bev, client_data);
+        }
     }
+
+    if (client_data->state != STATE_CLOSING) send_block_acknowledgement(client_data, bev);
 }
 
 static void ssl_errorcb(struct bufferevent *bev, short what, void *data)
 {
     struct client_data_t *client_data = (struct client_data_t *)data;
 
+    if (what & BEV_EVENT_CONNECTED) {
+        client_data->handshake_done = 1;
+        METRIC_OBSERVE(handshake, metrics_now() - client_data->accepted_at);
+        if (SSL_session_reused(bufferevent_openssl_get_ssl(bev))) METRIC_INC(handshakes_resumed);
+        else METRIC_INC(handshakes_full);
+    }
+
     if (what & (BEV_EVENT_EOF | BEV_EVENT_ERROR)) {
-        free_client_data(client_data);
+        if (!client_data->handshake_done) METRIC_INC(handshake_failures);
+
+        // Likewise a client that said goodbye properly; see close_writecb.
+        if (what & BEV_EVENT_EOF) SSL_shutdown(bufferevent_openssl_get_ssl(bev)); // ignore result
+        park_client_data(client_data);
+        bufferevent_free(bev);
     }
 }
 
 static void ssl_acceptcb(struct evconnlistener *serv, int sock, struct sockaddr *sa, int sa_len, void *arg)
 {
-    struct event_base *evbase;
+    struct worker_t *worker;
     struct bufferevent *bev;
-    SSL_CTX *server_ctx;
     SSL *client_ctx;
     struct client_data_t *client_data;
 
-    server_ctx = (SSL_CTX *)arg;
-    client_ctx = SSL_new(server_ctx);
-    evbase = evconnlistener_get_base(serv);
+    worker = (struct worker_t *)arg;
+    client_ctx = SSL_new(worker->ssl_ctx);
 
-    client_data = (struct client_data_t *)malloc(sizeof(struct client_data_t));
+    // Replies are often a short line followed by more data, which Nagle's
+    // algorithm would hold back until the client acknowledged the line.
+    int one = 1;
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    client_data = new_client_data();
     assert(client_data);
-    memset(client_data, 0, sizeof(struct client_data_t));
     client_data->sock = sock;
+    client_data->worker = worker;
+    client_data->accepted_at = metrics_now();
+    METRIC_INC(connections_accepted);
 
+    // Thread-safe because rate limit groups are shared between workers.
     bev = bufferevent_openssl_socket_new(
-            evbase, sock, client_ctx,
+            worker->evbase, sock, client_ctx,
             BUFFEREVENT_SSL_ACCEPTING,
-            BEV_OPT_CLOSE_ON_FREE);
+            BEV_OPT_CLOSE_ON_FREE | BEV_OPT_THREADSAFE);
+    client_data->bev = bev;
+    budget_watch(bufferevent_get_input(bev));
 
     bufferevent_write0(bev, "220 boat server\n");
 
@@ -119,7 +232,45 @@ static SSL_CTX *evssl_init(void)
     SSL_load_error_strings();
     SSL_library_init();
 
-    server_ctx = SSL_CTX_new(TLSv1_server_method());
+    server_ctx = SSL_CTX_new(TLS_server_method());
+    if (server_ctx == NULL) return NULL;
+
+    // TLS 1.2 and up, and for 1.2 only ECDHE key exchange with AEAD
+    // ciphers; all of TLS 1.3's suites are like that already. ChaCha20 goes
+    // first for clients that put it first, which are the ones without AES
+    // instructions.
+    SSL_CTX_set_min_proto_version(server_ctx, TLS1_2_VERSION);
+    if (!SSL_CTX_set_cipher_list(server_ctx, "ECDHE+AESGCM:ECDHE+CHACHA20")) {
+        fprintf(stderr, "Couldn't set the SSL cipher list\n");
+        return NULL;
+    }
+    SSL_CTX_set_options(server_ctx, SSL_OP_CIPHER_SERVER_PREFERENCE | SSL_OP_PRIORITIZE_CHACHA | SSL_OP_NO_RENEGOTIATION);
+
+    // Backup clients reconnect every hour or so, and a resumed session
+    // skips the key exchange and certificate signature. Clients that take
+    // tickets resume from those; the rest from the session cache. Every
+    // worker shares the one SSL_CTX, so both work whichever worker a client
+    // lands on next time.
+    SSL_CTX_set_session_id_context(server_ctx, (const unsigned char *)"boatd", 5);
+    SSL_CTX_set_timeout(server_ctx, configuration.ssl_session_timeout);
+    if (configuration.ssl_session_cache_size) {
+        SSL_CTX_set_session_cache_mode(server_ctx, SSL_SESS_CACHE_SERVER);
+        SSL_CTX_sess_set_cache_size(server_ctx, configuration.ssl_session_cache_size);
+    }
+    else {
+        SSL_CTX_set_session_cache_mode(server_ctx, SSL_SESS_CACHE_OFF);
+    }
+    if (!configuration.ssl_ticket_key_lifetime) {
+        SSL_CTX_set_options(server_ctx, SSL_OP_NO_TICKET);
+    }
+    else if (session_tickets_init(server_ctx) != 0) {
+        fprintf(stderr, "Couldn't set up SSL session tickets\n");
+        return NULL;
+    }
+
+    // Kernel TLS only engages for ciphers the kernel implements; connections
+    // that don't get it use the ordinary userspace path.
+    if (configuration.zero_copy_uploads || configuration.zero_copy_downloads) SSL_CTX_set_options(server_ctx, SSL_OP_ENABLE_KTLS);
 
     if (!SSL_CTX_use_certificate_chain_file(server_ctx, configuration.ssl_cert_file)) {
         fprintf(stderr, "Couldn't load SSL cert file '%s'\n", configuration.ssl_cert_file);
@@ -134,22 +285,108 @@ static SSL_CTX *evssl_init(void)
     return server_ctx;
 }
 
+static void janitor_cb(evutil_socket_t fd, short what, void *arg)
+{
+    expire_parked_uploads();
+}
+
+static void ticket_key_cb(evutil_socket_t fd, short what, void *arg)
+{
+    if (session_tickets_rotate() != 0) fprintf(stderr, "could not make a new session ticket key; keeping the old one\n");
+}
+
+static char *config_file;
+static struct worker_t *workers;
+
+// Re-reads the configuration file and swaps in its users. Sessions that have
+// already logged in carry on with the user records they have. Other
+// settings only take effect on restart.
+static void reload_cb(evutil_socket_t sig, short what, void *arg)
+{
+    struct configuration_t fresh;
+    int i;
+
+    memset(&fresh, 0, sizeof(fresh));
+    if (load_configuration(&fresh, config_file) != 0 || make_user_directories(fresh.head_user) != 0) {
+        fprintf(stderr, "could not reload configuration; keeping the existing users\n");
+        if (fresh.head_user) user_table_release(user_table_new(fresh.head_user));
+    }
+    else {
+        install_user_table(user_table_new(fresh.head_user), workers, configuration.worker_threads);
+    }
+
+    free(fresh.listen_address);
+    free(fresh.repository_root);
+    free(fresh.ssl_key_file);
+    free(fresh.ssl_cert_file);
+    free(fresh.replica_ca_file);
+    for (i = 0; i < fresh.replica_count; i++) free(fresh.replicas[i]);
+}
+
+static void *worker_thread(void *arg)
+{
+    struct worker_t *worker = (struct worker_t *)arg;
+
+    thread_metrics = &worker->metrics;
+    event_base_loop(worker->evbase, 0);
+
+    return NULL;
+}
+
 int main(int argc, char **argv)
 {
     SSL_CTX *ctx;
-    struct evconnlistener *listener;
-    struct event_base *evbase;
     struct sockaddr_in sin;
+    struct user_configuration_t *user;
+    int i;
 
     memset(&configuration, 0, sizeof(configuration));
     configuration.listen_address = "0.0.0.0";
     configuration.listen_port = 8235;
     configuration.repository_root = "/var/lib/boat";
-
-    if (load_configuration(argc == 1 ? NULL : argv[1]) != 0) return 1;
+    configuration.worker_threads = 1;
+    configuration.io_uring = 1;
+    configuration.disk_threads = 4;
+    configuration.group_commit_window = 5;
+    configuration.retention_interval = 3600;
+    configuration.retention_rate = 100;
+    configuration.ssl_session_cache_size = 20480;
+    configuration.ssl_session_timeout = 7200;
+    configuration.ssl_ticket_key_lifetime = 43200;
+    configuration.session_buffer_budget = 32 * 1024 * 1024;
+    configuration.memory_budget = 1024 * 1024 * 1024;
+
+    config_file = argc == 1 ? "/etc/boat.conf" : argv[1];
+    if (load_configuration(&configuration, config_file) != 0) return 1;
 
     make_directories();
 
+    // A client that hangs up while a reply is on its way must not take the
+    // server down with it.
+    signal(SIGPIPE, SIG_IGN);
+
+    // Catalogs that are missing are rebuilt from their repositories before
+    // any client can ask for one.
+    for (user = configuration.head_user; user; user = user->next) {
+        if (catalog_open(user->repository) == NULL) {
+            fprintf(stderr, "could not open the catalog for repository %s\n", user->repository);
+            return 1;
+        }
+    }
+
+    install_user_table(user_table_new(configuration.head_user), NULL, 0);
+    configuration.head_user = configuration.tail_user = NULL;
+
+    // Workers hand work to each other's event bases (see users.c), and the
+    // pools raise events on them.
+    evthread_use_pthreads();
+
+    if (pool_start(&compression_pool, configuration.compression_threads ? configuration.compression_threads : sysconf(_SC_NPROCESSORS_ONLN)) != 0) return 1;
+    if (pool_start(&disk_pool, configuration.disk_threads) != 0) return 1;
+    if (configuration.durable_saves && disk_start_group_commit(configuration.group_commit_window) != 0) return 1;
+    if (configuration.retention_interval && retention_start() != 0) return 1;
+    if (replication_start() != 0) return 1;
+
     memset(&sin, 0, sizeof(sin));
     sin.sin_family = AF_INET;
     sin.sin_port = htons(configuration.listen_port);
@@ -161,15 +398,88 @@ int main(int argc, char **argv)
 
     ctx = evssl_init();
     if (ctx == NULL) return 1;
-    evbase = event_base_new();
-    listener = evconnlistener_new_bind(
-            evbase, ssl_acceptcb, (void *)ctx,
-            LEV_OPT_CLOSE_ON_FREE | LEV_OPT_REUSEABLE, 1024,
-            (struct sockaddr *)&sin, sizeof(sin));
 
-    event_base_loop(evbase, 0);
+    workers = (struct worker_t *)calloc(configuration.worker_threads, sizeof(struct worker_t));
+    assert(workers);
+
+    // Bind every listener up front so that a bad address is reported before
+    // any thread starts.
+    for (i = 0; i < configuration.worker_threads; i++) {
+        workers[i].id = i;
+        workers[i].ssl_ctx = ctx;
+        workers[i].evbase = event_base_new();
+        assert(workers[i].evbase);
+        workers[i].listener = evconnlistener_new_bind(
+                workers[i].evbase, ssl_acceptcb, (void *)&workers[i],
+                LEV_OPT_CLOSE_ON_FREE | LEV_OPT_REUSEABLE | LEV_OPT_REUSEABLE_PORT, 1024,
+                (struct sockaddr *)&sin, sizeof(sin));
+        if (workers[i].listener == NULL) {
+            fprintf(stderr, "could not listen on %s port %d\n", configuration.listen_address, configuration.listen_port);
+            return 1;
+        }
+        if (disk_init(&workers[i].disk, workers[i].evbase, configuration.io_uring) != 0) {
+            fprintf(stderr, "could not set up disk I/O for worker %d\n", i);
+            return 1;
+        }
+    }
+
+    if (configuration.io_uring && workers[0].disk.ring_fd == -1) {
+        fprintf(stderr, "io_uring is not available; file operations will use %d disk threads\n", configuration.disk_threads);
+    }
+
+    if (rate_limit_init(workers[0].evbase) != 0) {
+        fprintf(stderr, "could not set up the rate limit\n");
+        return 1;
+    }
+
+    // Abandoned resumable uploads are swept up once a minute.
+    struct event *janitor = NULL;
+    if (configuration.resume_timeout) {
+        struct timeval interval = { 60, 0 };
+        janitor = event_new(workers[0].evbase, -1, EV_PERSIST, janitor_cb, NULL);
+        assert(janitor);
+        event_add(janitor, &interval);
+    }
 
-    evconnlistener_free(listener);
+    // Session tickets are issued under a new key every 'ssl ticket key
+    // lifetime'.
+    struct event *ticket_keys = NULL;
+    if (configuration.ssl_ticket_key_lifetime) {
+        struct timeval interval = { configuration.ssl_ticket_key_lifetime, 0 };
+        ticket_keys = event_new(workers[0].evbase, -1, EV_PERSIST, ticket_key_cb, NULL);
+        assert(ticket_keys);
+        event_add(ticket_keys, &interval);
+    }
+
+    if (configuration.metrics_port && metrics_listen(workers[0].evbase, workers, configuration.worker_threads) != 0) {
+        fprintf(stderr, "could not listen for metrics on 127.0.0.1 port %d\n", configuration.metrics_port);
+        return 1;
+    }
+
+    struct event *reload = evsignal_new(workers[0].evbase, SIGHUP, reload_cb, NULL);
+    assert(reload);
+    evsignal_add(reload, NULL);
+
+    // Worker 0 runs on the main thread.
+    for (i = 1; i < configuration.worker_threads; i++) {
+        if (pthread_create(&workers[i].thread, NULL, worker_thread, &workers[i]) != 0) {
+            fprintf(stderr, "could not start worker thread %d\n", i);
+            return 1;
+        }
+    }
+
+    worker_thread(&workers[0]);
+
+    for (i = 1; i < configuration.worker_threads; i++) pthread_join(workers[i].thread, NULL);
+    if (janitor) event_free(janitor);
+    if (ticket_keys) event_free(ticket_keys);
+    event_free(reload);
+    for (i = 0; i < configuration.worker_threads; i++) {
+        evconnlistener_free(workers[i].listener);
+        disk_free(&workers[i].disk);
+        event_base_free(workers[i].evbase);
+    }
+    free(workers);
     SSL_CTX_free(ctx);
 
     return 0;
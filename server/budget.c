@@ -0,0 +1,68 @@
+#include <event2/bufferevent.h>
+#include <event2/event.h>
+
+#include "budget.h"
+#include "configuration.h"
+#include "metrics.h"
+#include "worker.h"
+
+// A session waiting for memory looks again this often.
+#define MEMORY_WAIT_MS 10
+
+atomic_llong buffered_bytes = 0;
+
+static void watched_buffer_cb(struct evbuffer *buffer, const struct evbuffer_cb_info *info, void *arg)
+{
+    buffered_add((long long)info->n_added - (long long)info->n_deleted);
+}
+
+// Counts what goes in and out of `buffer` towards buffered_bytes.
+void budget_watch(struct evbuffer *buffer)
+{
+    evbuffer_add_cb(buffer, watched_buffer_cb, NULL);
+}
+
+// Stops counting a buffer that is about to be freed, which takes whatever
+// is left in it out of the count; freeing doesn't call the callback.
+void budget_unwatch(struct evbuffer *buffer)
+{
+    evbuffer_remove_cb(buffer, watched_buffer_cb, NULL);
+    buffered_add(-(long long)evbuffer_get_length(buffer));
+}
+
+// Sessions stop reading while the server as a whole holds more than its
+// 'memory budget' of client data, and start again once it is down to three
+// quarters of that. Each session also has a budget of its own; see
+// session_backlogged().
+int over_memory_budget(void)
+{
+    return configuration.memory_budget && atomic_load_explicit(&buffered_bytes, memory_order_relaxed) > configuration.memory_budget;
+}
+
+static void memory_wait_cb(evutil_socket_t fd, short what, void *arg)
+{
+    struct client_data_t *client_data = (struct client_data_t *)arg;
+    struct bufferevent *bev = client_data->bev;
+    struct timeval wait = { 0, MEMORY_WAIT_MS * 1000 };
+
+    if (atomic_load_explicit(&buffered_bytes, memory_order_relaxed) > configuration.memory_budget / 4 * 3) {
+        event_add(client_data->memory_event, &wait);
+        return;
+    }
+
+    bufferevent_enable(bev, EV_READ);
+    if (evbuffer_get_length(bufferevent_get_input(bev)) > 0) bufferevent_trigger(bev, EV_READ, BEV_TRIG_DEFER_CALLBACKS);
+}
+
+// Stops reading from a session until the server is back under three
+// quarters of its memory budget. Returns -1 if it can't.
+int wait_for_memory(struct client_data_t *client_data)
+{
+    struct timeval wait = { 0, MEMORY_WAIT_MS * 1000 };
+
+    if (client_data->memory_event == NULL && (client_data->memory_event = evtimer_new(client_data->worker->evbase, memory_wait_cb, client_data)) == NULL) return -1;
+
+    bufferevent_disable(client_data->bev, EV_READ);
+    METRIC_INC(memory_waits);
+    return event_add(client_data->memory_event, &wait);
+}
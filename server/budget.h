@@ -0,0 +1,23 @@
+#ifndef __BUDGET_H
+#define __BUDGET_H
+
+#include <stdatomic.h>
+#include <event2/buffer.h>
+#include "client_data.h"
+
+// Client data held in memory, in bytes: what is sitting in sessions' input
+// buffers and MPUT batches, and what uploads have received but not yet
+// compressed, applied or written. Every worker adds to it.
+extern atomic_llong buffered_bytes;
+
+static inline void buffered_add(long long n)
+{
+    atomic_fetch_add_explicit(&buffered_bytes, n, memory_order_relaxed);
+}
+
+void budget_watch(struct evbuffer *buffer);
+void budget_unwatch(struct evbuffer *buffer);
+int over_memory_budget(void);
+int wait_for_memory(struct client_data_t *client_data);
+
+#endif
@@ -0,0 +1,481 @@
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "catalog.h"
+#include "chunk_store.h"
+#include "compress.h"
+#include "configuration.h"
+#include "utils.h"
+
+_Static_assert(sizeof(struct catalog_record_t) == CATALOG_RECORD_SIZE, "catalog records must be CATALOG_RECORD_SIZE bytes");
+
+// Address space reserved for a catalog's mapping to begin with. The file
+// only needs to cover the records in use, and the mapping is doubled when
+// they outgrow it.
+#define CATALOG_INITIAL_MAP (16 * 1024 * 1024)
+
+// Catalogs with more removed records than this, and more of them than
+// live ones, are compacted when they are opened.
+#define CATALOG_COMPACT_MINIMUM 4096
+
+static pthread_mutex_t catalogs_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct catalog_t *catalogs = NULL;
+
+static off_t record_offset(uint32_t index)
+{
+    return (off_t)(index + 1) * CATALOG_RECORD_SIZE;
+}
+
+static struct catalog_record_t *catalog_record(struct catalog_t *catalog, uint32_t index)
+{
+    return (struct catalog_record_t *)(catalog->map + record_offset(index));
+}
+
+// Versions are named <pid>.<counter>.<time>.<filename>. Splits one into its
+// version id, which GET accepts as a version, its time and its filename.
+// Returns -1 if `name` isn't a version.
+static int parse_version_name(const char *name, struct catalog_record_t *record)
+{
+    const char *p = name, *field = NULL;
+    int i;
+
+    for (i = 0; i < 3; i++) {
+        field = p;
+        while (*p >= '0' && *p <= '9') p++;
+        if (p == field || *p != '.') return -1;
+        p++;
+    }
+
+    size_t length = p - name - 1;
+    if (length >= sizeof(record->version) || !*p || strlen(p) > MAX_FILENAME_LENGTH) return -1;
+
+    memcpy(record->version, name, length);
+    record->version[length] = 0;
+    record->saved_at = strtoll(field, NULL, 10);
+    strcpy(record->filename, p);
+    return 0;
+}
+
+// Finds `filename` in the catalog's sorted list of files, or where it would
+// go if it isn't there.
+static uint32_t find_file(struct catalog_t *catalog, const char *filename, int *found)
+{
+    uint32_t low = 0, high = catalog->file_count;
+
+    *found = 0;
+    while (low < high) {
+        uint32_t middle = low + (high - low) / 2;
+        int n = strcmp(catalog_record(catalog, catalog->files[middle])->filename, filename);
+        if (n == 0) {
+            *found = 1;
+            return middle;
+        }
+        if (n < 0) low = middle + 1;
+        else high = middle;
+    }
+    return low;
+}
+
+static int insert_file(struct catalog_t *catalog, uint32_t position, uint32_t index)
+{
+    if (catalog->file_count == catalog->file_capacity) {
+        uint32_t capacity = catalog->file_capacity ? catalog->file_capacity * 2 : 1024;
+        uint32_t *files = (uint32_t *)realloc(catalog->files, capacity * sizeof(uint32_t));
+        if (files == NULL) return -1;
+        catalog->files = files;
+        catalog->file_capacity = capacity;
+    }
+
+    memmove(&catalog->files[position + 1], &catalog->files[position], (catalog->file_count - position) * sizeof(uint32_t));
+    catalog->files[position] = index;
+    catalog->file_count++;
+    return 0;
+}
+
+// Makes sure the mapping covers `length` bytes of the file.
+static int map_catalog(struct catalog_t *catalog, size_t length)
+{
+    size_t mapped = catalog->mapped ? catalog->mapped : CATALOG_INITIAL_MAP;
+    void *map;
+
+    while (mapped < length) mapped *= 2;
+    if (mapped == catalog->mapped) return 0;
+
+    if (catalog->map) map = mremap(catalog->map, catalog->mapped, mapped, MREMAP_MAYMOVE);
+    else map = mmap(NULL, mapped, PROT_READ, MAP_SHARED, catalog->fd, 0);
+    if (map == MAP_FAILED) return -1;
+
+    catalog->map = (char *)map;
+    catalog->mapped = mapped;
+    return 0;
+}
+
+static int compare_files(const void *a, const void *b, void *arg)
+{
+    struct catalog_t *catalog = (struct catalog_t *)arg;
+    return strcmp(catalog_record(catalog, *(const uint32_t *)a)->filename, catalog_record(catalog, *(const uint32_t *)b)->filename);
+}
+
+// Maps an existing catalog and indexes the latest version of each file,
+// which is the one no other record points back to and that hasn't been
+// removed. Returns -1 if the file isn't a catalog or is damaged.
+static int load_catalog(struct catalog_t *catalog)
+{
+    char header[sizeof(CATALOG_HEADER) - 1];
+    unsigned char *superseded;
+    struct stat st;
+    uint32_t i;
+
+    if (fstat(catalog->fd, &st) != 0 || st.st_size < CATALOG_RECORD_SIZE) return -1;
+    if (pread(catalog->fd, header, sizeof(header), 0) != sizeof(header) || memcmp(header, CATALOG_HEADER, sizeof(header))) return -1;
+
+    // A record that was being appended when the server stopped is dropped.
+    catalog->count = st.st_size / CATALOG_RECORD_SIZE - 1;
+    if (st.st_size % CATALOG_RECORD_SIZE && ftruncate(catalog->fd, (off_t)(catalog->count + 1) * CATALOG_RECORD_SIZE) != 0) return -1;
+    if (map_catalog(catalog, (size_t)(catalog->count + 1) * CATALOG_RECORD_SIZE) != 0) return -1;
+
+    superseded = (unsigned char *)calloc(catalog->count + 1, 1);
+    if (superseded == NULL) return -1;
+
+    for (i = 0; i < catalog->count; i++) {
+        struct catalog_record_t *record = catalog_record(catalog, i);
+        if (record->filename[MAX_FILENAME_LENGTH] || record->version[sizeof(record->version) - 1] || record->hash[DIGEST_HEX_LENGTH] ||
+                (record->previous != CATALOG_NONE && record->previous >= i)) {
+            free(superseded);
+            return -1;
+        }
+        if (record->previous != CATALOG_NONE) superseded[record->previous] = 1;
+        if (record->flags & CATALOG_REMOVED) catalog->removed++;
+    }
+
+    for (i = 0; i < catalog->count; i++) {
+        if (!superseded[i] && !(catalog_record(catalog, i)->flags & CATALOG_REMOVED) && insert_file(catalog, catalog->file_count, i) != 0) {
+            free(superseded);
+            return -1;
+        }
+    }
+    free(superseded);
+
+    qsort_r(catalog->files, catalog->file_count, sizeof(uint32_t), compare_files, catalog);
+    return 0;
+}
+
+static int compare_versions(const void *a, const void *b)
+{
+    const struct catalog_record_t *x = (const struct catalog_record_t *)a, *y = (const struct catalog_record_t *)b;
+    int n = strcmp(x->filename, y->filename);
+
+    if (n) return n;
+    if (x->saved_at != y->saved_at) return x->saved_at < y->saved_at ? -1 : 1;
+    return strverscmp(x->version, y->version);
+}
+
+// The size of the file a version holds, rather than of what's on disk.
+static int version_size(const char *path, unsigned long long *size)
+{
+    struct stat st;
+
+    if (is_compressed(path, size)) return 0;
+    if (is_manifest(path)) return manifest_length(configuration.repository_root, path, size);
+    if (stat(path, &st) != 0) return -1;
+    *size = st.st_size;
+    return 0;
+}
+
+// Writes a catalog for every version found in the repository to `path`.
+// Records are grouped by file, oldest first, so that each one's previous
+// version is the record before it.
+static int rebuild_catalog(const char *repository_path, const char *path)
+{
+    struct catalog_record_t *records = NULL, *grown;
+    size_t count = 0, capacity = 0, i;
+    char version_path[PATH_MAX], temp_path[PATH_MAX];
+    unsigned long long size;
+    struct dirent *entry;
+    int fd = -1;
+
+    DIR *dir = opendir(repository_path);
+    if (dir == NULL) return -1;
+
+    // Room for the header goes at the front.
+    while ((entry = readdir(dir))) {
+        if (count + 1 >= capacity) {
+            capacity = capacity ? capacity * 2 : 1024;
+            if ((grown = (struct catalog_record_t *)realloc(records, capacity * sizeof(struct catalog_record_t))) == NULL) goto error;
+            records = grown;
+        }
+
+        struct catalog_record_t *record = &records[count + 1];
+        memset(record, 0, sizeof(*record));
+        if (parse_version_name(entry->d_name, record) != 0) continue;
+        if (build_path(version_path, "%s/%s", repository_path, entry->d_name) != 0 || version_size(version_path, &size) != 0) continue;
+
+        record->size = size;
+        if (read_cached_digest(version_path, record->hash) != 0) *record->hash = 0;
+        count++;
+    }
+    closedir(dir);
+    dir = NULL;
+
+    if (count > 0) qsort(records + 1, count, sizeof(struct catalog_record_t), compare_versions);
+    for (i = 1; i <= count; i++) {
+        records[i].previous = i > 1 && !strcmp(records[i].filename, records[i - 1].filename) ? i - 2 : CATALOG_NONE;
+    }
+
+    if (records == NULL && (records = (struct catalog_record_t *)malloc(sizeof(struct catalog_record_t))) == NULL) goto error;
+    memset(records, 0, sizeof(struct catalog_record_t));
+    memcpy(records, CATALOG_HEADER, sizeof(CATALOG_HEADER) - 1);
+
+    if (build_path(temp_path, "%s.new", path) != 0) goto error;
+    if ((fd = open(temp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0640)) == -1) goto error;
+
+    size = (count + 1) * sizeof(struct catalog_record_t);
+    if (write_all(fd, (unsigned char *)records, size) != 0) goto error;
+    if (close(fd) != 0) {
+        fd = -1;
+        goto error;
+    }
+    fd = -1;
+
+    if (rename(temp_path, path) != 0) goto error;
+    free(records);
+    return 0;
+
+error:
+    if (dir) closedir(dir);
+    if (fd != -1) close(fd);
+    free(records);
+    return -1;
+}
+
+static void close_catalog(struct catalog_t *catalog)
+{
+    if (catalog->map) munmap(catalog->map, catalog->mapped);
+    if (catalog->fd != -1) close(catalog->fd);
+    catalog->map = NULL;
+    catalog->mapped = 0;
+    catalog->fd = -1;
+    catalog->count = 0;
+    catalog->removed = 0;
+    catalog->file_count = 0;
+}
+
+static struct catalog_t *open_catalog(const char *repository)
+{
+    char repository_path[PATH_MAX], path[PATH_MAX];
+    int attempt;
+
+    if (build_path(repository_path, "%s/%s", configuration.repository_root, repository) != 0 ||
+            build_path(path, "%s/%s", repository_path, CATALOG_NAME) != 0) return NULL;
+
+    struct catalog_t *catalog = (struct catalog_t *)calloc(1, sizeof(struct catalog_t));
+    if (catalog == NULL) return NULL;
+    strcpy(catalog->repository, repository);
+    pthread_rwlock_init(&catalog->lock, NULL);
+
+    for (attempt = 0; attempt < 2; attempt++) {
+        if ((catalog->fd = open(path, O_RDWR | O_CLOEXEC)) != -1) {
+            if (load_catalog(catalog) == 0) {
+                if (attempt > 0 || catalog->removed < CATALOG_COMPACT_MINIMUM || catalog->removed < catalog->count / 2) return catalog;
+                close_catalog(catalog);
+            }
+            else {
+                close_catalog(catalog);
+                fprintf(stderr, "catalog %s is damaged; rebuilding it\n", path);
+            }
+        }
+        else if (errno != ENOENT) {
+            break;
+        }
+
+        if (attempt == 0 && rebuild_catalog(repository_path, path) != 0) break;
+    }
+
+    close_catalog(catalog);
+    free(catalog->files);
+    pthread_rwlock_destroy(&catalog->lock);
+    free(catalog);
+    return NULL;
+}
+
+// Returns the catalog for a repository, which stays open for the life of
+// the server. One that is missing is rebuilt from the repository first, as
+// is one that is mostly records of removed versions.
+struct catalog_t *catalog_open(const char *repository)
+{
+    struct catalog_t *catalog;
+
+    pthread_mutex_lock(&catalogs_lock);
+    for (catalog = catalogs; catalog; catalog = catalog->next) {
+        if (!strcmp(catalog->repository, repository)) break;
+    }
+    if (catalog == NULL && (catalog = open_catalog(repository))) {
+        catalog->next = catalogs;
+        catalogs = catalog;
+    }
+    pthread_mutex_unlock(&catalogs_lock);
+
+    return catalog;
+}
+
+// Records a version that has just been saved under `version_name` in the
+// repository. The catalog is only an index, so callers can carry on if
+// this fails; deleting the file gets it rebuilt on restart.
+int catalog_add(struct catalog_t *catalog, const char *version_name, unsigned long long size, const char *hash)
+{
+    struct catalog_record_t record;
+    uint32_t position;
+    int found, n = -1;
+
+    memset(&record, 0, sizeof(record));
+    if (parse_version_name(version_name, &record) != 0) return -1;
+    record.size = size;
+    if (hash) strcpy(record.hash, hash);
+
+    pthread_rwlock_wrlock(&catalog->lock);
+
+    position = find_file(catalog, record.filename, &found);
+    record.previous = found ? catalog->files[position] : CATALOG_NONE;
+
+    off_t offset = record_offset(catalog->count);
+    if (map_catalog(catalog, offset + CATALOG_RECORD_SIZE) == 0 && pwrite(catalog->fd, &record, CATALOG_RECORD_SIZE, offset) == CATALOG_RECORD_SIZE) {
+        uint32_t index = catalog->count++;
+        if (found) {
+            catalog->files[position] = index;
+            n = 0;
+        }
+        else {
+            n = insert_file(catalog, position, index);
+        }
+    }
+
+    pthread_rwlock_unlock(&catalog->lock);
+    return n;
+}
+
+static void add_record(struct evbuffer *out, struct catalog_record_t *record, int with_filename)
+{
+    if (with_filename) evbuffer_add_printf(out, "%s ", record->filename);
+    evbuffer_add_printf(out, "%s %lld %llu %s\n", record->version, (long long)record->saved_at, (unsigned long long)record->size, *record->hash ? record->hash : "-");
+}
+
+// Adds a line to `out` for the latest version of each file whose name
+// starts with `prefix`, in order of filename. Returns the number of files.
+int catalog_list(struct catalog_t *catalog, const char *prefix, struct evbuffer *out)
+{
+    size_t length = strlen(prefix);
+    uint32_t i;
+    int found, n = 0;
+
+    pthread_rwlock_rdlock(&catalog->lock);
+    for (i = find_file(catalog, prefix, &found); i < catalog->file_count; i++) {
+        struct catalog_record_t *record = catalog_record(catalog, catalog->files[i]);
+        if (strncmp(record->filename, prefix, length)) break;
+        add_record(out, record, 1);
+        n++;
+    }
+    pthread_rwlock_unlock(&catalog->lock);
+
+    return n;
+}
+
+// Adds a line to `out` for each version of `filename`, newest first.
+// Returns the number of versions.
+int catalog_versions(struct catalog_t *catalog, const char *filename, struct evbuffer *out)
+{
+    uint32_t position, index;
+    int found, n = 0;
+
+    pthread_rwlock_rdlock(&catalog->lock);
+    position = find_file(catalog, filename, &found);
+    for (index = found ? catalog->files[position] : CATALOG_NONE; index != CATALOG_NONE; index = catalog_record(catalog, index)->previous) {
+        if (catalog_record(catalog, index)->flags & CATALOG_REMOVED) continue;
+        add_record(out, catalog_record(catalog, index), 0);
+        n++;
+    }
+    pthread_rwlock_unlock(&catalog->lock);
+
+    return n;
+}
+
+// Moves on to the file after `filename` in the catalog, copying its name
+// back into `filename` and its versions into `versions`, newest first; the
+// array is grown as needed. Pass an empty name to start at the first file.
+// Returns the number of versions, 0 once there are no more files, or -1.
+int catalog_next_file(struct catalog_t *catalog, char *filename, struct catalog_version_t **versions, uint32_t *capacity)
+{
+    struct catalog_version_t *grown;
+    uint32_t position, index;
+    int found, n = 0;
+
+    pthread_rwlock_rdlock(&catalog->lock);
+    position = find_file(catalog, filename, &found);
+    if (found) position++;
+
+    index = position < catalog->file_count ? catalog->files[position] : CATALOG_NONE;
+    if (index != CATALOG_NONE) strcpy(filename, catalog_record(catalog, index)->filename);
+
+    for (; index != CATALOG_NONE; index = catalog_record(catalog, index)->previous) {
+        struct catalog_record_t *record = catalog_record(catalog, index);
+        if (record->flags & CATALOG_REMOVED) continue;
+
+        if ((uint32_t)n == *capacity) {
+            uint32_t size = *capacity ? *capacity * 2 : 64;
+            if ((grown = (struct catalog_version_t *)realloc(*versions, size * sizeof(struct catalog_version_t))) == NULL) {
+                n = -1;
+                break;
+            }
+            *versions = grown;
+            *capacity = size;
+        }
+
+        (*versions)[n].index = index;
+        (*versions)[n].saved_at = record->saved_at;
+        strcpy((*versions)[n].version, record->version);
+        n++;
+    }
+    pthread_rwlock_unlock(&catalog->lock);
+
+    return n;
+}
+
+// Records that the version at `index` of `filename` has been deleted: the
+// record is flagged first and then left out of the file's history, so a
+// crash in between leaves a removed record that walks skip over. A file's
+// latest version can't be removed.
+int catalog_remove(struct catalog_t *catalog, const char *filename, uint32_t index)
+{
+    uint32_t position, successor, flags;
+    int found, n = -1;
+
+    pthread_rwlock_wrlock(&catalog->lock);
+
+    position = find_file(catalog, filename, &found);
+    successor = found ? catalog->files[position] : CATALOG_NONE;
+    if (successor == index) successor = CATALOG_NONE;
+    while (successor != CATALOG_NONE && catalog_record(catalog, successor)->previous != index) {
+        successor = catalog_record(catalog, successor)->previous;
+    }
+
+    if (successor != CATALOG_NONE) {
+        struct catalog_record_t *record = catalog_record(catalog, index);
+        flags = record->flags | CATALOG_REMOVED;
+        if (pwrite(catalog->fd, &flags, sizeof(flags), record_offset(index) + offsetof(struct catalog_record_t, flags)) == sizeof(flags) &&
+                pwrite(catalog->fd, &record->previous, sizeof(record->previous), record_offset(successor) + offsetof(struct catalog_record_t, previous)) == sizeof(record->previous)) {
+            catalog->removed++;
+            n = 0;
+        }
+    }
+
+    pthread_rwlock_unlock(&catalog->lock);
+    return n;
+}
@@ -0,0 +1,71 @@
+#ifndef __CATALOG_H
+#define __CATALOG_H
+
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <event2/buffer.h>
+#include "constants.h"
+#include "digest.h"
+
+#define CATALOG_NAME "catalog"
+#define CATALOG_HEADER "boat-catalog 1\n"
+#define CATALOG_RECORD_SIZE 256
+#define CATALOG_NONE UINT32_MAX
+
+// Flags for catalog records.
+#define CATALOG_REMOVED 1
+
+// One saved version. `previous` is the index of the same file's version
+// before this one, so a file's history can be walked without searching.
+// Records for versions the retention policy has removed are flagged and
+// unlinked from the history, and dropped when the catalog is next rebuilt.
+struct catalog_record_t
+{
+    uint64_t size;
+    int64_t saved_at;
+    uint32_t previous;
+    char version[36];
+    char hash[DIGEST_HEX_LENGTH + 1];
+    char filename[MAX_FILENAME_LENGTH + 1];
+    char padding[CATALOG_RECORD_SIZE - 8 - 8 - 4 - 36 - (DIGEST_HEX_LENGTH + 1) - (MAX_FILENAME_LENGTH + 1) - 4];
+    uint32_t flags;
+};
+
+// A version as handed to the retention pass by catalog_next_file().
+struct catalog_version_t
+{
+    uint32_t index;
+    int64_t saved_at;
+    char version[36];
+};
+
+// Each repository's versions are recorded in an append-only file of fixed
+// size records, after a header of the same size, which is mapped into
+// memory to answer queries. `files` holds the index of each filename's
+// latest record, sorted by filename, so LIST and VERSIONS only touch the
+// records they return. Saves append from the disk threads and queries read
+// from the event loops, under `lock`.
+struct catalog_t
+{
+    char repository[PATH_MAX];
+    int fd;
+    pthread_rwlock_t lock;
+    char *map;
+    size_t mapped;
+    uint32_t count;
+    uint32_t removed;
+    uint32_t *files;
+    uint32_t file_count;
+    uint32_t file_capacity;
+    struct catalog_t *next;
+};
+
+struct catalog_t *catalog_open(const char *repository);
+int catalog_add(struct catalog_t *catalog, const char *version_name, unsigned long long size, const char *hash);
+int catalog_list(struct catalog_t *catalog, const char *prefix, struct evbuffer *out);
+int catalog_versions(struct catalog_t *catalog, const char *filename, struct evbuffer *out);
+int catalog_next_file(struct catalog_t *catalog, char *filename, struct catalog_version_t **versions, uint32_t *capacity);
+int catalog_remove(struct catalog_t *catalog, const char *filename, uint32_t index);
+
+#endif
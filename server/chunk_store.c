@@ -0,0 +1,566 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <openssl/sha.h>
+#include <event2/buffer.h>
+
+#include "chunk_store.h"
+#include "format.h"
+#include "utils.h"
+
+// FastCDC masks for a 64KB average: a harder mask (17 bits) below the
+// average chunk size and an easier one (15 bits) above it pull chunk sizes
+// towards the average.
+#define MASK_SMALL 0x0005d9f003530000ULL
+#define MASK_LARGE 0x0005d95003530000ULL
+
+static unsigned long long gear[256];
+static pthread_once_t gear_once = PTHREAD_ONCE_INIT;
+static atomic_int chunk_counter = 0;
+
+// Held shared while a chunk is stored and exclusively by the garbage
+// collector; see store_chunk() and collect_chunks().
+static pthread_rwlock_t chunk_lock = PTHREAD_RWLOCK_WRITER_NONRECURSIVE_INITIALIZER_NP;
+static int collecting;
+
+// The table must be identical across runs or nothing would ever dedup
+// against chunks written by an earlier boatd, so it comes from a fixed seed.
+static void init_gear(void)
+{
+    unsigned long long seed = 0x626f617463646321ULL;
+    int i;
+
+    for (i = 0; i < 256; i++) {
+        unsigned long long z = (seed += 0x9e3779b97f4a7c15ULL);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        gear[i] = z ^ (z >> 31);
+    }
+}
+
+static void chunk_path(char *path, size_t size, const char *root, const char *hex)
+{
+    snprintf(path, size, "%s/chunks/%.2s/%s", root, hex, hex);
+}
+
+static void hex_digest(char *out, const unsigned char *digest)
+{
+    const char *hex = "0123456789abcdef";
+    int i;
+
+    for (i = 0; i < SHA256_DIGEST_LENGTH; i++) {
+        *(out++) = hex[digest[i] >> 4];
+        *(out++) = hex[digest[i] & 0xf];
+    }
+    *out = 0;
+}
+
+// Stores a chunk unless one with the same digest is already present, and
+// appends it to the manifest either way. New chunks are written under a
+// temporary name and renamed into place, so a reader never sees a partial
+// chunk and two sessions storing the same chunk at once don't conflict.
+//
+// Both happen under `chunk_lock`, so that once collect_chunks() has taken
+// it every chunk stored before is in its manifest. While a collection is
+// under way a chunk that is already present is touched instead of just
+// looked at, which keeps the sweep off it.
+static int store_chunk(struct chunker_t *chunker, const unsigned char *data, size_t length)
+{
+    unsigned char digest[SHA256_DIGEST_LENGTH];
+    char hex[SHA256_DIGEST_LENGTH * 2 + 1];
+    char path[4096], temp_path[4096], line[128];
+    struct stat buf;
+    int n;
+
+    SHA256(data, length, digest);
+    hex_digest(hex, digest);
+    chunk_path(path, sizeof(path), chunker->root, hex);
+
+    pthread_rwlock_rdlock(&chunk_lock);
+    n = collecting ? utimensat(AT_FDCWD, path, NULL, 0) : stat(path, &buf);
+    if (n == -1 && errno == ENOENT) {
+        snprintf(temp_path, sizeof(temp_path), "%s/tmp/chunk.%d.%d", chunker->root, getpid(), chunk_counter++);
+        int fd = open(temp_path, O_WRONLY | O_CREAT | O_EXCL, 0640);
+        if (fd != -1) {
+            n = write_all(fd, data, length);
+            if (close(fd) != 0 || (n == 0 && rename(temp_path, path) != 0)) n = -1;
+            if (n != 0) unlink(temp_path);
+        }
+    }
+
+    if (n == 0) {
+        int line_length = snprintf(line, sizeof(line), "%s %zu\n", hex, length);
+        n = write_all(chunker->manifest_fd, (unsigned char *)line, line_length);
+    }
+    pthread_rwlock_unlock(&chunk_lock);
+    return n;
+}
+
+static int emit_chunk(struct chunker_t *chunker, size_t length)
+{
+    if (store_chunk(chunker, chunker->buffer, length) != 0) return -1;
+
+    memmove(chunker->buffer, chunker->buffer + length, chunker->length - length);
+    chunker->length -= length;
+    chunker->scanned = 0;
+    chunker->fingerprint = 0;
+    return 0;
+}
+
+struct chunker_t *chunker_new(const char *root, int manifest_fd)
+{
+    pthread_once(&gear_once, init_gear);
+
+    struct chunker_t *chunker = (struct chunker_t *)malloc(sizeof(struct chunker_t));
+    if (chunker == NULL) return NULL;
+    chunker->root = root;
+
+    if (chunker_reset(chunker, manifest_fd) != 0) {
+        free(chunker);
+        return NULL;
+    }
+    return chunker;
+}
+
+// Starts a new manifest, so that a chunker can be reused for another upload.
+int chunker_reset(struct chunker_t *chunker, int manifest_fd)
+{
+    chunker->manifest_fd = manifest_fd;
+    chunker->length = 0;
+    chunker->scanned = 0;
+    chunker->fingerprint = 0;
+
+    if (set_version_format(manifest_fd, FORMAT_MANIFEST) != 0) return -1;
+    return write_all(manifest_fd, (unsigned char *)MANIFEST_HEADER, strlen(MANIFEST_HEADER));
+}
+
+void chunker_free(struct chunker_t *chunker)
+{
+    free(chunker);
+}
+
+size_t chunker_space(struct chunker_t *chunker)
+{
+    return CHUNK_MAX_SIZE - chunker->length;
+}
+
+unsigned char *chunker_tail(struct chunker_t *chunker)
+{
+    return chunker->buffer + chunker->length;
+}
+
+// Called after `added` bytes have been copied to chunker_tail(). Stores
+// every chunk whose boundary falls in the buffered data.
+int chunker_update(struct chunker_t *chunker, size_t added)
+{
+    chunker->length += added;
+
+    for (;;) {
+        size_t i = chunker->scanned;
+        unsigned long long fingerprint = chunker->fingerprint;
+        size_t boundary = 0;
+
+        // No chunk is ever cut below the minimum size, so don't hash there.
+        if (i < CHUNK_MIN_SIZE) i = CHUNK_MIN_SIZE;
+
+        for (; i < chunker->length; i++) {
+            fingerprint = (fingerprint << 1) + gear[chunker->buffer[i]];
+            if (!(fingerprint & (i < CHUNK_AVERAGE_SIZE ? MASK_SMALL : MASK_LARGE))) {
+                boundary = i + 1;
+                break;
+            }
+        }
+
+        if (boundary == 0 && chunker->length == CHUNK_MAX_SIZE) boundary = CHUNK_MAX_SIZE;
+
+        if (boundary == 0) {
+            chunker->scanned = i;
+            chunker->fingerprint = fingerprint;
+            return 0;
+        }
+
+        if (emit_chunk(chunker, boundary) != 0) return -1;
+    }
+}
+
+// Stores whatever is left over as the final chunk.
+int chunker_finish(struct chunker_t *chunker)
+{
+    if (chunker->length == 0) return 0;
+    return emit_chunk(chunker, chunker->length);
+}
+
+int make_chunk_directories(const char *root)
+{
+    char path[4096];
+    int i;
+
+    snprintf(path, sizeof(path), "%s/chunks", root);
+    if (mkdir(path, 0770) == -1 && errno != EEXIST) return -1;
+
+    for (i = 0; i < 256; i++) {
+        snprintf(path, sizeof(path), "%s/chunks/%02x", root, i);
+        if (mkdir(path, 0770) == -1 && errno != EEXIST) return -1;
+    }
+
+    return 0;
+}
+
+int is_manifest(const char *path)
+{
+    return version_format(path) == FORMAT_MANIFEST;
+}
+
+// Chunk ids become paths, so anything but a full lowercase hex digest is
+// refused.
+static int valid_chunk_id(const char *hex)
+{
+    return strlen(hex) == SHA256_DIGEST_LENGTH * 2 && strspn(hex, "0123456789abcdef") == SHA256_DIGEST_LENGTH * 2;
+}
+
+// Opens a manifest and reads past its header.
+static FILE *open_manifest(const char *path)
+{
+    char line[128];
+
+    FILE *manifest = fopen(path, "r");
+    if (manifest == NULL) return NULL;
+
+    if (fgets(line, sizeof(line), manifest) == NULL || strcmp(line, MANIFEST_HEADER)) {
+        fclose(manifest);
+        errno = EINVAL;
+        return NULL;
+    }
+    return manifest;
+}
+
+// Reads the path and length of the next chunk of a manifest. Returns 1 if
+// there was one, 0 at the end of the manifest, or -1 if it is malformed.
+static int next_manifest_chunk(FILE *manifest, const char *root, char *chunk, size_t size, size_t *length)
+{
+    char line[128], hex[SHA256_DIGEST_LENGTH * 2 + 1];
+
+    if (fgets(line, sizeof(line), manifest) == NULL) return 0;
+    if (sscanf(line, "%64s %zu", hex, length) != 2 || !valid_chunk_id(hex) || *length > CHUNK_MAX_SIZE) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    chunk_path(chunk, size, root, hex);
+    return 1;
+}
+
+// Calls `callback` with the path and length of each chunk of a manifest, in
+// order, stopping early if it returns non-zero.
+int each_manifest_chunk(const char *root, const char *path, manifest_chunk_callback callback, void *arg)
+{
+    char chunk[4096];
+    size_t length;
+    int n = 0, more = 0;
+
+    FILE *manifest = open_manifest(path);
+    if (manifest == NULL) return -1;
+
+    while (n == 0 && (more = next_manifest_chunk(manifest, root, chunk, sizeof(chunk), &length)) == 1) n = callback(chunk, length, arg);
+    if (n == 0 && more == -1) n = -1;
+
+    fclose(manifest);
+    return n;
+}
+
+static int add_chunk_length(const char *chunk, size_t length, void *arg)
+{
+    *(unsigned long long *)arg += length;
+    return 0;
+}
+
+// Works out the size of the file a manifest describes.
+int manifest_length(const char *root, const char *path, unsigned long long *length)
+{
+    *length = 0;
+    return each_manifest_chunk(root, path, add_chunk_length, length);
+}
+
+static int copy_chunk(const char *chunk, size_t length, void *arg)
+{
+    int out_fd = *(int *)arg;
+    unsigned char buffer[65536];
+
+    int fd = open(chunk, O_RDONLY);
+    if (fd == -1) return -1;
+
+    while (length > 0) {
+        ssize_t n = read(fd, buffer, length < sizeof(buffer) ? length : sizeof(buffer));
+        if (n <= 0 || write_all(out_fd, buffer, n) != 0) {
+            if (n == 0) errno = EINVAL;
+            close(fd);
+            return -1;
+        }
+        length -= n;
+    }
+
+    close(fd);
+    return 0;
+}
+
+// Reassembles the file a manifest describes and writes it to out_fd.
+int materialize_manifest(const char *root, const char *path, int out_fd)
+{
+    return each_manifest_chunk(root, path, copy_chunk, &out_fd);
+}
+
+struct manifest_reader_t *manifest_reader_open(const char *root, const char *path, unsigned long long offset, unsigned long long length)
+{
+    struct manifest_reader_t *reader = (struct manifest_reader_t *)calloc(1, sizeof(struct manifest_reader_t));
+    if (reader == NULL) return NULL;
+
+    if ((reader->manifest = open_manifest(path)) == NULL) {
+        free(reader);
+        return NULL;
+    }
+
+    reader->root = root;
+    reader->fd = -1;
+    reader->skip = offset;
+    reader->remaining = length;
+    return reader;
+}
+
+// Appends up to `limit` more bytes of the range to `out`, from one chunk.
+// Returns the number added, 0 once the whole range has been produced, or -1
+// if the manifest or a chunk it names is missing, unreadable or too short.
+// Like decompressor_read(), it returns -1 with errno EAGAIN if it has read
+// MANIFEST_SKIP_LIMIT lines without getting to the start of the range.
+int manifest_reader_read(struct manifest_reader_t *reader, struct evbuffer *out, size_t limit)
+{
+    char chunk[4096];
+    struct evbuffer_iovec vec;
+    struct stat buf;
+    size_t length;
+    int skipped = 0;
+    ssize_t n;
+
+    if (reader->remaining == 0) return 0;
+
+    while (reader->fd == -1) {
+        if ((n = next_manifest_chunk(reader->manifest, reader->root, chunk, sizeof(chunk), &length)) != 1) {
+            if (n == 0) errno = EINVAL;
+            return -1;
+        }
+        if (reader->skip >= length) {
+            reader->skip -= length;
+            if (++skipped == MANIFEST_SKIP_LIMIT) {
+                errno = EAGAIN;
+                return -1;
+            }
+            continue;
+        }
+
+        // A chunk cut short would leave the client waiting for the rest.
+        if ((reader->fd = open(chunk, O_RDONLY)) == -1) return -1;
+        if (fstat(reader->fd, &buf) == -1 || (size_t)buf.st_size < length) {
+            close(reader->fd);
+            reader->fd = -1;
+            errno = EINVAL;
+            return -1;
+        }
+        reader->chunk_offset = reader->skip;
+        reader->chunk_remaining = length - reader->skip;
+        reader->skip = 0;
+    }
+
+    if (limit > reader->chunk_remaining) limit = reader->chunk_remaining;
+    if (limit > reader->remaining) limit = reader->remaining;
+    if (evbuffer_reserve_space(out, limit, &vec, 1) < 1) return -1;
+    if ((n = pread(reader->fd, vec.iov_base, limit, reader->chunk_offset)) <= 0) {
+        if (n == 0) errno = EINVAL;
+        return -1;
+    }
+    vec.iov_len = n;
+    if (evbuffer_commit_space(out, &vec, 1) != 0) return -1;
+
+    reader->chunk_offset += n;
+    reader->chunk_remaining -= n;
+    reader->remaining -= n;
+    if (reader->chunk_remaining == 0) {
+        close(reader->fd);
+        reader->fd = -1;
+    }
+    return n;
+}
+
+void manifest_reader_free(struct manifest_reader_t *reader)
+{
+    if (reader->fd != -1) close(reader->fd);
+    fclose(reader->manifest);
+    free(reader);
+}
+
+// Chunks are marked by the first 64 bits of their id, which is plenty to
+// tell them apart; a collision only keeps a chunk that could have gone.
+struct chunk_marks_t
+{
+    const char *root;
+    char chunks_path[4096], tmp_path[4096]; // as nftw() spells them
+    uint64_t *ids;
+    size_t count;
+    size_t capacity;
+};
+
+// nftw() has no way to pass this to its callback. Only the retention
+// thread collects chunks.
+static struct chunk_marks_t *marking;
+
+static uint64_t chunk_id_prefix(const char *hex)
+{
+    char prefix[17];
+
+    memcpy(prefix, hex, 16);
+    prefix[16] = 0;
+    return strtoull(prefix, NULL, 16);
+}
+
+static int mark_chunk(const char *chunk, size_t length, void *arg)
+{
+    struct chunk_marks_t *marks = (struct chunk_marks_t *)arg;
+
+    if (marks->count == marks->capacity) {
+        size_t capacity = marks->capacity ? marks->capacity * 2 : 65536;
+        uint64_t *ids = (uint64_t *)realloc(marks->ids, capacity * sizeof(uint64_t));
+        if (ids == NULL) return -1;
+        marks->ids = ids;
+        marks->capacity = capacity;
+    }
+
+    marks->ids[marks->count++] = chunk_id_prefix(strrchr(chunk, '/') + 1);
+    return 0;
+}
+
+// Marks the chunks of every manifest in the repositories. The chunk store
+// has nothing to mark, and the temporary files have been done already. No
+// repository may share their names; see 'user repository'.
+static int mark_manifest(const char *path, const struct stat *st, int type, struct FTW *ftw)
+{
+    if (type == FTW_D && (!strcmp(path, marking->chunks_path) || !strcmp(path, marking->tmp_path))) return FTW_SKIP_SUBTREE;
+    if (type != FTW_F || !is_manifest(path)) return FTW_CONTINUE;
+
+    // A version may be removed under us, but a manifest that can't be
+    // read might still need its chunks, so nothing is collected.
+    if (each_manifest_chunk(marking->root, path, mark_chunk, marking) != 0 && errno != ENOENT) return FTW_STOP;
+    return FTW_CONTINUE;
+}
+
+// Marks the chunks of the manifests uploads are still writing. Their last
+// line may be only partly written, but any chunk it names was stored after
+// the collection started, so the sweep leaves it alone anyway.
+static int mark_temporary_manifests(struct chunk_marks_t *marks)
+{
+    char path[4096];
+    struct dirent *entry;
+    int n = 0;
+
+    snprintf(path, sizeof(path), "%s/tmp", marks->root);
+    DIR *dir = opendir(path);
+    if (dir == NULL) return errno == ENOENT ? 0 : -1;
+
+    while (n == 0 && (entry = readdir(dir))) {
+        snprintf(path, sizeof(path), "%s/tmp/%s", marks->root, entry->d_name);
+        if (entry->d_name[0] == '.' || !is_manifest(path)) continue;
+
+        size_t count = marks->count;
+        if (each_manifest_chunk(marks->root, path, mark_chunk, marks) != 0 && marks->count == count && errno == ENOMEM) n = -1;
+    }
+
+    closedir(dir);
+    return n;
+}
+
+static int compare_ids(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+// Removes the chunks that no manifest uses any more, calling `pace` before
+// every CHUNK_SWEEP_BATCH of them. Every chunk named by a manifest in the
+// repositories or an upload's temporary file is marked, and the rest are
+// swept, unless they have been stored or used since the collection began.
+// store_chunk() touches the chunks it reuses meanwhile, and each removal
+// checks the time under `chunk_lock`, so a chunk an upload has just found
+// is never taken from under it. Returns -1 if the marking couldn't be
+// finished, in which case nothing is removed.
+int collect_chunks(const char *root, void (*pace)(void), unsigned long long *removed)
+{
+    struct chunk_marks_t marks = { root, "", "", NULL, 0, 0 };
+    size_t root_length = strlen(root);
+    char path[4096];
+    struct timespec started;
+    struct dirent *entry;
+    struct stat st;
+    unsigned long long candidates = 0;
+    int i, n;
+
+    *removed = 0;
+    snprintf(path, sizeof(path), "%s/chunks", root);
+    if (stat(path, &st) != 0) return errno == ENOENT ? 0 : -1;
+
+    // File times come from a clock that can lag a tick behind this one,
+    // hence the second's grace in the sweep.
+    clock_gettime(CLOCK_REALTIME, &started);
+    pthread_rwlock_wrlock(&chunk_lock);
+    collecting = 1;
+    pthread_rwlock_unlock(&chunk_lock);
+
+    // nftw() drops the root's trailing slashes from the paths it builds.
+    while (root_length > 0 && root[root_length - 1] == '/') root_length--;
+    snprintf(marks.chunks_path, sizeof(marks.chunks_path), "%.*s/chunks", (int)root_length, root);
+    snprintf(marks.tmp_path, sizeof(marks.tmp_path), "%.*s/tmp", (int)root_length, root);
+
+    // Uploads move their manifests out of the temporary directory, so that
+    // goes first; a manifest moved while it is read is then still found.
+    marking = &marks;
+    n = mark_temporary_manifests(&marks);
+    if (n == 0) n = nftw(root, mark_manifest, 16, FTW_PHYS | FTW_ACTIONRETVAL) == 0 ? 0 : -1;
+    marking = NULL;
+    if (n != 0) goto done;
+
+    qsort(marks.ids, marks.count, sizeof(uint64_t), compare_ids);
+
+    for (i = 0; i < 256 && n == 0; i++) {
+        snprintf(path, sizeof(path), "%s/chunks/%02x", root, i);
+        DIR *dir = opendir(path);
+        if (dir == NULL) continue;
+
+        while ((entry = readdir(dir))) {
+            if (!valid_chunk_id(entry->d_name)) continue;
+            uint64_t id = chunk_id_prefix(entry->d_name);
+            if (bsearch(&id, marks.ids, marks.count, sizeof(uint64_t), compare_ids)) continue;
+
+            if (candidates++ % CHUNK_SWEEP_BATCH == 0) pace();
+            chunk_path(path, sizeof(path), root, entry->d_name);
+            pthread_rwlock_wrlock(&chunk_lock);
+            if (stat(path, &st) == 0 && st.st_mtime < started.tv_sec - 1 && unlink(path) == 0) (*removed)++;
+            pthread_rwlock_unlock(&chunk_lock);
+        }
+        closedir(dir);
+    }
+
+done:
+    pthread_rwlock_wrlock(&chunk_lock);
+    collecting = 0;
+    pthread_rwlock_unlock(&chunk_lock);
+    free(marks.ids);
+    return n;
+}
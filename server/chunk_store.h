@@ -0,0 +1,72 @@
+#ifndef __CHUNK_STORE_H
+#define __CHUNK_STORE_H
+
+#include <stddef.h>
+#include <stdio.h>
+#include <sys/types.h>
+
+#include <event2/buffer.h>
+
+#define CHUNK_MIN_SIZE 16384
+#define CHUNK_AVERAGE_SIZE 65536
+#define CHUNK_MAX_SIZE 262144
+
+// Garbage collection hands back to its caller this often while sweeping.
+#define CHUNK_SWEEP_BATCH 64
+
+#define MANIFEST_HEADER "boat-manifest 1\n"
+
+// Splits a byte stream into content-defined chunks (FastCDC with normalised
+// chunking), so that an insertion or deletion only changes the chunks around
+// it. Data is appended directly into the chunker's buffer; each complete
+// chunk is stored under <root>/chunks and recorded in the manifest.
+struct chunker_t
+{
+    const char *root;
+    int manifest_fd;
+    unsigned char buffer[CHUNK_MAX_SIZE];
+    size_t length;
+    size_t scanned;
+    unsigned long long fingerprint;
+};
+
+struct chunker_t *chunker_new(const char *root, int manifest_fd);
+int chunker_reset(struct chunker_t *chunker, int manifest_fd);
+void chunker_free(struct chunker_t *chunker);
+size_t chunker_space(struct chunker_t *chunker);
+unsigned char *chunker_tail(struct chunker_t *chunker);
+int chunker_update(struct chunker_t *chunker, size_t added);
+int chunker_finish(struct chunker_t *chunker);
+
+int make_chunk_directories(const char *root);
+int is_manifest(const char *path);
+typedef int (*manifest_chunk_callback)(const char *chunk, size_t length, void *arg);
+
+int each_manifest_chunk(const char *root, const char *path, manifest_chunk_callback callback, void *arg);
+int manifest_length(const char *root, const char *path, unsigned long long *length);
+int materialize_manifest(const char *root, const char *path, int out_fd);
+
+// At most this many lines of a manifest before the range being read back
+// are gone through in one go.
+#define MANIFEST_SKIP_LIMIT 4096
+
+// Streams `length` bytes from `offset` of the file a manifest describes, a
+// piece at a time, with at most one of its chunks open at once.
+struct manifest_reader_t
+{
+    const char *root;
+    FILE *manifest;
+    int fd;
+    off_t chunk_offset;
+    size_t chunk_remaining;
+    unsigned long long skip;
+    unsigned long long remaining;
+};
+
+struct manifest_reader_t *manifest_reader_open(const char *root, const char *path, unsigned long long offset, unsigned long long length);
+int manifest_reader_read(struct manifest_reader_t *reader, struct evbuffer *out, size_t limit);
+void manifest_reader_free(struct manifest_reader_t *reader);
+
+int collect_chunks(const char *root, void (*pace)(void), unsigned long long *removed);
+
+#endif
@@ -1,17 +1,154 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <openssl/ssl.h>
+#include <event2/buffer.h>
+#include <event2/bufferevent_ssl.h>
+#include <event2/event.h>
+#include "budget.h"
+#include "chunk_store.h"
 #include "client_data.h"
+#include "compress.h"
+#include "delta.h"
+#include "metrics.h"
+#include "ratelimit.h"
+#include "users.h"
+#include "utils.h"
+#include "zerocopy.h"
 
-void free_client_data(struct client_data_t *client_data)
+// Sessions are recycled through a per-thread free list. A session never
+// leaves the worker that accepted it, so no locking is needed. Recycled
+// sessions keep their splice pipe, if they made one.
+#define MAX_FREE_SESSIONS 256
+
+static __thread struct client_data_t *free_sessions = NULL;
+static __thread int free_session_count = 0;
+
+struct client_data_t *new_client_data(void)
 {
-    if (client_data->fd) close(client_data->fd);
-    if (client_data->temp_path) {
-        unlink(client_data->temp_path); // ignore result
-        free(client_data->temp_path);
+    struct client_data_t *client_data = free_sessions;
+    int pipe_fds[2] = { 0, 0 };
+
+    if (client_data) {
+        free_sessions = client_data->next_free;
+        free_session_count--;
+        pipe_fds[0] = client_data->pipe_fds[0];
+        pipe_fds[1] = client_data->pipe_fds[1];
+    }
+    else {
+        client_data = (struct client_data_t *)malloc(sizeof(struct client_data_t));
+        if (client_data == NULL) return NULL;
     }
-    if (client_data->filename) free(client_data->filename);
-    if (client_data->user) free(client_data->user);
+
     memset(client_data, 0, sizeof(struct client_data_t));
-    free(client_data);
+    client_data->pipe_fds[0] = pipe_fds[0];
+    client_data->pipe_fds[1] = pipe_fds[1];
+    return client_data;
+}
+
+struct upload_t **session_uploads(struct client_data_t *client_data, int *count)
+{
+    if (client_data->multiplexed) {
+        *count = MAX_STREAMS;
+        return client_data->streams;
+    }
+    *count = 1;
+    return &client_data->upload;
+}
+
+// Lets go of every upload the session has in progress. Only one the client
+// has been told about can be resumed, and one that is being saved has
+// already ended its compressed stream, or is on its way into the
+// repository. A delta upload can't be resumed either, since the client
+// would have no way of knowing how much of the delta had been applied.
+static void release_uploads(struct client_data_t *client_data, int park)
+{
+    struct upload_t **uploads, *upload;
+    int i, count;
+
+    uploads = session_uploads(client_data, &count);
+    for (i = 0; i < count; i++) {
+        if ((upload = uploads[i]) == NULL) continue;
+        uploads[i] = NULL;
+        upload_release(upload, park && upload->opened && !upload->saving && !upload->delta);
+    }
+    client_data->upload = NULL;
+    client_data->stream_count = 0;
+}
+
+void free_client_data(struct client_data_t *client_data)
+{
+    METRIC_INC(connections_closed);
+    zerocopy_stop(client_data);
+    release_uploads(client_data, 0);
+    if (client_data->batch) batch_release(client_data->batch);
+    if (client_data->signature) client_data->signature->client = NULL;
+    client_data->signature = NULL;
+    if (client_data->compress_event) event_free(client_data->compress_event);
+    if (client_data->restore) decompressor_free(client_data->restore);
+    if (client_data->restore_manifest) manifest_reader_free(client_data->restore_manifest);
+    if (client_data->memory_event) event_free(client_data->memory_event);
+    budget_unwatch(bufferevent_get_input(client_data->bev));
+    if (client_data->user) {
+        rate_limit_end(client_data);
+        user_table_release(client_data->user->table);
+    }
+
+    if (free_session_count >= MAX_FREE_SESSIONS) {
+        if (client_data->pipe_fds[0]) {
+            close(client_data->pipe_fds[0]);
+            close(client_data->pipe_fds[1]);
+        }
+        free(client_data);
+        return;
+    }
+
+    client_data->state = STATE_CLOSING;
+    client_data->next_free = free_sessions;
+    free_sessions = client_data;
+    free_session_count++;
+}
+
+// Used when the connection drops rather than when the session ends
+// deliberately: uploads in progress are kept so the client can resume them.
+void park_client_data(struct client_data_t *client_data)
+{
+    release_uploads(client_data, 1);
+    free_client_data(client_data);
+}
+
+// Ending with a close_notify, rather than just closing the socket, leaves
+// the session in the cache for the client to resume next time.
+static void close_writecb(struct bufferevent *bev, void *data)
+{
+    SSL_shutdown(bufferevent_openssl_get_ssl(bev)); // ignore result
+    free_client_data((struct client_data_t *)data);
+    bufferevent_free(bev);
+}
+
+static void close_errorcb(struct bufferevent *bev, short what, void *data)
+{
+    free_client_data((struct client_data_t *)data);
+    bufferevent_free(bev);
+}
+
+// Stops reading from the client and disconnects once everything already
+// written to it has been sent. The session is freed asynchronously, so
+// callers only need to stop touching it once its state is STATE_CLOSING.
+void close_client(struct bufferevent *bev, struct client_data_t *client_data)
+{
+    client_data->state = STATE_CLOSING;
+    zerocopy_stop(client_data);
+    bufferevent_disable(bev, EV_READ);
+    bufferevent_setcb(bev, NULL, close_writecb, close_errorcb, client_data);
+    bufferevent_enable(bev, EV_WRITE);
+
+    if (evbuffer_get_length(bufferevent_get_output(bev)) == 0) bufferevent_trigger(bev, EV_WRITE, BEV_TRIG_DEFER_CALLBACKS);
+}
+
+void system_error(struct bufferevent *bufev, struct client_data_t *client_data)
+{
+    METRIC_INC(system_errors);
+    bufferevent_write0(bufev, "599 system error occurred, disconnecting\n");
+    close_client(bufev, client_data);
 }
@@ -1,22 +1,58 @@
 #ifndef __CLIENT_DATA_H
 #define __CLIENT_DATA_H
 
+#include <stdint.h>
+#include <sys/types.h>
+#include <event2/bufferevent.h>
 #include "configuration.h"
+#include "constants.h"
+#include "batch.h"
+#include "upload.h"
 
-enum client_state { STATE_INIT = 0, STATE_WAITING_FOR_PASSWORD, STATE_AUTHENTICATED, STATE_PUT, STATE_DATA };
+enum client_state { STATE_INIT = 0, STATE_WAITING_FOR_PASSWORD, STATE_AUTHENTICATED, STATE_OPENING, STATE_PUT, STATE_DATA, STATE_BATCH, STATE_SENDING, STATE_SAVING, STATE_CLOSING };
 
 struct client_data_t
 {
     enum client_state state;
     int sock;
-    char *username;
-    char *temp_path;
-    char *filename;
+    struct bufferevent *bev;
+    char username[MAX_USERNAME_LENGTH + 1];
+    struct upload_t *upload;
     unsigned int incoming_data_size;
+    int pipelined;
+    int multiplexed;
+    struct upload_t *streams[MAX_STREAMS];
+    int stream_count;
     struct user_configuration_t *user;
-    int fd;
+    struct worker_t *worker;
+    int pipe_fds[2];
+    struct event *splice_event;
+    struct event *sendfile_event;
+    int send_fd;
+    off_t send_offset;
+    size_t send_remaining;
+    struct client_data_t *next_free;
+    uint64_t accepted_at;
+    int handshake_done;
+    unsigned int block_size;
+    uint64_t block_started;
+    struct event *compress_event;
+    struct upload_t *backlogged;
+    struct decompressor_t *restore;
+    struct manifest_reader_t *restore_manifest;
+    struct batch_t *batch;
+    struct signature_t *signature;
+    struct event *rate_event;
+    struct event *memory_event;
 };
 
+// In multiplexed mode `upload` is the stream whose BLOCK payload is being
+// received, if any, and every upload in progress is in `streams`.
+struct upload_t **session_uploads(struct client_data_t *client_data, int *count);
+struct client_data_t *new_client_data(void);
 void free_client_data(struct client_data_t *client_data);
+void park_client_data(struct client_data_t *client_data);
+void close_client(struct bufferevent *bev, struct client_data_t *client_data);
+void system_error(struct bufferevent *bufev, struct client_data_t *client_data);
 
 #endif
@@ -1,21 +1,38 @@
+#define _GNU_SOURCE
+#include <errno.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <unistd.h>
+#include <sys/uio.h>
 
 #include <openssl/hmac.h>
 #include <openssl/err.h>
 #include <openssl/bio.h>
 #include <openssl/evp.h>
 #include <openssl/rand.h>
+#include <event2/buffer.h>
 
+#include "budget.h"
+#include "catalog.h"
+#include "chunk_store.h"
 #include "commands.h"
 #include "constants.h"
 #include "client_data.h"
+#include "compress.h"
+#include "delta.h"
+#include "digest.h"
+#include "diskio.h"
+#include "metrics.h"
+#include "parser.h"
+#include "ratelimit.h"
+#include "replication.h"
+#include "upload.h"
+#include "users.h"
 #include "utils.h"
-
-static int upload_counter = 0;
+#include "zerocopy.h"
 
 void command_user(struct client_data_t *client_data, struct bufferevent *bev, char *args)
 {
@@ -24,8 +41,12 @@ void command_user(struct client_data_t *client_data, struct bufferevent *bev, ch
         return;
     }
 
-    if (client_data->user) free(client_data->user);
-    client_data->username = strdup(args);
+    if (strlen(args) > MAX_USERNAME_LENGTH) {
+        bufferevent_write0(bev, "510 username is too long\n");
+        return;
+    }
+
+    strcpy(client_data->username, args);
     client_data->state = STATE_WAITING_FOR_PASSWORD;
 
     bufferevent_write0(bev, "251 hi, password please\n");
@@ -38,159 +59,1888 @@ void command_pass(struct client_data_t *client_data, struct bufferevent *bev, ch
         return;
     }
 
-    struct user_configuration_t *user = configuration.head_user;
+    uint64_t started = metrics_now();
+    struct user_configuration_t *user = find_user(client_data->username);
     int success = 0;
 
-    // Find the user configuration record
-    while (user && strcmp(user->username, client_data->username)) user = user->next;
-
     if (user) {
         unsigned char server_password[EVP_MAX_MD_SIZE];
         unsigned int server_password_length;
 
         if (HMAC(EVP_sha256(), args, strlen(args), (unsigned char *)user->password, SALT_LENGTH, server_password, &server_password_length)) {
-            char *server_password_in_hex = binary_to_hex(server_password, server_password_length);
+            char server_password_in_hex[EVP_MAX_MD_SIZE * 2 + 1];
+            hex_encode(server_password_in_hex, server_password, server_password_length);
             success = !strcmp(user->password + SALT_LENGTH, server_password_in_hex);
-            free(server_password_in_hex);
         }
     }
 
     while (*args) *(args++) = 0;
+    METRIC_OBSERVE(pass, metrics_now() - started);
 
     if (success) {
-        bufferevent_write0(bev, "252 authenticated\n");
+        METRIC_INC(auth_successes);
         client_data->state = STATE_AUTHENTICATED;
         client_data->user = user;
+        if (rate_limit_session(client_data) != 0) {
+            system_error(bev, client_data);
+            return;
+        }
+        bufferevent_write0(bev, "252 authenticated\n");
     }
     else {
+        if (user) user_table_release(user->table);
+        METRIC_INC(auth_failures);
         bufferevent_write0(bev, "552 invalid password\n");
         client_data->state = STATE_INIT;
     }
 }
 
-void command_put(struct client_data_t *client_data, struct bufferevent *bev, char *args)
+// Picks up again with whatever the client sent while we weren't reading.
+static void resume_reading(struct bufferevent *bev)
 {
-    if (!*args) {
-        bufferevent_write0(bev, "510 must specify a filename\n");
+    bufferevent_enable(bev, EV_READ);
+    if (evbuffer_get_length(bufferevent_get_input(bev)) > 0) bufferevent_trigger(bev, EV_READ, BEV_TRIG_DEFER_CALLBACKS);
+}
+
+enum save_step { SAVE_WAITING = 0, SAVE_SETTLING, SAVE_SYNCING, SAVE_CLOSING, SAVE_HASHING, SAVE_RENAMING, SAVE_RECORDING, SAVE_LINKING, SAVE_REPLACING, SAVE_COMMITTING };
+
+static void save_continue(struct upload_t *upload, int result);
+static void delta_continue(struct upload_t *upload);
+
+// In multiplexed mode replies about an upload carry its stream id after the
+// response code.
+static void stream_write(struct bufferevent *bev, unsigned int stream_id, const char *response)
+{
+    if (stream_id == 0) {
+        bufferevent_write0(bev, response);
         return;
     }
 
-    if (strlen(args) > MAX_FILENAME_LENGTH) {
-        bufferevent_write0(bev, "510 filename is too long\n");
-        return;
+    char tagged[160];
+    snprintf(tagged, sizeof(tagged), "%.3s %u%s", response, stream_id, response + 3);
+    bufferevent_write0(bev, tagged);
+}
+
+// Takes the stream id off the front of a multiplexed session's PUT, RESUME,
+// BLOCK or SAVE. Leaves `stream_id` 0 for a session that isn't multiplexed.
+// Returns -1, having answered the client, if there isn't a valid one.
+static int parse_stream_id(struct client_data_t *client_data, struct bufferevent *bev, char **args, unsigned int *stream_id)
+{
+    unsigned long id = 0;
+    char *p = *args;
+
+    *stream_id = 0;
+    if (!client_data->multiplexed) return 0;
+
+    while (*p >= '0' && *p <= '9' && id <= MAX_STREAM_ID) id = id * 10 + (*(p++) - '0');
+    if (p == *args || (*p && *p != ' ') || id == 0 || id > MAX_STREAM_ID) {
+        bufferevent_write0(bev, "510 invalid stream id\n");
+        return -1;
     }
 
-    if (!valid_filename(args)) {
-        bufferevent_write0(bev, "510 invalid characters in filename\n");
-        return;
+    while (*p == ' ') p++;
+    *args = p;
+    *stream_id = id;
+    return 0;
+}
+
+static struct upload_t *find_stream(struct client_data_t *client_data, unsigned int stream_id)
+{
+    int i;
+
+    for (i = 0; i < MAX_STREAMS; i++) {
+        if (client_data->streams[i] && client_data->streams[i]->stream_id == stream_id) return client_data->streams[i];
     }
+    return NULL;
+}
+
+// Whether the upload's data is arriving faster than its compressor or disk
+// writes can keep up with.
+static int writes_backlogged(struct upload_t *upload)
+{
+    return (upload->compressor && compressor_pending(upload->compressor) > COMPRESS_HIGH_WATER) || upload->bytes_in_flight > DISK_WRITE_HIGH_WATER;
+}
+
+// Whether a session that stopped reading for the upload's sake can start
+// again.
+static int upload_caught_up(struct upload_t *upload)
+{
+    if (upload->compressor && compressor_pending(upload->compressor) > COMPRESS_LOW_WATER) return 0;
+    if (upload->delta && evbuffer_get_length(upload->delta->pending) > DELTA_LOW_WATER) return 0;
+    return upload->bytes_in_flight <= DISK_WRITE_LOW_WATER;
+}
+
+// Brings buffered_bytes up to date with what the upload is holding on to:
+// data waiting for its compressor, delta or disk writes. What has since
+// been compressed stays counted until the next time this is called.
+static void account_upload(struct upload_t *upload)
+{
+    size_t buffered = upload->bytes_in_flight;
+
+    if (upload->compressor) buffered += compressor_pending(upload->compressor);
+    if (upload->delta) buffered += evbuffer_get_length(upload->delta->pending);
+    buffered_add((long long)buffered - (long long)upload->buffered);
+    upload->buffered = buffered;
+}
+
+// What the session has received and not yet dealt with, in its input
+// buffer and all its uploads.
+static size_t session_buffered(struct client_data_t *client_data)
+{
+    struct upload_t **uploads;
+    size_t buffered = evbuffer_get_length(bufferevent_get_input(client_data->bev));
+    int i, count;
+
+    uploads = session_uploads(client_data, &count);
+    for (i = 0; i < count; i++) {
+        if (uploads[i]) buffered += uploads[i]->buffered;
+    }
+    return buffered;
+}
 
-    if (!client_data->user->versioning_enabled) {
-        char *path;
-        int n;
-        n = asprintf(&path, "%s/%s/current.%s", configuration.repository_root, client_data->user->repository, args);
-        if (n == -1 || path == NULL) {
+// Whether the session should stop reading until it catches up: `upload` is
+// past one of its high water marks, or the session as a whole is holding
+// more than its 'session buffer budget'.
+int session_backlogged(struct client_data_t *client_data, struct upload_t *upload)
+{
+    if (writes_backlogged(upload) || (upload->delta && evbuffer_get_length(upload->delta->pending) > DELTA_HIGH_WATER)) return 1;
+    return session_buffered(client_data) > (size_t)configuration.session_buffer_budget;
+}
+
+// Whether a session that stopped reading can start again: the upload it
+// stopped for has caught up, and the session is down to half its budget.
+// Any of its uploads making progress may be what gets it there.
+static int session_caught_up(struct client_data_t *client_data)
+{
+    struct upload_t *upload = client_data->backlogged;
+
+    if (upload->opening || !upload_caught_up(upload)) return 0;
+    return session_buffered(client_data) <= (size_t)configuration.session_buffer_budget / 2;
+}
+
+// Runs on the connection's event loop when one of its uploads' compressors
+// has caught up, finished the stream or failed.
+static void compression_cb(evutil_socket_t fd, short what, void *arg)
+{
+    struct bufferevent *bev = (struct bufferevent *)arg;
+    struct client_data_t *client_data;
+    struct upload_t **uploads, *upload;
+    int i, count, status;
+
+    bufferevent_getcb(bev, NULL, NULL, NULL, (void **)&client_data);
+
+    uploads = session_uploads(client_data, &count);
+    for (i = 0; i < count && client_data->state != STATE_CLOSING; i++) {
+        if ((upload = uploads[i]) == NULL || upload->compressor == NULL) continue;
+        account_upload(upload);
+
+        if ((status = compressor_status(upload->compressor)) == -1) {
             system_error(bev, client_data);
             return;
         }
 
-        struct stat buf;
-        if (stat(path, &buf) != -1 || errno != ENOENT) {
-            free(path);
-            bufferevent_write0(bev, "520 file already exists\n");
+        if (upload->delta && !upload->delta->applied) {
+            delta_continue(upload);
+        }
+        else if (upload->saving) {
+            if (status == 1 && upload->save_step == SAVE_WAITING) save_continue(upload, 0);
+        }
+        else if (client_data->backlogged && session_caught_up(client_data)) {
+            client_data->backlogged = NULL;
+            resume_reading(bev);
+        }
+    }
+}
+
+static int watch_compressor(struct upload_t *upload)
+{
+    struct client_data_t *client_data = upload->client;
+
+    if (upload->compressor == NULL) return 0;
+
+    if (client_data->compress_event == NULL) {
+        client_data->compress_event = event_new(client_data->worker->evbase, -1, 0, compression_cb, client_data->bev);
+        if (client_data->compress_event == NULL) return -1;
+    }
+
+    compressor_set_notify(upload->compressor, client_data->compress_event);
+    return 0;
+}
+
+// Starts a file operation on behalf of an upload, which it keeps hold of
+// until `done` has run.
+static struct disk_op_t *upload_op(struct upload_t *upload, enum disk_opcode opcode, void (*done)(struct disk_op_t *op))
+{
+    struct disk_op_t *op = disk_op_new(upload->disk, opcode, done, upload);
+    if (op) upload->ops_in_flight++;
+    return op;
+}
+
+// Checks that a multiplexed session can start an upload on `stream_id`.
+static int stream_available(struct client_data_t *client_data, struct bufferevent *bev, unsigned int stream_id)
+{
+    if (stream_id == 0) return 1;
+
+    if (find_stream(client_data, stream_id)) {
+        stream_write(bev, stream_id, "543 stream already in use\n");
+        return 0;
+    }
+    if (client_data->stream_count == MAX_STREAMS) {
+        stream_write(bev, stream_id, "544 too many streams\n");
+        return 0;
+    }
+    return 1;
+}
+
+// Gives the session an upload to work on with its disk engine. A classic
+// session stops reading until the upload's file is ready; a multiplexed one
+// carries on with its other streams.
+static void attach_upload(struct client_data_t *client_data, struct upload_t *upload, unsigned int stream_id)
+{
+    int i;
+
+    upload->client = client_data;
+    upload->disk = &client_data->worker->disk;
+    upload->stream_id = stream_id;
+    upload->unacknowledged_blocks = 0;
+    upload->opening = 1;
+
+    if (stream_id) {
+        for (i = 0; client_data->streams[i]; i++);
+        client_data->streams[i] = upload;
+        client_data->stream_count++;
+        return;
+    }
+
+    client_data->upload = upload;
+    client_data->state = STATE_OPENING;
+    bufferevent_disable(client_data->bev, EV_READ);
+}
+
+// Ends an upload with `response`, or with a system error if that's NULL:
+// either a PUT or RESUME that didn't get as far as 255, or a SAVE. A
+// multiplexed stream whose BLOCK payload is still arriving has the rest of
+// it thrown away.
+static void finish_upload(struct upload_t *upload, const char *response)
+{
+    struct client_data_t *client_data = upload->client;
+    unsigned int stream_id = upload->stream_id;
+    int i, paused = 1;
+
+    if (client_data && stream_id) {
+        for (i = 0; client_data->streams[i] != upload; i++);
+        client_data->streams[i] = NULL;
+        client_data->stream_count--;
+        if (client_data->upload == upload) client_data->upload = NULL;
+        paused = client_data->backlogged == upload;
+        if (paused) client_data->backlogged = NULL;
+    }
+    else if (client_data) {
+        client_data->upload = NULL;
+    }
+
+    upload_free(upload);
+    if (client_data == NULL || client_data->state == STATE_CLOSING) return;
+
+    if (response == NULL) {
+        system_error(client_data->bev, client_data);
+        return;
+    }
+
+    if (!stream_id) client_data->state = STATE_AUTHENTICATED;
+    stream_write(client_data->bev, stream_id, response);
+    if (paused) resume_reading(client_data->bev);
+}
+
+static void save_start(struct upload_t *upload);
+
+// Carries on once an upload's file is open and the client has been told. A
+// classic session starts reading again; a multiplexed one picks up a BLOCK
+// or SAVE that arrived for the stream in the meantime.
+static void upload_ready(struct upload_t *upload)
+{
+    struct client_data_t *client_data = upload->client;
+
+    upload->opening = 0;
+    if (upload->saving) {
+        save_start(upload);
+    }
+    else if (!upload->stream_id || client_data->backlogged == upload) {
+        client_data->backlogged = NULL;
+        resume_reading(client_data->bev);
+    }
+}
+
+// Runs on a disk thread.
+static int current_version_matches(void *arg)
+{
+    struct upload_t *upload = (struct upload_t *)arg;
+    return version_matches(upload->current_path, upload->expected_hash);
+}
+
+// Tells the client to go ahead with the upload.
+static void put_ready(struct upload_t *upload)
+{
+    struct client_data_t *client_data = upload->client;
+
+    if (!upload->stream_id) client_data->state = STATE_PUT;
+
+    if (*upload->token) {
+        char response[64];
+        snprintf(response, sizeof(response), "255 ok %s\n", upload->token);
+        stream_write(client_data->bev, upload->stream_id, response);
+    }
+    else {
+        stream_write(client_data->bev, upload->stream_id, "255 ok\n");
+    }
+    upload_ready(upload);
+}
+
+static void put_preallocated(struct disk_op_t *op)
+{
+    struct upload_t *upload = (struct upload_t *)op->arg;
+
+    if (op->result == 0) upload->preallocated = op->length;
+    if (upload_op_done(upload)) return;
+
+    // A filesystem that can't preallocate just goes without; one that is
+    // out of space turns the upload away before any of it is sent.
+    if (op->result == -ENOSPC || op->result == -EDQUOT || op->result == -EFBIG) {
+        finish_upload(upload, "551 not enough space for file\n");
+        return;
+    }
+    if (upload->client->state == STATE_CLOSING) return;
+    put_ready(upload);
+}
+
+static void put_opened(struct disk_op_t *op)
+{
+    struct upload_t *upload = (struct upload_t *)op->arg;
+
+    if (op->result >= 0) upload->fd = op->result;
+    if (upload_op_done(upload)) return;
+
+    if (op->result < 0 || upload_open(upload, upload->fd) != 0 || watch_compressor(upload) != 0) {
+        finish_upload(upload, NULL);
+        return;
+    }
+    if (upload->client->state == STATE_CLOSING) return;
+
+    // A file stored whole and uncompressed is allocated in one go when the
+    // client says how big it will be, so that it isn't scattered across
+    // the disk as it grows. Keeping the size as it is means a short upload
+    // still ends where the data does.
+    if (upload->expected_size && !upload->compressor && !upload->chunker) {
+        struct disk_op_t *fallocate_op = upload_op(upload, DISK_FALLOCATE, put_preallocated);
+        if (fallocate_op == NULL) {
+            finish_upload(upload, NULL);
             return;
         }
-        free(path);
+        fallocate_op->fd = upload->fd;
+        fallocate_op->flags = FALLOC_FL_KEEP_SIZE;
+        fallocate_op->offset = 0;
+        fallocate_op->length = upload->expected_size;
+        disk_submit(fallocate_op);
+        return;
+    }
+    put_ready(upload);
+}
+
+static void put_open(struct upload_t *upload)
+{
+    struct disk_op_t *op = upload_op(upload, DISK_OPEN, put_opened);
+    if (op == NULL) {
+        finish_upload(upload, NULL);
+        return;
     }
 
-    if (client_data->filename) free(client_data->filename);
-    client_data->filename = strdup(args);
-    client_data->state = STATE_PUT;
+    op->path = upload->temp_path;
+    op->flags = O_WRONLY | O_CREAT | O_CLOEXEC;
+    op->mode = 0640;
+    disk_submit(op);
+}
 
-    if (client_data->temp_path) free(client_data->temp_path);
-    int n;
-    n = asprintf(&(client_data->temp_path), "%s/tmp/%d.%d", configuration.repository_root, getpid(), upload_counter++);
-    if (n == -1 || client_data->temp_path == NULL) {
-        system_error(bev, client_data);
+static void put_checked_exists(struct disk_op_t *op)
+{
+    struct upload_t *upload = (struct upload_t *)op->arg;
+
+    if (upload_op_done(upload)) return;
+    if (op->result != -ENOENT) {
+        finish_upload(upload, "520 file already exists\n");
+        return;
+    }
+    put_open(upload);
+}
+
+static void put_check_exists(struct upload_t *upload)
+{
+    if (upload->user->versioning_enabled) {
+        put_open(upload);
         return;
     }
 
-    client_data->fd = open(client_data->temp_path, O_WRONLY|O_CREAT, 0640);
+    struct disk_op_t *op = upload_op(upload, DISK_STAT, put_checked_exists);
+    if (op == NULL) {
+        finish_upload(upload, NULL);
+        return;
+    }
 
-    bufferevent_write0(bev, "255 ok\n");
+    op->path = upload->current_path;
+    disk_submit(op);
 }
 
-void command_block(struct client_data_t *client_data, struct bufferevent *bev, char *args)
+static void put_checked_unchanged(struct disk_op_t *op)
+{
+    struct upload_t *upload = (struct upload_t *)op->arg;
+
+    if (upload_op_done(upload)) return;
+    if (op->result == 1) {
+        METRIC_INC(files_unchanged);
+        finish_upload(upload, "258 file unchanged\n");
+        return;
+    }
+    put_check_exists(upload);
+}
+
+// PUT [<stream>] <filename> [<sha256>] [<size>]
+//
+// Works through its checks and creating the temporary file one disk
+// operation at a time, so that the event loop never waits on the disk. A
+// classic session doesn't read anything else until it has answered.
+// A client that gives the size of the file gets the space for it up front.
+void command_put(struct client_data_t *client_data, struct bufferevent *bev, char *args)
 {
+    unsigned long long expected_size = 0;
+    unsigned int stream_id;
+
+    if (parse_stream_id(client_data, bev, &args, &stream_id) != 0) return;
+
     if (!*args) {
-        bufferevent_write0(bev, "510 must specify a block size\n");
+        stream_write(bev, stream_id, "510 must specify a filename\n");
         return;
     }
 
-    char *p = args;
-    while (*p) {
-        if (*p < '0' || *p > '9') {
-            bufferevent_write0(bev, "510 invalid block size\n");
+    // A hash is always 64 characters long, and no size is.
+    char *expected_hash = strchr(args, ' '), *size = NULL;
+    if (expected_hash) {
+        *(expected_hash++) = 0;
+        if ((size = strchr(expected_hash, ' ')) != NULL) {
+            *(size++) = 0;
+        }
+        else if (strlen(expected_hash) < DIGEST_HEX_LENGTH && strspn(expected_hash, "0123456789") == strlen(expected_hash)) {
+            size = expected_hash;
+            expected_hash = NULL;
+        }
+
+        if (expected_hash && !valid_digest(expected_hash)) {
+            stream_write(bev, stream_id, "510 invalid hash\n");
+            return;
+        }
+        if (size && parse_number(size, ULLONG_MAX, &expected_size) != 0) {
+            stream_write(bev, stream_id, "510 invalid size\n");
             return;
         }
-        p++;
     }
 
-    if (p - args > 9 || atoi(args) > MAX_BLOCK_SIZE) {
-        bufferevent_write0(bev, "510 invalid block size\n");
+    if (strlen(args) > MAX_FILENAME_LENGTH) {
+        stream_write(bev, stream_id, "510 filename is too long\n");
         return;
     }
 
-    client_data->state = STATE_DATA;
-    client_data->incoming_data_size = atoi(args);
-    bufferevent_write0(bev, "256 commence data upload\n");
+    if (!valid_filename(args)) {
+        stream_write(bev, stream_id, "510 invalid characters in filename\n");
+        return;
+    }
+
+    if (!stream_available(client_data, bev, stream_id)) return;
+
+    struct upload_t *upload = upload_new(client_data->user, args, expected_hash);
+    if (upload == NULL) {
+        system_error(bev, client_data);
+        return;
+    }
+    attach_upload(client_data, upload, stream_id);
+    upload->expected_size = expected_size;
+
+    // If the client told us the hash up front and it matches the current
+    // version, there is nothing to upload.
+    if (expected_hash) {
+        struct disk_op_t *op = upload_op(upload, DISK_CALL, put_checked_unchanged);
+        if (op == NULL) {
+            finish_upload(upload, NULL);
+            return;
+        }
+        op->call = current_version_matches;
+        disk_submit(op);
+        return;
+    }
+
+    put_check_exists(upload);
 }
 
-void command_save(struct client_data_t *client_data, struct bufferevent *bev, char *args)
+static int valid_version(const char *version)
 {
-    if (*args) {
-        bufferevent_write0(bev, "510 save does not take an argument\n");
+    if (!*version) return 0;
+    while (*version) {
+        if ((*version < '0' || *version > '9') && *version != '.') return 0;
+        version++;
+    }
+    return 1;
+}
+
+// GET <filename> [<version>|current [<offset> <length>]]
+//
+// Streams a stored file back to the client after a '260 <length>' line.
+// Versions are named by the prefix of their filename in the repository.
+// A byte range lets large restores be split across several connections.
+#define RESTORE_LOW_WATER (256 * 1024)
+#define RESTORE_HIGH_WATER (1024 * 1024)
+
+static int restore_read(struct client_data_t *client_data, struct evbuffer *out)
+{
+    if (client_data->restore) return decompressor_read(client_data->restore, out, 65536);
+    return manifest_reader_read(client_data->restore_manifest, out, 65536);
+}
+
+// Inflates more of a compressed version, or reads more of a deduplicated
+// one's chunks, each time the output buffer runs low, so that a large
+// restore never holds up the event loop for long or keeps many chunks open.
+static void restore_writecb(struct bufferevent *bev, void *data)
+{
+    struct client_data_t *client_data = (struct client_data_t *)data;
+    struct evbuffer *out = bufferevent_get_output(bev);
+    bufferevent_data_cb readcb;
+    bufferevent_event_cb eventcb;
+    int n = 1;
+
+    while (evbuffer_get_length(out) < RESTORE_HIGH_WATER && (n = restore_read(client_data, out)) > 0);
+
+    if (n == -1 && errno == EAGAIN) {
+        // Still on the way to the start of the range. Other connections get
+        // a turn before it carries on, even with nothing queued to drain.
+        bufferevent_trigger(bev, EV_WRITE, BEV_TRIG_IGNORE_WATERMARKS | BEV_TRIG_DEFER_CALLBACKS);
+        return;
+    }
+    if (n == -1) {
+        // The length has already been promised to the client, so the only
+        // way to report a failure is to hang up.
+        bufferevent_setwatermark(bev, EV_WRITE, 0, 0);
+        close_client(bev, client_data);
+        return;
+    }
+    if (n > 0) return;
+
+    if (client_data->restore) decompressor_free(client_data->restore);
+    if (client_data->restore_manifest) manifest_reader_free(client_data->restore_manifest);
+    client_data->restore = NULL;
+    client_data->restore_manifest = NULL;
+    client_data->state = STATE_AUTHENTICATED;
+
+    bufferevent_setwatermark(bev, EV_WRITE, 0, 0);
+    bufferevent_getcb(bev, &readcb, NULL, &eventcb, NULL);
+    bufferevent_setcb(bev, readcb, NULL, eventcb, client_data);
+    resume_reading(bev);
+}
+
+// Streams `length` bytes from `offset` of a compressed or deduplicated
+// version. Reading is paused until it has all been queued so that later
+// responses can't overtake it.
+static int restore_start(struct client_data_t *client_data, struct bufferevent *bev, const char *path, int manifest, unsigned long long offset, unsigned long long length)
+{
+    bufferevent_data_cb readcb;
+    bufferevent_event_cb eventcb;
+
+    if (manifest) client_data->restore_manifest = manifest_reader_open(configuration.repository_root, path, offset, length);
+    else client_data->restore = decompressor_open(path, offset, length);
+    if (client_data->restore == NULL && client_data->restore_manifest == NULL) return -1;
+
+    client_data->state = STATE_SENDING;
+    bufferevent_disable(bev, EV_READ);
+    bufferevent_setwatermark(bev, EV_WRITE, RESTORE_LOW_WATER, 0);
+    bufferevent_getcb(bev, &readcb, NULL, &eventcb, NULL);
+    bufferevent_setcb(bev, readcb, restore_writecb, eventcb, client_data);
+    restore_writecb(bev, client_data);
+    return 0;
+}
+
+void command_get(struct client_data_t *client_data, struct bufferevent *bev, char *args)
+{
+    char *filename, *version = NULL, *offset_arg = NULL, *length_arg = NULL;
+    unsigned long long offset = 0, length = 0, size;
+    int ranged = 0;
+
+    filename = strsep(&args, " ");
+    if (args) version = strsep(&args, " ");
+    if (args) offset_arg = strsep(&args, " ");
+    if (args) length_arg = strsep(&args, " ");
+
+    if (!*filename) {
+        bufferevent_write0(bev, "510 must specify a filename\n");
+        return;
+    }
+
+    if (strlen(filename) > MAX_FILENAME_LENGTH || !valid_filename(filename)) {
+        bufferevent_write0(bev, "510 invalid filename\n");
+        return;
+    }
+
+    if (version && strcmp(version, "current") && !valid_version(version)) {
+        bufferevent_write0(bev, "510 invalid version\n");
         return;
     }
 
-    close(client_data->fd);
-    client_data->fd = 0;
+    if (offset_arg) {
+        if (length_arg == NULL || args || parse_number(offset_arg, ULLONG_MAX, &offset) != 0 || parse_number(length_arg, ULLONG_MAX, &length) != 0) {
+            bufferevent_write0(bev, "510 invalid range\n");
+            return;
+        }
+        ranged = 1;
+    }
 
-    char *path;
+    char path[PATH_MAX];
     int n;
-    time_t now = time(NULL);
-    n = asprintf(&path, "%s/%s/%d.%d.%d.%s", configuration.repository_root, client_data->user->repository, getpid(), upload_counter++, (int)now, client_data->filename);
-    if (n == -1 || path == NULL) {
+    if (version == NULL || !strcmp(version, "current"))
+        n = build_path(path, "%s/%s/current.%s", configuration.repository_root, client_data->user->repository, filename);
+    else
+        n = build_path(path, "%s/%s/%s.%s", configuration.repository_root, client_data->user->repository, version, filename);
+    if (n != 0) {
         system_error(bev, client_data);
         return;
     }
 
-    n = rename(client_data->temp_path, path);
-    if (n == -1) {
-        system_error(bev, client_data);
+    int manifest = is_manifest(path);
+    int compressed = !manifest && is_compressed(path, &size);
+    int fd = -1;
+    if (manifest) {
+        n = manifest_length(configuration.repository_root, path, &size);
+    }
+    else if (compressed) {
+        n = 0;
+    }
+    else {
+        struct stat buf;
+        fd = open(path, O_RDONLY);
+        n = (fd == -1 || fstat(fd, &buf) == -1) ? -1 : 0;
+        if (n == 0) size = buf.st_size;
+    }
+
+    if (n != 0) {
+        if (fd != -1) close(fd);
+        bufferevent_write0(bev, errno == ENOENT ? "541 no such file or version\n" : "550 could not read file\n");
         return;
     }
 
-    char *current_symlink;
-    n = asprintf(&current_symlink, "%s/%s/current.%s", configuration.repository_root, client_data->user->repository, client_data->filename);
-    if (n == -1 || current_symlink == NULL) {
-        system_error(bev, client_data);
+    if (offset > size) {
+        if (fd != -1) close(fd);
+        bufferevent_write0(bev, "510 invalid range\n");
         return;
     }
+    if (!ranged || length > size - offset) length = size - offset;
 
-    unlink(current_symlink); // ignore return value
-    n = symlink(path, current_symlink);
-    if (n == -1) {
-        system_error(bev, client_data);
+    char response[64];
+    snprintf(response, sizeof(response), "260 %llu\n", length);
+    bufferevent_write0(bev, response);
+    METRIC_ADD(bytes_sent, length);
+
+    // From here on the client is reading data, so a failure can only be
+    // reported by hanging up once whatever was queued has gone.
+    if (compressed || manifest) {
+        if (length > 0 && restore_start(client_data, bev, path, manifest, offset, length) != 0) close_client(bev, client_data);
         return;
     }
 
-    free(current_symlink);
-    free(path);
+    if (length == 0) {
+        close(fd);
+        return;
+    }
 
-    client_data->state = STATE_AUTHENTICATED;
-    bufferevent_write0(bev, "259 file saved\n");
+    if (zerocopy_send_file(client_data, bev, fd, offset, length)) return;
+
+    struct evbuffer_file_segment *segment = evbuffer_file_segment_new(fd, offset, length, EVBUF_FS_CLOSE_ON_FREE);
+    if (segment == NULL) {
+        close(fd);
+        close_client(bev, client_data);
+        return;
+    }
+    // A rate limited session pays for each buffer chain it writes in one
+    // go, however big, so its file goes on in pieces.
+    size_t piece = rate_limited(client_data->user) ? RATE_LIMIT_PIECE : length, done;
+    for (done = 0, n = 0; n == 0 && done < length; done += piece) {
+        n = evbuffer_add_file_segment(bufferevent_get_output(bev), segment, done, length - done < piece ? length - done : piece);
+    }
+    evbuffer_file_segment_free(segment);
+    if (n != 0) close_client(bev, client_data);
 }
 
+static void resume_opened(struct disk_op_t *op)
+{
+    struct upload_t *upload = (struct upload_t *)op->arg;
+
+    if (op->result >= 0) upload->fd = op->result;
+    if (upload_op_done(upload)) return;
+
+    struct client_data_t *client_data = upload->client;
+    if (op->result < 0) {
+        finish_upload(upload, "540 no such upload to resume\n");
+        return;
+    }
+    if (upload_reopen(upload, upload->fd) != 0 || watch_compressor(upload) != 0) {
+        finish_upload(upload, NULL);
+        return;
+    }
+    if (client_data->state == STATE_CLOSING) return;
+    if (!upload->stream_id) client_data->state = STATE_PUT;
+
+    char response[64];
+    snprintf(response, sizeof(response), "255 resume %llu\n", upload->received);
+    stream_write(client_data->bev, upload->stream_id, response);
+    upload_ready(upload);
+}
+
+// RESUME [<stream>] <token>
+void command_resume(struct client_data_t *client_data, struct bufferevent *bev, char *args)
+{
+    unsigned int stream_id;
+
+    if (parse_stream_id(client_data, bev, &args, &stream_id) != 0) return;
+
+    if (!*args) {
+        stream_write(bev, stream_id, "510 must specify an upload token\n");
+        return;
+    }
 
+    if (!stream_available(client_data, bev, stream_id)) return;
 
+    struct upload_t *upload = upload_resume(args, client_data->user);
+    if (upload == NULL) {
+        stream_write(bev, stream_id, "540 no such upload to resume\n");
+        return;
+    }
+    attach_upload(client_data, upload, stream_id);
+
+    struct disk_op_t *op = upload_op(upload, DISK_OPEN, resume_opened);
+    if (op == NULL) {
+        finish_upload(upload, NULL);
+        return;
+    }
+    op->path = upload->temp_path;
+    op->flags = O_WRONLY | O_CLOEXEC;
+    disk_submit(op);
+}
+
+// BLOCK [<stream>] <size>
+//
+// The payload of a BLOCK for a multiplexed stream that has gone, or is
+// being saved, is read and thrown away.
+void command_block(struct client_data_t *client_data, struct bufferevent *bev, char *args)
+{
+    unsigned long long size;
+    unsigned int stream_id;
+
+    if (parse_stream_id(client_data, bev, &args, &stream_id) != 0) goto invalid;
+
+    if (!*args) {
+        stream_write(bev, stream_id, "510 must specify a block size\n");
+        goto invalid;
+    }
+
+    if (parse_number(args, MAX_BLOCK_SIZE, &size) != 0) {
+        stream_write(bev, stream_id, "510 invalid block size\n");
+        goto invalid;
+    }
+
+    if (stream_id) {
+        client_data->upload = find_stream(client_data, stream_id);
+        if (client_data->upload && client_data->upload->saving) client_data->upload = NULL;
+        if (client_data->upload == NULL) stream_write(bev, stream_id, "542 no such stream\n");
+    }
+
+    client_data->state = STATE_DATA;
+    client_data->incoming_data_size = size;
+    client_data->block_size = client_data->incoming_data_size;
+    client_data->block_started = metrics_now();
+    if (!client_data->pipelined) bufferevent_write0(bev, "256 commence data upload\n");
+    return;
+
+invalid:
+    // A pipelining client has already sent the payload, and there's no way
+    // of telling where it ends.
+    if (client_data->pipelined) close_client(bev, client_data);
+}
+
+static void digest_buffer(EVP_MD_CTX *digest, struct evbuffer *in, size_t length)
+{
+    struct evbuffer_ptr ptr;
+    struct evbuffer_iovec vec[16];
+    int i, count;
+
+    evbuffer_ptr_set(in, &ptr, 0, EVBUFFER_PTR_SET);
+    while (length > 0) {
+        count = evbuffer_peek(in, length, &ptr, vec, 16);
+        if (count > 16) count = 16;
+        for (i = 0; i < count && length > 0; i++) {
+            size_t n = vec[i].iov_len < length ? vec[i].iov_len : length;
+            EVP_DigestUpdate(digest, vec[i].iov_base, n);
+            evbuffer_ptr_set(in, &ptr, n, EVBUFFER_PTR_ADD);
+            length -= n;
+        }
+    }
+}
+
+// Runs on a disk thread. Waits for the upload's data from `drop_offset` to
+// reach the disk, then drops it from the page cache, which won't drop dirty
+// pages. A `drop_length` of 0 runs to the end of the file.
+static int drop_written_data(void *arg)
+{
+    struct upload_t *upload = (struct upload_t *)arg;
+
+    if (sync_file_range(upload->fd, upload->drop_offset, upload->drop_length, SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER) != 0) return -errno;
+    return -posix_fadvise(upload->fd, upload->drop_offset, upload->drop_length, POSIX_FADV_DONTNEED);
+}
+
+static void written_dropped(struct disk_op_t *op)
+{
+    struct upload_t *upload = (struct upload_t *)op->arg;
+
+    upload->dropping = 0;
+    if (upload_op_done(upload)) return;
+    if (upload->client->state == STATE_CLOSING) return;
+    if (upload->saving && upload->ops_in_flight == 0) save_continue(upload, 0);
+}
+
+// With 'uncached uploads', each UNCACHED_WINDOW of the upload that has been
+// written is seen out of the page cache, so that a large upload doesn't
+// push out everything else on the host. Failing to is no great loss.
+static void drop_written(struct upload_t *upload)
+{
+    unsigned long long written = upload->received - upload->bytes_in_flight;
+    struct disk_op_t *op;
+
+    if (!configuration.uncached_uploads || upload->chunker || upload->dropping || written < upload->dropped + UNCACHED_WINDOW) return;
+    if ((op = upload_op(upload, DISK_CALL, written_dropped)) == NULL) return;
+
+    op->call = drop_written_data;
+    upload->drop_offset = upload->dropped;
+    upload->drop_length = written - upload->dropped;
+    upload->dropped = written;
+    upload->dropping = 1;
+    disk_submit(op);
+}
+
+// Runs as each piece of BLOCK payload reaches the temporary file, or fails
+// to. Reading resumes once the backlog of writes is down to the low water
+// mark, and a SAVE waiting for the writes to finish carries on.
+static void block_written(struct disk_op_t *op)
+{
+    struct upload_t *upload = (struct upload_t *)op->arg;
+
+    METRIC_ADD(disk_write_microseconds, metrics_now() - op->started);
+    upload->bytes_in_flight -= op->length;
+    account_upload(upload);
+    if (op->result < 0 && !upload->write_error) upload->write_error = -op->result;
+    if (upload_op_done(upload)) return;
+
+    struct client_data_t *client_data = upload->client;
+    if (client_data->state == STATE_CLOSING) return;
+
+    if (upload->write_error) {
+        system_error(client_data->bev, client_data);
+        return;
+    }
+
+    if (upload->delta && !upload->delta->applied) {
+        delta_continue(upload);
+        return;
+    }
+
+    if (upload->saving) {
+        if (upload->ops_in_flight == 0) save_continue(upload, 0);
+        return;
+    }
+
+    drop_written(upload);
+    if (client_data->backlogged && session_caught_up(client_data)) {
+        client_data->backlogged = NULL;
+        resume_reading(client_data->bev);
+    }
+}
+
+// Runs on a disk thread: puts the data it has been handed through the
+// chunker, which hashes and stores each chunk as it is completed, and
+// finishes the manifest off if the upload is being saved.
+static int store_chunk_data(void *arg)
+{
+    struct upload_t *upload = (struct upload_t *)arg;
+    size_t length;
+
+    while ((length = evbuffer_get_length(upload->chunk_data)) > 0) {
+        size_t n = chunker_space(upload->chunker);
+        if (n > length) n = length;
+
+        evbuffer_remove(upload->chunk_data, chunker_tail(upload->chunker), n);
+        if (chunker_update(upload->chunker, n) != 0) return errno ? -errno : -EIO;
+    }
+    if (upload->chunks_finishing && chunker_finish(upload->chunker) != 0) return errno ? -errno : -EIO;
+    return 0;
+}
+
+static void chunks_stored(struct disk_op_t *op);
+
+// Hands what a deduplicating upload has received so far to a disk thread
+// to be chunked, or, once all of it has been, the rest along with finishing
+// the manifest. One lot is chunked at a time, in order; whatever arrives
+// meanwhile waits for chunks_stored(). Returns -1 on a system error.
+static int store_chunks(struct upload_t *upload)
+{
+    if (upload->chunking || upload->chunks_finishing) return 0;
+    if (evbuffer_get_length(upload->chunk_pending) == 0 && !upload->chunks_complete) return 0;
+
+    struct disk_op_t *op = upload_op(upload, DISK_CALL, chunks_stored);
+    if (op == NULL) return -1;
+
+    op->call = store_chunk_data;
+    op->length = evbuffer_get_length(upload->chunk_pending);
+    op->started = metrics_now();
+    evbuffer_add_buffer(upload->chunk_data, upload->chunk_pending);
+    upload->chunks_finishing = upload->chunks_complete;
+    upload->chunking = 1;
+    disk_submit(op);
+    return 0;
+}
+
+// Runs once a lot of data has been chunked. What has arrived since is
+// handed over straight away, even if the session has gone, so that a
+// parked upload has stored everything it was counted as receiving. The
+// upload then carries on as it would after a write.
+static void chunks_stored(struct disk_op_t *op)
+{
+    struct upload_t *upload = (struct upload_t *)op->arg;
+
+    upload->chunking = 0;
+    if (op->result < 0 && !upload->write_error) upload->write_error = -op->result;
+    if (!upload->write_error && store_chunks(upload) != 0) upload->write_error = ENOMEM;
+    block_written(op);
+}
+
+// Moves `length` bytes of the file being uploaded from `in` to the upload,
+// hashing them on the way. Returns -1 on a system error.
+static int upload_data(struct upload_t *upload, struct evbuffer *in, size_t length)
+{
+    if (upload->chunker) {
+        // Hash the data here and leave the chunking, with its hashing of
+        // each chunk and writing of new ones, to a disk thread.
+        digest_buffer(upload->digest, in, length);
+        evbuffer_remove_buffer(in, upload->chunk_pending, length);
+        upload->bytes_in_flight += length;
+        account_upload(upload);
+        if (store_chunks(upload) != 0) return -1;
+    }
+    else if (upload->compressor) {
+        // Hash the data here and hand the buffer chains themselves over to
+        // the compressor.
+        digest_buffer(upload->digest, in, length);
+        if (compressor_write(upload->compressor, in, length) != 0) return -1;
+    }
+    else if (length > 0) {
+        // Likewise for the disk engine, which writes them out at the
+        // upload's current offset, taking turns with other uploads, while
+        // we carry on reading.
+        struct disk_op_t *op = upload_op(upload, DISK_WRITE, block_written);
+        if (op == NULL) return -1;
+
+        digest_buffer(upload->digest, in, length);
+        evbuffer_remove_buffer(in, op->data, length);
+        op->fd = upload->fd;
+        op->flow = &upload->flow;
+        op->offset = upload->received;
+        op->length = length;
+        op->started = metrics_now();
+        upload->bytes_in_flight += length;
+        disk_submit(op);
+    }
+
+    upload->received += length;
+    return 0;
+}
+
+static int read_delta_base(void *arg)
+{
+    struct upload_t *upload = (struct upload_t *)arg;
+    return delta_read_base(upload->delta);
+}
+
+static void delta_base_read(struct disk_op_t *op);
+
+// Applies as much of a delta upload's pending delta as it can: literal data
+// goes straight to the upload, and copies are read from the base on a disk
+// thread, a piece at a time, coming back here through delta_base_read().
+// Stops while a read is in flight or the upload's writes need to catch up.
+// An invalid delta is thrown away as it arrives, and the SAVE refused.
+// Returns -1 on a system error.
+static int apply_delta(struct upload_t *upload)
+{
+    struct delta_t *delta = upload->delta;
+    struct disk_op_t *op;
+    size_t length;
+
+    while (!delta->reading && !delta->failed && !writes_backlogged(upload)) {
+        if (delta->remaining == 0) {
+            if (delta_next_instruction(delta) <= 0) break;
+        }
+        else if (delta->opcode == DELTA_LITERAL) {
+            if ((length = evbuffer_get_length(delta->pending)) == 0) break;
+            if (length > delta->remaining) length = delta->remaining;
+            if (upload_data(upload, delta->pending, length) != 0) return -1;
+            delta->remaining -= length;
+        }
+        else {
+            if ((op = upload_op(upload, DISK_CALL, delta_base_read)) == NULL) return -1;
+            op->call = read_delta_base;
+            delta->reading = 1;
+            disk_submit(op);
+        }
+    }
+
+    if (delta->failed) evbuffer_drain(delta->pending, evbuffer_get_length(delta->pending));
+    return 0;
+}
+
+// Carries on with a delta upload once a read from its base or one of its
+// writes has finished: a SAVE waiting for the delta to be applied tries
+// again, and otherwise more of the delta is applied.
+static void delta_continue(struct upload_t *upload)
+{
+    struct client_data_t *client_data = upload->client;
+
+    if (upload->saving) {
+        save_start(upload);
+        return;
+    }
+
+    if (apply_delta(upload) != 0) {
+        system_error(client_data->bev, client_data);
+        return;
+    }
+    account_upload(upload);
+
+    if (client_data->backlogged && session_caught_up(client_data)) {
+        client_data->backlogged = NULL;
+        resume_reading(client_data->bev);
+    }
+}
+
+static void delta_base_read(struct disk_op_t *op)
+{
+    struct upload_t *upload = (struct upload_t *)op->arg;
+    struct delta_t *delta = upload->delta;
+
+    delta->reading = 0;
+    if (upload_op_done(upload)) return;
+
+    struct client_data_t *client_data = upload->client;
+    if (client_data->state == STATE_CLOSING) return;
+
+    if (op->result < 0 || upload_data(upload, delta->read, op->result) != 0) {
+        system_error(client_data->bev, client_data);
+        return;
+    }
+    delta->offset += op->result;
+    delta->remaining -= op->result;
+    delta_continue(upload);
+}
+
+// Moves as much of the current BLOCK's payload as is buffered in `in` to the
+// upload, or for a delta upload to its pending delta. Returns -1 on a
+// system error.
+int receive_block_data(struct client_data_t *client_data, struct evbuffer *in)
+{
+    struct upload_t *upload = client_data->upload;
+    size_t length = evbuffer_get_length(in);
+    if (length > client_data->incoming_data_size) length = client_data->incoming_data_size;
+
+    client_data->incoming_data_size -= length;
+    if (upload == NULL) {
+        evbuffer_drain(in, length);
+        return 0;
+    }
+
+    if (upload->write_error) return -1;
+
+    int n;
+    if (upload->delta) {
+        if (evbuffer_remove_buffer(in, upload->delta->pending, length) != (int)length) return -1;
+        upload->delta->received += length;
+        n = apply_delta(upload);
+    }
+    else {
+        n = upload_data(upload, in, length);
+    }
+
+    account_upload(upload);
+    return n;
+}
+
+void block_received(struct client_data_t *client_data, struct bufferevent *bev)
+{
+    struct upload_t *upload = client_data->upload;
+
+    if (client_data->multiplexed) {
+        client_data->state = STATE_AUTHENTICATED;
+        client_data->upload = NULL;
+        if (upload == NULL) return;
+    }
+    else {
+        client_data->state = STATE_PUT;
+    }
+
+    METRIC_INC(blocks_received);
+    METRIC_ADD(bytes_received, client_data->block_size);
+    if (client_data->block_size > 0) {
+        uint64_t elapsed = metrics_now() - client_data->block_started;
+        METRIC_OBSERVE(block_per_mb, elapsed * 1048576 / client_data->block_size);
+    }
+
+    if (client_data->pipelined) upload->unacknowledged_blocks++;
+    else bufferevent_write0(bev, "257 block received\n");
+}
+
+// In pipelined mode blocks are acknowledged together, once whatever the
+// client has sent so far has been consumed, with the total number of bytes
+// received for the upload. The client may keep sending until its own window
+// of unacknowledged bytes is full. A multiplexed session gets one
+// acknowledgement for each stream that has had blocks.
+void send_block_acknowledgement(struct client_data_t *client_data, struct bufferevent *bev)
+{
+    struct upload_t **uploads, *upload;
+    char response[80];
+    int i, count;
+
+    uploads = session_uploads(client_data, &count);
+    for (i = 0; i < count; i++) {
+        if ((upload = uploads[i]) == NULL || upload->unacknowledged_blocks == 0) continue;
+
+        snprintf(response, sizeof(response), "257 %u blocks received %llu\n", upload->unacknowledged_blocks, upload->delta ? upload->delta->received : upload->received);
+        stream_write(bev, upload->stream_id, response);
+        upload->unacknowledged_blocks = 0;
+    }
+}
+
+void command_pipeline(struct client_data_t *client_data, struct bufferevent *bev, char *args)
+{
+    if (*args) {
+        bufferevent_write0(bev, "510 pipeline does not take an argument\n");
+        return;
+    }
+
+    client_data->pipelined = 1;
+    bufferevent_write0(bev, "262 pipelining enabled\n");
+}
+
+// MULTIPLEX
+//
+// Lets the session have up to MAX_STREAMS uploads on the go at once, each
+// with its own temporary file. PUT, RESUME, BLOCK and SAVE then take a
+// stream id of the client's choosing, from 1 to 999999999, before their
+// usual arguments, and replies about a stream carry its id after the
+// response code. BLOCKs for different streams may be interleaved, and are
+// pipelined as after PIPELINE. A stream's id can be used again once its
+// upload has been answered with 259 or an error.
+void command_multiplex(struct client_data_t *client_data, struct bufferevent *bev, char *args)
+{
+    if (*args) {
+        bufferevent_write0(bev, "510 multiplex does not take an argument\n");
+        return;
+    }
+
+    client_data->multiplexed = 1;
+    client_data->pipelined = 1;
+    bufferevent_write0(bev, "263 multiplexing enabled\n");
+}
+
+static void save_step_done(struct disk_op_t *op)
+{
+    struct upload_t *upload = (struct upload_t *)op->arg;
+
+    upload->ops_in_flight--;
+    save_continue(upload, op->result);
+}
+
+// Runs on a disk thread as a save starts. Gives back space preallocated
+// beyond where the upload actually ended and, with 'uncached uploads', sees
+// the rest of the file out of the page cache. Neither is worth failing the
+// save over.
+static int settle_temp_file(void *arg)
+{
+    struct upload_t *upload = (struct upload_t *)arg;
+
+    if (upload->preallocated > upload->received) ftruncate(upload->fd, upload->received); // ignore result
+    if (configuration.uncached_uploads && !upload->chunker) {
+        upload->drop_offset = upload->dropped;
+        upload->drop_length = 0;
+        drop_written_data(upload); // ignore result
+    }
+    return 0;
+}
+
+// Data that went through the splice path was never seen by the server, so
+// in that case the temporary file is read back on a disk thread.
+static int digest_temp_file(void *arg)
+{
+    struct upload_t *upload = (struct upload_t *)arg;
+    return digest_file(upload->temp_path, upload->hash);
+}
+
+static int record_digest(void *arg)
+{
+    struct upload_t *upload = (struct upload_t *)arg;
+    struct catalog_t *catalog = catalog_open(upload->user->repository);
+
+    if (catalog) catalog_add(catalog, strrchr(upload->version_path, '/') + 1, upload->received, upload->hash); // ignore result
+    replication_add(upload->user, strrchr(upload->version_path, '/') + 1, upload->filename, upload->received, upload->hash);
+    return write_cached_digest(upload->version_path, upload->hash);
+}
+
+// Checks the upload's hash and moves it into the repository as the new
+// current version, one disk operation at a time: close the temporary file,
+// rename it into place, record its digest and add it to the repository's
+// catalog, and repoint current.<filename>.
+// Each step comes back here with its result. A save that has started goes
+// on to the end even if the client disconnects, so that a renamed version
+// is never left without its symlink.
+//
+// With 'durable saves' the data is synced before the rename and the reply
+// waits for a group commit of the repository directory. Deduplicated
+// chunks are written all over the chunk store, so for those the data sync
+// is a group commit of the whole filesystem instead, which covers the
+// manifest and every chunk it names before the version can become current.
+static void save_continue(struct upload_t *upload, int result)
+{
+    struct disk_op_t *op;
+    unsigned char digest[EVP_MAX_MD_SIZE];
+    unsigned int digest_length;
+    uint64_t now;
+
+    switch (upload->save_step) {
+    case SAVE_WAITING:
+        if (upload->preallocated > upload->received || (configuration.uncached_uploads && !upload->chunker)) {
+            if ((op = upload_op(upload, DISK_CALL, save_step_done)) == NULL) goto failed;
+            op->call = settle_temp_file;
+            upload->save_step = SAVE_SETTLING;
+            break;
+        }
+        // fall through
+
+    case SAVE_SETTLING:
+        if (configuration.durable_saves && upload->chunker) {
+            if ((op = upload_op(upload, DISK_COMMIT, save_step_done)) == NULL) goto failed;
+            op->path = upload->repository_path;
+            op->flags = DISK_SYNC_FILESYSTEM;
+            upload->save_step = SAVE_SYNCING;
+            break;
+        }
+        if (configuration.durable_saves) {
+            if ((op = upload_op(upload, DISK_FSYNC, save_step_done)) == NULL) goto failed;
+            op->fd = upload->fd;
+            op->flags = DISK_DATASYNC;
+            upload->save_step = SAVE_SYNCING;
+            break;
+        }
+        // fall through
+
+    case SAVE_SYNCING:
+        if (result < 0) goto failed;
+        if ((op = upload_op(upload, DISK_CLOSE, save_step_done)) == NULL) goto failed;
+        op->fd = upload->fd;
+        upload->fd = 0;
+        upload->save_step = SAVE_CLOSING;
+        break;
+
+    case SAVE_CLOSING:
+        if (result < 0) goto failed;
+        if (upload->digest_incomplete) {
+            if ((op = upload_op(upload, DISK_CALL, save_step_done)) == NULL) goto failed;
+            op->call = digest_temp_file;
+            upload->save_step = SAVE_HASHING;
+            break;
+        }
+        if (!EVP_DigestFinal_ex(upload->digest, digest, &digest_length)) goto failed;
+        hex_encode(upload->hash, digest, digest_length);
+        // fall through
+
+    case SAVE_HASHING:
+        if (result < 0) goto failed;
+        if (upload->delta && upload->delta->failed) {
+            finish_upload(upload, "531 invalid delta\n");
+            return;
+        }
+        if (*upload->expected_hash && strcasecmp(upload->expected_hash, upload->hash)) {
+            METRIC_INC(hash_mismatches);
+            finish_upload(upload, "530 file hash does not match hash supplied by client\n");
+            return;
+        }
+
+        if (build_path(upload->version_path, "%s/%d.%d.%d.%s", upload->repository_path, getpid(), next_upload_number(), (int)time(NULL), upload->filename) != 0) goto failed;
+        if ((op = upload_op(upload, DISK_RENAME, save_step_done)) == NULL) goto failed;
+        op->path = upload->temp_path;
+        op->path2 = upload->version_path;
+        upload->commit_started = metrics_now();
+        upload->save_step = SAVE_RENAMING;
+        break;
+
+    case SAVE_RENAMING:
+        if (result < 0) goto failed;
+        if ((op = upload_op(upload, DISK_CALL, save_step_done)) == NULL) goto failed;
+        op->call = record_digest;
+        upload->save_step = SAVE_RECORDING;
+        break;
+
+    case SAVE_RECORDING:
+        // Ignore the result; a later PUT will rehash. The new symlink is made
+        // under the temporary file's old name and renamed over the current
+        // one, so current.<filename> always points at a version.
+        if ((op = upload_op(upload, DISK_SYMLINK, save_step_done)) == NULL) goto failed;
+        op->path = upload->version_path;
+        op->path2 = upload->temp_path;
+        upload->save_step = SAVE_LINKING;
+        break;
+
+    case SAVE_LINKING:
+        if (result < 0) goto failed;
+        if ((op = upload_op(upload, DISK_RENAME, save_step_done)) == NULL) goto failed;
+        op->path = upload->temp_path;
+        op->path2 = upload->current_path;
+        upload->save_step = SAVE_REPLACING;
+        break;
+
+    case SAVE_REPLACING:
+        if (result < 0) goto failed;
+        *upload->temp_path = 0;
+        now = metrics_now();
+        METRIC_OBSERVE(save_commit, now - upload->commit_started);
+
+        if (configuration.durable_saves) {
+            if ((op = upload_op(upload, DISK_COMMIT, save_step_done)) == NULL) goto failed;
+            op->path = upload->repository_path;
+            upload->commit_started = now;
+            upload->save_step = SAVE_COMMITTING;
+            break;
+        }
+        // fall through
+
+    case SAVE_COMMITTING:
+    default:
+        if (result < 0) goto failed;
+
+        now = metrics_now();
+        if (configuration.durable_saves) METRIC_OBSERVE(save_sync, now - upload->commit_started);
+        METRIC_OBSERVE(save, now - upload->save_started);
+        METRIC_INC(files_saved);
+        finish_upload(upload, "259 file saved\n");
+        return;
+    }
+
+    disk_submit(op);
+    return;
+
+failed:
+    finish_upload(upload, NULL);
+}
+
+// Waits for the upload's data to reach the temporary file, then hands over
+// to save_continue(). A delta upload may have the end of its delta still to
+// apply, the tail of a compressed upload may still be working its way
+// through the pool, a deduplicating one has its manifest to finish on a
+// disk thread and a plain one may have writes in flight; delta_continue(),
+// compression_cb or block_written carries on with the save once they're
+// done.
+static void save_start(struct upload_t *upload)
+{
+    struct client_data_t *client_data = upload->client;
+    struct delta_t *delta = upload->delta;
+
+    if (delta && !delta->applied) {
+        if (apply_delta(upload) != 0) {
+            system_error(client_data->bev, client_data);
+            return;
+        }
+        if (delta->reading) return;
+
+        // Anything left over is the end of a delta that was cut short.
+        if (!delta->failed && (delta->remaining > 0 || evbuffer_get_length(delta->pending) > 0)) {
+            if (writes_backlogged(upload)) return;
+            delta->failed = 1;
+        }
+        delta->applied = 1;
+    }
+
+    if (upload->chunker) {
+        upload->chunks_complete = 1;
+        if (store_chunks(upload) != 0) {
+            system_error(client_data->bev, client_data);
+            return;
+        }
+    }
+
+    if (upload->compressor) {
+        if (compressor_finish(upload->compressor) != 0) system_error(client_data->bev, client_data);
+        return;
+    }
+
+    if (upload->ops_in_flight == 0) save_continue(upload, 0);
+}
+
+// SAVE [<stream>] [<sha256>]
+//
+// A classic session doesn't read anything else until the save has been
+// answered. A multiplexed stream may still be waiting for its file to
+// open, in which case the save starts once it has.
+void command_save(struct client_data_t *client_data, struct bufferevent *bev, char *args)
+{
+    struct upload_t *upload = client_data->upload;
+    unsigned int stream_id;
+
+    if (parse_stream_id(client_data, bev, &args, &stream_id) != 0) return;
+
+    if (*args && !valid_digest(args)) {
+        stream_write(bev, stream_id, "510 invalid hash\n");
+        return;
+    }
+
+    if (stream_id && ((upload = find_stream(client_data, stream_id)) == NULL || upload->saving)) {
+        stream_write(bev, stream_id, "542 no such stream\n");
+        return;
+    }
+
+    upload->save_started = metrics_now();
+    upload->saving = 1;
+    if (*args) strcpy(upload->expected_hash, args);
+
+    if (!stream_id) {
+        client_data->state = STATE_SAVING;
+        bufferevent_disable(bev, EV_READ);
+    }
+
+    if (!upload->opening) save_start(upload);
+}
+
+// MPUT <count>
+//
+// Uploads up to MAX_BATCH_FILES small files in one go. The command is
+// followed straight away by a line for each file, '<filename> <size>
+// [<sha256>]', with the file's data after it. Nothing more is said until
+// the whole batch has been stored, when the reply is '264 <count> files'
+// and then, in order, what PUT and SAVE would have said about each file. A
+// file with a bad entry, over MAX_BATCH_FILE_SIZE bytes or that would take
+// the batch over MAX_BATCH_SIZE is skipped, and its data thrown away.
+void command_mput(struct client_data_t *client_data, struct bufferevent *bev, char *args)
+{
+    unsigned long long count;
+
+    if (parse_number(args, MAX_BATCH_FILES, &count) != 0 || count == 0) {
+        // The files follow on regardless, and can't be told apart from
+        // commands.
+        bufferevent_write0(bev, "510 invalid file count\n");
+        close_client(bev, client_data);
+        return;
+    }
+
+    struct batch_t *batch = batch_new(client_data->user, count);
+    if (batch == NULL) {
+        system_error(bev, client_data);
+        return;
+    }
+
+    batch->client = client_data;
+    batch->disk = &client_data->worker->disk;
+    batch->started = metrics_now();
+    client_data->batch = batch;
+    client_data->state = STATE_BATCH;
+}
+
+// Takes the line describing the next file in a batch.
+void batch_entry(struct client_data_t *client_data, struct bufferevent *bev, char *line)
+{
+    struct batch_t *batch = client_data->batch;
+    struct batch_file_t *file = &batch->files[batch->entries++];
+    char *size, *expected_hash = NULL;
+    unsigned long long length;
+
+    if ((size = strchr(line, ' '))) {
+        *(size++) = 0;
+        if ((expected_hash = strchr(size, ' '))) *(expected_hash++) = 0;
+    }
+
+    if (size == NULL || parse_number(size, 999999999, &length) != 0) {
+        bufferevent_write0(bev, "510 invalid batch entry\n");
+        close_client(bev, client_data);
+        return;
+    }
+
+    file->length = length;
+    batch->remaining = file->length;
+
+    if (!*line) file->response = "510 must specify a filename\n";
+    else if (strlen(line) > MAX_FILENAME_LENGTH) file->response = "510 filename is too long\n";
+    else if (!valid_filename(line)) file->response = "510 invalid characters in filename\n";
+    else if (expected_hash && !valid_digest(expected_hash)) file->response = "510 invalid hash\n";
+    else if (file->length > MAX_BATCH_FILE_SIZE) file->response = "510 file is too large for a batch\n";
+    else if (batch->size + file->length > MAX_BATCH_SIZE) file->response = "510 batch is too large\n";
+    else {
+        strcpy(file->filename, line);
+        if (expected_hash) strcpy(file->expected_hash, expected_hash);
+        batch->size += file->length;
+    }
+}
+
+// Moves as much of the current batch file's data as is buffered in `in`
+// into the batch. Returns -1 on a system error.
+int receive_batch_data(struct client_data_t *client_data, struct evbuffer *in)
+{
+    struct batch_t *batch = client_data->batch;
+    size_t length = evbuffer_get_length(in);
+    if (length > batch->remaining) length = batch->remaining;
+    if (length == 0) return 0;
+
+    if (batch->files[batch->entries - 1].response) evbuffer_drain(in, length);
+    else if (evbuffer_remove_buffer(in, batch->data, length) != (int)length) return -1;
+
+    batch->remaining -= length;
+    return 0;
+}
+
+// Answers the batch, or disconnects with a system error if `failed` is set.
+static void finish_batch(struct batch_t *batch, int failed)
+{
+    struct client_data_t *client_data = batch->client;
+    char response[64];
+    unsigned int i;
+
+    if (client_data == NULL || client_data->state == STATE_CLOSING) {
+        if (client_data) client_data->batch = NULL;
+        batch_free(batch);
+        return;
+    }
+
+    client_data->batch = NULL;
+    if (failed) {
+        batch_free(batch);
+        system_error(client_data->bev, client_data);
+        return;
+    }
+
+    snprintf(response, sizeof(response), "264 %u files\n", batch->count);
+    bufferevent_write0(client_data->bev, response);
+    for (i = 0; i < batch->count; i++) {
+        const char *file_response = batch->files[i].response;
+        bufferevent_write0(client_data->bev, file_response);
+
+        if (!strncmp(file_response, "259", 3)) METRIC_INC(files_saved);
+        else if (!strncmp(file_response, "258", 3)) METRIC_INC(files_unchanged);
+        else if (!strncmp(file_response, "530", 3)) METRIC_INC(hash_mismatches);
+    }
+
+    METRIC_INC(batches_received);
+    METRIC_OBSERVE(batch, metrics_now() - batch->started);
+    batch_free(batch);
+
+    client_data->state = STATE_AUTHENTICATED;
+    resume_reading(client_data->bev);
+}
+
+static void batch_committed(struct disk_op_t *op)
+{
+    struct batch_t *batch = (struct batch_t *)op->arg;
+
+    batch->storing = 0;
+    finish_batch(batch, op->result < 0);
+}
+
+// With 'durable saves' the batch's files have been synced before being
+// renamed into place, and the reply waits for a group commit of the
+// repository directory, as for SAVE.
+static void batch_stored(struct disk_op_t *op)
+{
+    struct batch_t *batch = (struct batch_t *)op->arg;
+    unsigned int i;
+
+    if (op->result >= 0 && configuration.durable_saves) {
+        for (i = 0; i < batch->count && strncmp(batch->files[i].response, "259", 3); i++);
+
+        if (i < batch->count) {
+            struct disk_op_t *commit = disk_op_new(batch->disk, DISK_COMMIT, batch_committed, batch);
+            if (commit) {
+                commit->path = batch->repository_path;
+                disk_submit(commit);
+                return;
+            }
+        }
+    }
+
+    batch->storing = 0;
+    finish_batch(batch, op->result < 0);
+}
+
+// Hands a batch whose files have all arrived to a disk thread. The session
+// doesn't read anything else until it has answered.
+void batch_received(struct client_data_t *client_data, struct bufferevent *bev)
+{
+    struct batch_t *batch = client_data->batch;
+
+    struct disk_op_t *op = disk_op_new(batch->disk, DISK_CALL, batch_stored, batch);
+    if (op == NULL) {
+        system_error(bev, client_data);
+        return;
+    }
+
+    op->call = batch_store;
+    batch->storing = 1;
+    client_data->state = STATE_SAVING;
+    bufferevent_disable(bev, EV_READ);
+    METRIC_ADD(bytes_received, batch->size);
+    disk_submit(op);
+}
+
+// LIST [<prefix>]
+//
+// Lists the current version of each file whose name starts with `prefix`,
+// after '265 <count> files', as '<filename> <version> <time> <size>
+// <sha256>' lines in order of filename. The hash is '-' for versions saved
+// before hashes were recorded. Answered from the repository's catalog, so
+// the cost is in proportion to the number of files listed.
+void command_list(struct client_data_t *client_data, struct bufferevent *bev, char *args)
+{
+    if (strlen(args) > MAX_FILENAME_LENGTH) {
+        bufferevent_write0(bev, "510 prefix is too long\n");
+        return;
+    }
+
+    struct catalog_t *catalog = catalog_open(client_data->user->repository);
+    struct evbuffer *lines = evbuffer_new();
+    if (catalog == NULL || lines == NULL) {
+        if (lines) evbuffer_free(lines);
+        system_error(bev, client_data);
+        return;
+    }
+
+    char response[64];
+    snprintf(response, sizeof(response), "265 %d files\n", catalog_list(catalog, args, lines));
+    bufferevent_write0(bev, response);
+    bufferevent_write_buffer(bev, lines);
+    evbuffer_free(lines);
+}
+
+// VERSIONS <filename>
+//
+// Lists every version of a file, newest first, after '266 <count>
+// versions', as '<version> <time> <size> <sha256>' lines.
+void command_versions(struct client_data_t *client_data, struct bufferevent *bev, char *args)
+{
+    if (!*args) {
+        bufferevent_write0(bev, "510 must specify a filename\n");
+        return;
+    }
+
+    if (strlen(args) > MAX_FILENAME_LENGTH) {
+        bufferevent_write0(bev, "510 filename is too long\n");
+        return;
+    }
+
+    struct catalog_t *catalog = catalog_open(client_data->user->repository);
+    struct evbuffer *lines = evbuffer_new();
+    if (catalog == NULL || lines == NULL) {
+        if (lines) evbuffer_free(lines);
+        system_error(bev, client_data);
+        return;
+    }
+
+    int n = catalog_versions(catalog, args, lines);
+    if (n == 0) {
+        bufferevent_write0(bev, "541 no such file or version\n");
+    }
+    else {
+        char response[64];
+        snprintf(response, sizeof(response), "266 %d versions\n", n);
+        bufferevent_write0(bev, response);
+        bufferevent_write_buffer(bev, lines);
+    }
+    evbuffer_free(lines);
+}
+
+// Runs on a disk thread.
+static int open_delta_base(void *arg)
+{
+    struct upload_t *upload = (struct upload_t *)arg;
+    return delta_open_base(upload->delta);
+}
+
+static void delta_base_opened(struct disk_op_t *op)
+{
+    struct upload_t *upload = (struct upload_t *)op->arg;
+
+    if (upload_op_done(upload)) return;
+    if (op->result == -ENOENT) {
+        finish_upload(upload, "541 no such file or version\n");
+        return;
+    }
+    if (op->result < 0) {
+        finish_upload(upload, NULL);
+        return;
+    }
+    put_check_exists(upload);
+}
+
+// DELTA [<stream>] <filename> <version> [<sha256>]
+//
+// Starts an upload whose BLOCKs carry a delta against `version`, as given
+// by SIGNATURE, instead of the whole file. Otherwise it goes as for PUT, up
+// to and including SAVE; the delta is applied to the temporary file as it
+// arrives. A SAVE after a delta that was cut short or copied blocks the
+// version doesn't have is answered with 531. Delta uploads can't be
+// resumed, so 255 never carries a token.
+void command_delta(struct client_data_t *client_data, struct bufferevent *bev, char *args)
+{
+    char *filename, *version = NULL, *expected_hash;
+    unsigned int stream_id;
+
+    if (parse_stream_id(client_data, bev, &args, &stream_id) != 0) return;
+
+    filename = strsep(&args, " ");
+    if (args) version = strsep(&args, " ");
+    expected_hash = args;
+
+    if (!*filename) {
+        stream_write(bev, stream_id, "510 must specify a filename\n");
+        return;
+    }
+
+    if (strlen(filename) > MAX_FILENAME_LENGTH) {
+        stream_write(bev, stream_id, "510 filename is too long\n");
+        return;
+    }
+
+    if (!valid_filename(filename)) {
+        stream_write(bev, stream_id, "510 invalid characters in filename\n");
+        return;
+    }
+
+    if (version == NULL || !valid_version(version)) {
+        stream_write(bev, stream_id, "510 invalid version\n");
+        return;
+    }
+
+    if (expected_hash && !valid_digest(expected_hash)) {
+        stream_write(bev, stream_id, "510 invalid hash\n");
+        return;
+    }
+
+    if (!stream_available(client_data, bev, stream_id)) return;
+
+    struct upload_t *upload = upload_new(client_data->user, filename, expected_hash);
+    if (upload == NULL) {
+        system_error(bev, client_data);
+        return;
+    }
+    *upload->token = 0;
+
+    if ((upload->delta = delta_new(upload->repository_path, filename, version)) == NULL) {
+        upload_free(upload);
+        system_error(bev, client_data);
+        return;
+    }
+    attach_upload(client_data, upload, stream_id);
+
+    struct disk_op_t *op = upload_op(upload, DISK_CALL, delta_base_opened);
+    if (op == NULL) {
+        finish_upload(upload, NULL);
+        return;
+    }
+    op->call = open_delta_base;
+    disk_submit(op);
+}
+
+static void signature_built(struct disk_op_t *op)
+{
+    struct signature_t *signature = (struct signature_t *)op->arg;
+    struct client_data_t *client_data = signature->client;
+    char response[128];
+
+    if (client_data == NULL || client_data->state == STATE_CLOSING) {
+        if (client_data) client_data->signature = NULL;
+        signature_free(signature);
+        return;
+    }
+    client_data->signature = NULL;
+
+    if (op->result < 0 && op->result != -ENOENT) {
+        signature_free(signature);
+        system_error(client_data->bev, client_data);
+        return;
+    }
+
+    if (op->result == -ENOENT) {
+        bufferevent_write0(client_data->bev, "541 no such file or version\n");
+    }
+    else {
+        snprintf(response, sizeof(response), "267 %s %llu %u %zu\n", signature->version, signature->length, signature->block_size,
+                evbuffer_get_length(signature->data) / DELTA_ENTRY_LENGTH);
+        bufferevent_write0(client_data->bev, response);
+        bufferevent_write_buffer(client_data->bev, signature->data);
+    }
+    signature_free(signature);
+
+    client_data->state = STATE_AUTHENTICATED;
+    resume_reading(client_data->bev);
+}
+
+// SIGNATURE <filename> [<version>]
+//
+// Answers '267 <version> <length> <block size> <blocks>' about the current
+// version of a file, or the one given, followed by the signature of each of
+// its blocks in turn, as described in delta.h, for the client to work out
+// a DELTA against. The signature is worked out, or read from the cache, on
+// a disk thread, and the session doesn't read anything else until it has
+// been sent.
+void command_signature(struct client_data_t *client_data, struct bufferevent *bev, char *args)
+{
+    struct signature_t *signature;
+    char *filename, *version;
+    char repository_path[PATH_MAX];
+
+    filename = strsep(&args, " ");
+    version = args;
+
+    if (!*filename) {
+        bufferevent_write0(bev, "510 must specify a filename\n");
+        return;
+    }
+
+    if (strlen(filename) > MAX_FILENAME_LENGTH || !valid_filename(filename)) {
+        bufferevent_write0(bev, "510 invalid filename\n");
+        return;
+    }
+
+    if (version && (strlen(version) >= sizeof(signature->version) || !valid_version(version))) {
+        bufferevent_write0(bev, "510 invalid version\n");
+        return;
+    }
+
+    if (build_path(repository_path, "%s/%s", configuration.repository_root, client_data->user->repository) != 0 ||
+            (signature = signature_new(repository_path, filename, version)) == NULL) {
+        system_error(bev, client_data);
+        return;
+    }
+
+    struct disk_op_t *op = disk_op_new(&client_data->worker->disk, DISK_CALL, signature_built, signature);
+    if (op == NULL) {
+        signature_free(signature);
+        system_error(bev, client_data);
+        return;
+    }
+
+    op->call = signature_build;
+    signature->client = client_data;
+    client_data->signature = signature;
+    client_data->state = STATE_SENDING;
+    bufferevent_disable(bev, EV_READ);
+    disk_submit(op);
+}
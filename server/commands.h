@@ -4,6 +4,22 @@
 
 void command_user(struct client_data_t *client_data, struct bufferevent *bev, char *args);
 void command_pass(struct client_data_t *client_data, struct bufferevent *bev, char *args);
+void command_pipeline(struct client_data_t *client_data, struct bufferevent *bev, char *args);
+void command_multiplex(struct client_data_t *client_data, struct bufferevent *bev, char *args);
 void command_put(struct client_data_t *client_data, struct bufferevent *bev, char *args);
+void command_get(struct client_data_t *client_data, struct bufferevent *bev, char *args);
+void command_resume(struct client_data_t *client_data, struct bufferevent *bev, char *args);
 void command_block(struct client_data_t *client_data, struct bufferevent *bev, char *args);
+void command_mput(struct client_data_t *client_data, struct bufferevent *bev, char *args);
+void command_list(struct client_data_t *client_data, struct bufferevent *bev, char *args);
+void command_versions(struct client_data_t *client_data, struct bufferevent *bev, char *args);
+void command_delta(struct client_data_t *client_data, struct bufferevent *bev, char *args);
+void command_signature(struct client_data_t *client_data, struct bufferevent *bev, char *args);
 void command_save(struct client_data_t *client_data, struct bufferevent *bev, char *args);
+int session_backlogged(struct client_data_t *client_data, struct upload_t *upload);
+int receive_block_data(struct client_data_t *client_data, struct evbuffer *in);
+void block_received(struct client_data_t *client_data, struct bufferevent *bev);
+void send_block_acknowledgement(struct client_data_t *client_data, struct bufferevent *bev);
+void batch_entry(struct client_data_t *client_data, struct bufferevent *bev, char *line);
+int receive_batch_data(struct client_data_t *client_data, struct evbuffer *in);
+void batch_received(struct client_data_t *client_data, struct bufferevent *bev);
@@ -0,0 +1,407 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "compress.h"
+#include "format.h"
+#include "utils.h"
+
+struct pool_t compression_pool = POOL_INITIALIZER;
+
+static int write_header(int fd, unsigned long long length)
+{
+    char header[COMPRESSED_HEADER_LENGTH + 1];
+    snprintf(header, sizeof(header), COMPRESSED_HEADER "%020llu\n", length);
+    return pwrite(fd, header, COMPRESSED_HEADER_LENGTH, 0) == COMPRESSED_HEADER_LENGTH ? 0 : -1;
+}
+
+// Runs the deflate stream over whatever is in `working`, writing out any
+// output as it goes; with `finish` set the stream is ended as well.
+static int deflate_working(struct compressor_t *compressor, int finish)
+{
+    struct evbuffer_iovec vec[16];
+    int i, count, result;
+
+    while (evbuffer_get_length(compressor->working) > 0) {
+        size_t consumed = 0;
+
+        count = evbuffer_peek(compressor->working, -1, NULL, vec, 16);
+        if (count > 16) count = 16;
+        for (i = 0; i < count; i++) {
+            compressor->stream.next_in = vec[i].iov_base;
+            compressor->stream.avail_in = vec[i].iov_len;
+            do {
+                compressor->stream.next_out = compressor->out;
+                compressor->stream.avail_out = sizeof(compressor->out);
+                if (deflate(&compressor->stream, Z_NO_FLUSH) == Z_STREAM_ERROR) return -1;
+                if (write_all(compressor->fd, compressor->out, sizeof(compressor->out) - compressor->stream.avail_out) != 0) return -1;
+            } while (compressor->stream.avail_in > 0);
+            consumed += vec[i].iov_len;
+        }
+
+        compressor->length += consumed;
+        evbuffer_drain(compressor->working, consumed);
+    }
+
+    if (!finish) return 0;
+
+    do {
+        compressor->stream.next_out = compressor->out;
+        compressor->stream.avail_out = sizeof(compressor->out);
+        result = deflate(&compressor->stream, Z_FINISH);
+        if (result == Z_STREAM_ERROR) return -1;
+        if (write_all(compressor->fd, compressor->out, sizeof(compressor->out) - compressor->stream.avail_out) != 0) return -1;
+    } while (result != Z_STREAM_END);
+
+    return write_header(compressor->fd, compressor->length);
+}
+
+static void destroy_compressor(struct compressor_t *compressor)
+{
+    deflateEnd(&compressor->stream);
+    close(compressor->fd);
+    evbuffer_free(compressor->queued);
+    evbuffer_free(compressor->working);
+    pthread_mutex_destroy(&compressor->lock);
+    free(compressor);
+}
+
+// Takes everything queued so far and compresses it, until the queue is
+// empty. Only one pool thread runs a given compressor's job at a time.
+static void compress_job(struct pool_job_t *job)
+{
+    struct compressor_t *compressor = (struct compressor_t *)job;
+    int finishing, failed;
+
+    for (;;) {
+        pthread_mutex_lock(&compressor->lock);
+        if (compressor->released) {
+            pthread_mutex_unlock(&compressor->lock);
+            destroy_compressor(compressor);
+            return;
+        }
+
+        evbuffer_add_buffer(compressor->working, compressor->queued);
+        size_t length = evbuffer_get_length(compressor->working);
+        finishing = compressor->finishing && !compressor->finished;
+        failed = compressor->failed;
+        if (length == 0 && !finishing) {
+            compressor->scheduled = 0;
+            pthread_mutex_unlock(&compressor->lock);
+            return;
+        }
+        pthread_mutex_unlock(&compressor->lock);
+
+        if (failed) evbuffer_drain(compressor->working, length);
+        else failed = deflate_working(compressor, finishing) != 0;
+
+        pthread_mutex_lock(&compressor->lock);
+        compressor->pending -= length;
+        if (failed) compressor->failed = 1;
+        else if (finishing) compressor->finished = 1;
+        if (compressor->notify && (compressor->pending <= COMPRESS_LOW_WATER || failed || finishing)) event_active(compressor->notify, EV_READ, 0);
+        pthread_mutex_unlock(&compressor->lock);
+    }
+}
+
+// Must be called with the lock held.
+static void schedule(struct compressor_t *compressor)
+{
+    if (compressor->scheduled) return;
+    compressor->scheduled = 1;
+    pool_submit(&compression_pool, &compressor->job);
+}
+
+// Starts a compressed version in the newly created file `fd`. The
+// compressor keeps its own descriptor for the file.
+struct compressor_t *compressor_new(int fd, int level)
+{
+    struct compressor_t *compressor = (struct compressor_t *)calloc(1, sizeof(struct compressor_t));
+    if (compressor == NULL) return NULL;
+
+    compressor->job.run = compress_job;
+    compressor->fd = -1;
+    pthread_mutex_init(&compressor->lock, NULL);
+    compressor->queued = evbuffer_new();
+    compressor->working = evbuffer_new();
+    if (compressor->queued == NULL || compressor->working == NULL) goto error;
+
+    // gzip framing, so that the data can be recovered with standard tools.
+    if (deflateInit2(&compressor->stream, level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) goto error;
+
+    compressor->fd = dup(fd);
+    if (compressor->fd == -1 || set_version_format(compressor->fd, FORMAT_COMPRESSED) != 0 || write_header(compressor->fd, 0) != 0 || lseek(compressor->fd, COMPRESSED_HEADER_LENGTH, SEEK_SET) == -1) goto error;
+
+    return compressor;
+
+error:
+    if (compressor->queued) evbuffer_free(compressor->queued);
+    if (compressor->working) evbuffer_free(compressor->working);
+    if (compressor->fd != -1) close(compressor->fd);
+    deflateEnd(&compressor->stream);
+    pthread_mutex_destroy(&compressor->lock);
+    free(compressor);
+    return NULL;
+}
+
+// Writes a whole compressed version to the newly created file `fd` in one
+// go, for data small enough not to need the pool.
+int compress_data(int fd, int level, const unsigned char *data, size_t length)
+{
+    unsigned char out[65536];
+    z_stream stream;
+    int result;
+
+    memset(&stream, 0, sizeof(stream));
+    if (deflateInit2(&stream, level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) return -1;
+    if (set_version_format(fd, FORMAT_COMPRESSED) != 0 || write_header(fd, length) != 0 || lseek(fd, COMPRESSED_HEADER_LENGTH, SEEK_SET) == -1) goto error;
+
+    stream.next_in = (unsigned char *)data;
+    stream.avail_in = length;
+    do {
+        stream.next_out = out;
+        stream.avail_out = sizeof(out);
+        result = deflate(&stream, Z_FINISH);
+        if (result == Z_STREAM_ERROR) goto error;
+        if (write_all(fd, out, sizeof(out) - stream.avail_out) != 0) goto error;
+    } while (result != Z_STREAM_END);
+
+    deflateEnd(&stream);
+    return 0;
+
+error:
+    deflateEnd(&stream);
+    return -1;
+}
+
+// Abandons the compressor. If the pool is part way through it, the pool
+// frees it once it's done.
+void compressor_free(struct compressor_t *compressor)
+{
+    pthread_mutex_lock(&compressor->lock);
+    compressor->notify = NULL;
+    compressor->released = 1;
+    if (compressor->scheduled) {
+        pthread_mutex_unlock(&compressor->lock);
+        return;
+    }
+    pthread_mutex_unlock(&compressor->lock);
+    destroy_compressor(compressor);
+}
+
+// Sets the event to raise on the owning connection's event loop, or clears
+// it when the connection goes away. Once this returns the old event won't
+// be touched again.
+void compressor_set_notify(struct compressor_t *compressor, struct event *notify)
+{
+    pthread_mutex_lock(&compressor->lock);
+    compressor->notify = notify;
+    pthread_mutex_unlock(&compressor->lock);
+}
+
+// Moves `length` bytes from `in` to the compressor without copying them.
+int compressor_write(struct compressor_t *compressor, struct evbuffer *in, size_t length)
+{
+    int result = 0;
+
+    pthread_mutex_lock(&compressor->lock);
+    if (compressor->failed || evbuffer_remove_buffer(in, compressor->queued, length) != (int)length) {
+        result = -1;
+    }
+    else {
+        compressor->pending += length;
+        schedule(compressor);
+    }
+    pthread_mutex_unlock(&compressor->lock);
+
+    return result;
+}
+
+// Ends the stream once everything written so far has been compressed.
+int compressor_finish(struct compressor_t *compressor)
+{
+    int result = 0;
+
+    pthread_mutex_lock(&compressor->lock);
+    if (compressor->failed) {
+        result = -1;
+    }
+    else {
+        compressor->finishing = 1;
+        schedule(compressor);
+    }
+    pthread_mutex_unlock(&compressor->lock);
+
+    return result;
+}
+
+size_t compressor_pending(struct compressor_t *compressor)
+{
+    pthread_mutex_lock(&compressor->lock);
+    size_t pending = compressor->pending;
+    pthread_mutex_unlock(&compressor->lock);
+    return pending;
+}
+
+// Returns -1 if compression has failed, 1 once the stream is finished and
+// written out, or 0 otherwise.
+int compressor_status(struct compressor_t *compressor)
+{
+    pthread_mutex_lock(&compressor->lock);
+    int status = compressor->failed ? -1 : compressor->finished;
+    pthread_mutex_unlock(&compressor->lock);
+    return status;
+}
+
+// Returns 1 if `path` is a compressed version, setting `length` (if given)
+// to its uncompressed length. Only versions marked as compressed when they
+// were written count; a plain file that happens to start with the header
+// is the user's data.
+int is_compressed(const char *path, unsigned long long *length)
+{
+    char header[COMPRESSED_HEADER_LENGTH + 1];
+
+    if (version_format(path) != FORMAT_COMPRESSED) return 0;
+
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) return 0;
+    ssize_t n = read(fd, header, COMPRESSED_HEADER_LENGTH);
+    close(fd);
+
+    if (n != COMPRESSED_HEADER_LENGTH || memcmp(header, COMPRESSED_HEADER, sizeof(COMPRESSED_HEADER) - 1) || header[COMPRESSED_HEADER_LENGTH - 1] != '\n') return 0;
+
+    header[COMPRESSED_HEADER_LENGTH - 1] = 0;
+    if (length) *length = strtoull(header + sizeof(COMPRESSED_HEADER) - 1, NULL, 10);
+    return 1;
+}
+
+struct decompressor_t *decompressor_open(const char *path, unsigned long long offset, unsigned long long length)
+{
+    struct decompressor_t *decompressor = (struct decompressor_t *)calloc(1, sizeof(struct decompressor_t));
+    if (decompressor == NULL) return NULL;
+
+    if (inflateInit2(&decompressor->stream, 15 + 16) != Z_OK) {
+        free(decompressor);
+        return NULL;
+    }
+
+    decompressor->fd = open(path, O_RDONLY);
+    if (decompressor->fd == -1 || lseek(decompressor->fd, COMPRESSED_HEADER_LENGTH, SEEK_SET) == -1) {
+        if (decompressor->fd != -1) close(decompressor->fd);
+        inflateEnd(&decompressor->stream);
+        free(decompressor);
+        return NULL;
+    }
+
+    decompressor->skip = offset;
+    decompressor->remaining = length;
+    return decompressor;
+}
+
+// Inflates into `out` up to `limit` bytes of the requested range directly,
+// or into `scratch` for data before the range starts. Returns the number of
+// bytes produced, or -1 on error.
+static ssize_t inflate_some(struct decompressor_t *decompressor, unsigned char *out, size_t limit)
+{
+    if (decompressor->stream.avail_in == 0 && !decompressor->eof) {
+        ssize_t n = read(decompressor->fd, decompressor->in, sizeof(decompressor->in));
+        if (n == -1) return -1;
+        if (n == 0) decompressor->eof = 1;
+        decompressor->stream.next_in = decompressor->in;
+        decompressor->stream.avail_in = n;
+    }
+
+    decompressor->stream.next_out = out;
+    decompressor->stream.avail_out = limit;
+    int result = inflate(&decompressor->stream, Z_NO_FLUSH);
+    size_t produced = limit - decompressor->stream.avail_out;
+
+    // Running out of stored data before the promised length is corruption.
+    if (result == Z_STREAM_END && produced == 0) return -1;
+    if (result == Z_BUF_ERROR && decompressor->eof) return -1;
+    if (result != Z_OK && result != Z_STREAM_END && result != Z_BUF_ERROR) return -1;
+
+    return produced;
+}
+
+// Appends up to `limit` more bytes of the range to `out`. Returns the
+// number added, 0 once the whole range has been produced, or -1 if the
+// stored data is unreadable or corrupt. Getting to the start of the range
+// means inflating everything before it, which is done RESTORE_SKIP_LIMIT
+// bytes per call; until it is done, -1 is returned with errno EAGAIN.
+int decompressor_read(struct decompressor_t *decompressor, struct evbuffer *out, size_t limit)
+{
+    unsigned char scratch[16384];
+    struct evbuffer_iovec vec;
+    size_t skipped = 0;
+    ssize_t n;
+
+    while (decompressor->skip > 0) {
+        if (skipped >= RESTORE_SKIP_LIMIT) {
+            errno = EAGAIN;
+            return -1;
+        }
+        size_t length = decompressor->skip < sizeof(scratch) ? decompressor->skip : sizeof(scratch);
+        if ((n = inflate_some(decompressor, scratch, length)) == -1) return -1;
+        decompressor->skip -= n;
+        skipped += n;
+    }
+
+    if (decompressor->remaining == 0) return 0;
+    if (limit > decompressor->remaining) limit = decompressor->remaining;
+
+    do {
+        if (evbuffer_reserve_space(out, limit, &vec, 1) < 1) return -1;
+        if (vec.iov_len > limit) vec.iov_len = limit;
+        if ((n = inflate_some(decompressor, vec.iov_base, vec.iov_len)) == -1) return -1;
+        vec.iov_len = n;
+        if (evbuffer_commit_space(out, &vec, 1) != 0) return -1;
+    } while (n == 0);
+
+    decompressor->remaining -= n;
+    return n;
+}
+
+void decompressor_free(struct decompressor_t *decompressor)
+{
+    inflateEnd(&decompressor->stream);
+    close(decompressor->fd);
+    free(decompressor);
+}
+
+// Writes a whole compressed version, uncompressed, to `out_fd`.
+int decompress_file(const char *path, int out_fd)
+{
+    unsigned long long length;
+    struct decompressor_t *decompressor;
+    struct evbuffer *buffer;
+    int n;
+
+    if (!is_compressed(path, &length)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if ((decompressor = decompressor_open(path, 0, length)) == NULL) return -1;
+    if ((buffer = evbuffer_new()) == NULL) {
+        decompressor_free(decompressor);
+        return -1;
+    }
+
+    while ((n = decompressor_read(decompressor, buffer, 1048576)) > 0) {
+        while (evbuffer_get_length(buffer) > 0) {
+            if (evbuffer_write(buffer, out_fd) == -1) {
+                n = -1;
+                break;
+            }
+        }
+        if (n == -1) break;
+    }
+
+    evbuffer_free(buffer);
+    decompressor_free(decompressor);
+    return n;
+}
@@ -0,0 +1,80 @@
+#ifndef __COMPRESS_H
+#define __COMPRESS_H
+
+#include <pthread.h>
+#include <zlib.h>
+#include <event2/buffer.h>
+#include <event2/event.h>
+
+#include "pool.h"
+
+// A compressed version is this header, the uncompressed length as 20
+// decimal digits and a newline, followed by a single gzip member, so it can
+// be recovered with `tail -c +34 <file> | zcat` if need be.
+#define COMPRESSED_HEADER "boat-gzip 1 "
+#define COMPRESSED_HEADER_LENGTH (sizeof(COMPRESSED_HEADER) - 1 + 21)
+
+// Start reading from a client again once its compressor is this far behind,
+// and stop once it's further behind than the high water mark.
+#define COMPRESS_LOW_WATER (2 * 1024 * 1024)
+#define COMPRESS_HIGH_WATER (8 * 1024 * 1024)
+
+// Compresses one upload as it arrives. The event loop moves received data
+// into `queued` and the pool deflates it in order on whichever thread is
+// free, raising `notify` on the loop as it catches up, when the stream has
+// been finished and if anything goes wrong.
+struct compressor_t
+{
+    struct pool_job_t job;
+    pthread_mutex_t lock;
+    struct evbuffer *queued;
+    size_t pending;
+    int scheduled;
+    int finishing;
+    int finished;
+    int failed;
+    int released;
+    struct event *notify;
+
+    // Only touched by the pool thread running the job.
+    int fd;
+    z_stream stream;
+    unsigned long long length;
+    struct evbuffer *working;
+    unsigned char out[65536];
+};
+
+extern struct pool_t compression_pool;
+
+struct compressor_t *compressor_new(int fd, int level);
+void compressor_free(struct compressor_t *compressor);
+void compressor_set_notify(struct compressor_t *compressor, struct event *notify);
+int compressor_write(struct compressor_t *compressor, struct evbuffer *in, size_t length);
+int compressor_finish(struct compressor_t *compressor);
+size_t compressor_pending(struct compressor_t *compressor);
+int compressor_status(struct compressor_t *compressor);
+int compress_data(int fd, int level, const unsigned char *data, size_t length);
+
+// At most this much of a compressed version before the range being read
+// back is inflated in one go.
+#define RESTORE_SKIP_LIMIT (1024 * 1024)
+
+// Reads back a compressed version, or a byte range of one, a piece at a
+// time.
+struct decompressor_t
+{
+    int fd;
+    z_stream stream;
+    unsigned long long skip;
+    unsigned long long remaining;
+    int eof;
+    unsigned char in[65536];
+};
+
+int is_compressed(const char *path, unsigned long long *length);
+struct decompressor_t *decompressor_open(const char *path, unsigned long long offset, unsigned long long length);
+int decompressor_read(struct decompressor_t *decompressor, struct evbuffer *out, size_t limit);
+void decompressor_free(struct decompressor_t *decompressor);
+int decompress_file(const char *path, int out_fd);
+
+#endif
@@ -3,16 +3,18 @@
 #include <stdlib.h>
 #include <stdio.h>
 
+#include "chunk_store.h"
 #include "configuration.h"
 #include "constants.h"
+#include "replication.h"
 #include "utils.h"
 
 struct configuration_t configuration;
 
-int process_configuration_option(const char *key, const char *value, int line_number)
+int process_configuration_option(struct configuration_t *config, const char *key, const char *value, int line_number)
 {
     if (!strcasecmp(key, "listen address")) {
-        configuration.listen_address = strdup(value);
+        config->listen_address = strdup(value);
     }
 
     else if (!strcasecmp(key, "listen port")) {
@@ -21,19 +23,220 @@ int process_configuration_option(const char *key, const char *value, int line_nu
             fprintf(stderr, "invalid value for listen_port; it must be between 1 and 65535\n");
             return -1;
         }
-        configuration.listen_port = n;
+        config->listen_port = n;
     }
 
     else if (!strcasecmp(key, "repository root")) {
-        configuration.repository_root = strdup(value);
+        config->repository_root = strdup(value);
     }
 
     else if (!strcasecmp(key, "ssl key file")) {
-        configuration.ssl_key_file = strdup(value);
+        config->ssl_key_file = strdup(value);
     }
 
     else if (!strcasecmp(key, "ssl cert file")) {
-        configuration.ssl_cert_file = strdup(value);
+        config->ssl_cert_file = strdup(value);
+    }
+
+    else if (!strcasecmp(key, "ssl session cache size")) {
+        int n = atoi(value);
+        if (n < 0 || (n == 0 && strcmp(value, "0"))) {
+            fprintf(stderr, "invalid value for ssl session cache size; it must be a number of sessions, or 0 to disable the cache\n");
+            return -1;
+        }
+        config->ssl_session_cache_size = n;
+    }
+
+    else if (!strcasecmp(key, "ssl session timeout")) {
+        int n = atoi(value);
+        if (n < 1) {
+            fprintf(stderr, "invalid value for ssl session timeout; it must be a number of seconds\n");
+            return -1;
+        }
+        config->ssl_session_timeout = n;
+    }
+
+    else if (!strcasecmp(key, "ssl ticket key lifetime")) {
+        int n = atoi(value);
+        if (n < 0 || (n == 0 && strcmp(value, "0"))) {
+            fprintf(stderr, "invalid value for ssl ticket key lifetime; it must be a number of seconds, or 0 to disable session tickets\n");
+            return -1;
+        }
+        config->ssl_ticket_key_lifetime = n;
+    }
+
+    else if (!strcasecmp(key, "worker threads")) {
+        int n = atoi(value);
+        if (n < 1 || n > 256) {
+            fprintf(stderr, "invalid value for worker threads; it must be between 1 and 256\n");
+            return -1;
+        }
+        config->worker_threads = n;
+    }
+
+    else if (!strcasecmp(key, "zero copy uploads")) {
+        if (!strcasecmp(value, "yes") || !strcasecmp(value, "1") || !strcasecmp(value, "true"))
+            config->zero_copy_uploads = 1;
+        else if (!strcasecmp(value, "no") || !strcasecmp(value, "0") || !strcasecmp(value, "false"))
+            config->zero_copy_uploads = 0;
+        else {
+            fprintf(stderr, "value for 'zero copy uploads' must be yes or no on line %d of configuration file\n", line_number);
+            return -1;
+        }
+    }
+
+    else if (!strcasecmp(key, "zero copy downloads")) {
+        if (!strcasecmp(value, "yes") || !strcasecmp(value, "1") || !strcasecmp(value, "true"))
+            config->zero_copy_downloads = 1;
+        else if (!strcasecmp(value, "no") || !strcasecmp(value, "0") || !strcasecmp(value, "false"))
+            config->zero_copy_downloads = 0;
+        else {
+            fprintf(stderr, "value for 'zero copy downloads' must be yes or no on line %d of configuration file\n", line_number);
+            return -1;
+        }
+    }
+
+    else if (!strcasecmp(key, "resume timeout")) {
+        int n = atoi(value);
+        if (n < 0 || (n == 0 && strcmp(value, "0"))) {
+            fprintf(stderr, "invalid value for resume timeout; it must be a number of seconds, or 0 to disable resuming\n");
+            return -1;
+        }
+        config->resume_timeout = n;
+    }
+
+    else if (!strcasecmp(key, "metrics port")) {
+        int n = atoi(value);
+        if (n < 0 || n > 65535 || (n == 0 && strcmp(value, "0"))) {
+            fprintf(stderr, "invalid value for metrics port; it must be between 1 and 65535, or 0 to disable metrics\n");
+            return -1;
+        }
+        config->metrics_port = n;
+    }
+
+    else if (!strcasecmp(key, "compression threads")) {
+        int n = atoi(value);
+        if (n < 0 || n > 256 || (n == 0 && strcmp(value, "0"))) {
+            fprintf(stderr, "invalid value for compression threads; it must be between 1 and 256, or 0 for one per CPU\n");
+            return -1;
+        }
+        config->compression_threads = n;
+    }
+
+    else if (!strcasecmp(key, "io uring")) {
+        if (!strcasecmp(value, "yes") || !strcasecmp(value, "1") || !strcasecmp(value, "true"))
+            config->io_uring = 1;
+        else if (!strcasecmp(value, "no") || !strcasecmp(value, "0") || !strcasecmp(value, "false"))
+            config->io_uring = 0;
+        else {
+            fprintf(stderr, "value for 'io uring' must be yes or no on line %d of configuration file\n", line_number);
+            return -1;
+        }
+    }
+
+    else if (!strcasecmp(key, "disk threads")) {
+        int n = atoi(value);
+        if (n < 1 || n > 256) {
+            fprintf(stderr, "invalid value for disk threads; it must be between 1 and 256\n");
+            return -1;
+        }
+        config->disk_threads = n;
+    }
+
+    else if (!strcasecmp(key, "durable saves")) {
+        if (!strcasecmp(value, "yes") || !strcasecmp(value, "1") || !strcasecmp(value, "true"))
+            config->durable_saves = 1;
+        else if (!strcasecmp(value, "no") || !strcasecmp(value, "0") || !strcasecmp(value, "false"))
+            config->durable_saves = 0;
+        else {
+            fprintf(stderr, "value for 'durable saves' must be yes or no on line %d of configuration file\n", line_number);
+            return -1;
+        }
+    }
+
+    else if (!strcasecmp(key, "uncached uploads")) {
+        if (!strcasecmp(value, "yes") || !strcasecmp(value, "1") || !strcasecmp(value, "true"))
+            config->uncached_uploads = 1;
+        else if (!strcasecmp(value, "no") || !strcasecmp(value, "0") || !strcasecmp(value, "false"))
+            config->uncached_uploads = 0;
+        else {
+            fprintf(stderr, "value for 'uncached uploads' must be yes or no on line %d of configuration file\n", line_number);
+            return -1;
+        }
+    }
+
+    else if (!strcasecmp(key, "group commit window")) {
+        int n = atoi(value);
+        if (n < 0 || n > 1000 || (n == 0 && strcmp(value, "0"))) {
+            fprintf(stderr, "invalid value for group commit window; it must be between 0 and 1000 milliseconds\n");
+            return -1;
+        }
+        config->group_commit_window = n;
+    }
+
+    else if (!strcasecmp(key, "retention interval")) {
+        int n = atoi(value);
+        if (n < 0 || (n == 0 && strcmp(value, "0"))) {
+            fprintf(stderr, "invalid value for retention interval; it must be a number of seconds, or 0 to never remove old versions\n");
+            return -1;
+        }
+        config->retention_interval = n;
+    }
+
+    else if (!strcasecmp(key, "retention rate")) {
+        int n = atoi(value);
+        if (n < 1 || n > 100000) {
+            fprintf(stderr, "invalid value for retention rate; it must be between 1 and 100000 versions a second\n");
+            return -1;
+        }
+        config->retention_rate = n;
+    }
+
+    else if (!strcasecmp(key, "rate limit")) {
+        int n = atoi(value);
+        if (n < 0 || (n == 0 && strcmp(value, "0"))) {
+            fprintf(stderr, "invalid value for rate limit; it must be a number of bytes a second, or 0 for no limit\n");
+            return -1;
+        }
+        config->rate_limit = n;
+    }
+
+    else if (!strcasecmp(key, "session buffer budget")) {
+        long long n = atoll(value);
+        if (n < 1048576) {
+            fprintf(stderr, "invalid value for session buffer budget; it must be at least 1048576 bytes\n");
+            return -1;
+        }
+        config->session_buffer_budget = n;
+    }
+
+    else if (!strcasecmp(key, "memory budget")) {
+        long long n = atoll(value);
+        if ((n > 0 && n < 16777216) || n < 0 || (n == 0 && strcmp(value, "0"))) {
+            fprintf(stderr, "invalid value for memory budget; it must be at least 16777216 bytes, or 0 for no limit\n");
+            return -1;
+        }
+        config->memory_budget = n;
+    }
+
+    // Saved versions are copied to each 'replica', another boatd given as
+    // <host>:<port>, for the users that have a 'user replica password'.
+    else if (!strcasecmp(key, "replica")) {
+        char *port = strrchr(value, ':');
+        int n = port ? atoi(port + 1) : 0;
+        if (port == NULL || port == value || n < 1 || n > 65535) {
+            fprintf(stderr, "value for 'replica' must be <host>:<port> on line %d of configuration file\n", line_number);
+            return -1;
+        }
+        if (config->replica_count == MAX_REPLICAS) {
+            fprintf(stderr, "too many replicas on line %d of configuration file; there can be at most %d\n", line_number, MAX_REPLICAS);
+            return -1;
+        }
+        config->replicas[config->replica_count++] = strdup(value);
+    }
+
+    else if (!strcasecmp(key, "replica ca file")) {
+        config->replica_ca_file = strdup(value);
     }
 
     else if (!strcasecmp(key, "user")) {
@@ -42,56 +245,149 @@ int process_configuration_option(const char *key, const char *value, int line_nu
         new_user = (struct user_configuration_t *)malloc(sizeof(struct user_configuration_t));
         assert(new_user);
         memset(new_user, 0, sizeof(struct user_configuration_t));
-        if (configuration.tail_user) {
-            configuration.tail_user->next = new_user;
+        if (config->tail_user) {
+            config->tail_user->next = new_user;
         }
         else {
-            configuration.head_user = new_user;
+            config->head_user = new_user;
         }
-        configuration.tail_user = new_user;
+        config->tail_user = new_user;
         new_user->username = strdup(value);
+        new_user->disk_weight = 1;
     }
 
 #define USER_FIRST_ERROR { fprintf(stderr, "must specify a 'user' before specifying a '%s' on line %d of configuration file\n", key, line_number); return -1; }
 #define DUPLICATE_FIELD_ERROR { fprintf(stderr, "'%s' already supplied for this user on line %d of configuration file\n", key, line_number); return -1; }
 
     else if (!strcasecmp(key, "user password")) {
-        if (configuration.tail_user == NULL) USER_FIRST_ERROR;
-        if (configuration.tail_user->password) DUPLICATE_FIELD_ERROR;
+        if (config->tail_user == NULL) USER_FIRST_ERROR;
+        if (config->tail_user->password) DUPLICATE_FIELD_ERROR;
 
         if (strlen(value) != 64 + SALT_LENGTH) {
             fprintf(stderr, "invalid password value on line %d of configuration file\n", line_number);
             return -1;
         }
 
-        configuration.tail_user->password = strdup(value);
+        config->tail_user->password = strdup(value);
     }
 
     else if (!strcasecmp(key, "user repository")) {
-        if (configuration.tail_user == NULL) USER_FIRST_ERROR;
-        if (configuration.tail_user->repository) DUPLICATE_FIELD_ERROR;
+        if (config->tail_user == NULL) USER_FIRST_ERROR;
+        if (config->tail_user->repository) DUPLICATE_FIELD_ERROR;
 
         if (!valid_filename(value)) {
             fprintf(stderr, "value for 'user repository' is not a valid filename in line %d of configuration file\n", line_number);
             return -1;
         }
 
-        configuration.tail_user->repository = strdup(value);
+        // The server's own directories share the repository root.
+        if (!*value || !strcmp(value, ".") || !strcmp(value, "..") || !strcmp(value, "chunks") || !strcmp(value, "tmp") || !strcmp(value, REPLICATION_DIRECTORY)) {
+            fprintf(stderr, "value for 'user repository' is reserved for the server in line %d of configuration file\n", line_number);
+            return -1;
+        }
+
+        config->tail_user->repository = strdup(value);
     }
 
     else if (!strcasecmp(key, "user versioning enabled")) {
-        if (configuration.tail_user == NULL) USER_FIRST_ERROR;
+        if (config->tail_user == NULL) USER_FIRST_ERROR;
 
         if (!strcasecmp(value, "yes") || !strcasecmp(value, "1") || !strcasecmp(value, "true"))
-            configuration.tail_user->versioning_enabled = 1;
+            config->tail_user->versioning_enabled = 1;
         else if (!strcasecmp(value, "no") || !strcasecmp(value, "0") || !strcasecmp(value, "false"))
-            configuration.tail_user->versioning_enabled = 0;
+            config->tail_user->versioning_enabled = 0;
         else {
             fprintf(stderr, "value for 'user versioning enabled' must be yes or no on line %d of configuration file\n", line_number);
             return -1;
         }
     }
 
+    else if (!strcasecmp(key, "user deduplication enabled")) {
+        if (config->tail_user == NULL) USER_FIRST_ERROR;
+
+        if (!strcasecmp(value, "yes") || !strcasecmp(value, "1") || !strcasecmp(value, "true"))
+            config->tail_user->deduplication_enabled = 1;
+        else if (!strcasecmp(value, "no") || !strcasecmp(value, "0") || !strcasecmp(value, "false"))
+            config->tail_user->deduplication_enabled = 0;
+        else {
+            fprintf(stderr, "value for 'user deduplication enabled' must be yes or no on line %d of configuration file\n", line_number);
+            return -1;
+        }
+    }
+
+    else if (!strcasecmp(key, "user compression")) {
+        if (config->tail_user == NULL) USER_FIRST_ERROR;
+
+        // "none", "gzip" or "gzip <level>"
+        if (!strcasecmp(value, "none")) {
+            config->tail_user->compression_level = 0;
+        }
+        else if (!strncasecmp(value, "gzip", 4) && (value[4] == 0 || value[4] == ' ')) {
+            int n = value[4] ? atoi(value + 5) : 6;
+            if (n < 1 || n > 9) {
+                fprintf(stderr, "gzip compression level must be between 1 and 9 on line %d of configuration file\n", line_number);
+                return -1;
+            }
+            config->tail_user->compression_level = n;
+        }
+        else {
+            fprintf(stderr, "value for 'user compression' must be none, gzip or gzip <level> on line %d of configuration file\n", line_number);
+            return -1;
+        }
+    }
+
+    // Retention policies: a version is kept if it is one of the last
+    // 'user keep versions', or the newest of its day within the last 'user
+    // keep daily' days, or of its week within the last 'user keep weekly'
+    // weeks. Without any of them every version is kept.
+    else if (!strcasecmp(key, "user keep versions") || !strcasecmp(key, "user keep daily") || !strcasecmp(key, "user keep weekly")) {
+        if (config->tail_user == NULL) USER_FIRST_ERROR;
+
+        int n = atoi(value);
+        if (n < 0 || (n == 0 && strcmp(value, "0"))) {
+            fprintf(stderr, "value for '%s' must be a number, or 0 to turn it off, on line %d of configuration file\n", key, line_number);
+            return -1;
+        }
+
+        if (!strcasecmp(key, "user keep versions")) config->tail_user->keep_versions = n;
+        else if (!strcasecmp(key, "user keep daily")) config->tail_user->keep_daily = n;
+        else config->tail_user->keep_weekly = n;
+    }
+
+    // A user's sessions between them move at most 'user rate limit' bytes
+    // a second each way, instead of sharing the global 'rate limit'.
+    else if (!strcasecmp(key, "user rate limit")) {
+        if (config->tail_user == NULL) USER_FIRST_ERROR;
+
+        int n = atoi(value);
+        if (n < 0 || (n == 0 && strcmp(value, "0"))) {
+            fprintf(stderr, "value for 'user rate limit' must be a number of bytes a second, or 0 for no limit of their own, on line %d of configuration file\n", line_number);
+            return -1;
+        }
+        config->tail_user->rate_limit = n;
+    }
+
+    // The password the user has on the replicas, which their versions are
+    // saved there under.
+    else if (!strcasecmp(key, "user replica password")) {
+        if (config->tail_user == NULL) USER_FIRST_ERROR;
+        if (config->tail_user->replica_password) DUPLICATE_FIELD_ERROR;
+        config->tail_user->replica_password = strdup(value);
+    }
+
+    // When uploads are waiting on the disk, each gets a share of the writes
+    // in proportion to its user's weight.
+    else if (!strcasecmp(key, "user disk weight")) {
+        if (config->tail_user == NULL) USER_FIRST_ERROR;
+
+        int n = atoi(value);
+        if (n < 1 || n > 1000) {
+            fprintf(stderr, "value for 'user disk weight' must be between 1 and 1000 on line %d of configuration file\n", line_number);
+            return -1;
+        }
+        config->tail_user->disk_weight = n;
+    }
+
     else {
         fprintf(stderr, "unrecognised configuration key '%s' on line number %d of configuration file\n", key, line_number);
         return -1;
@@ -100,10 +396,8 @@ int process_configuration_option(const char *key, const char *value, int line_nu
     return 0;
 }
 
-int load_configuration(char *config_file)
+int load_configuration(struct configuration_t *config, char *config_file)
 {
-    if (config_file == NULL) config_file = "/etc/boat.conf";
-
     FILE *file;
     file = fopen(config_file, "r");
     if (file == NULL) {
@@ -147,7 +441,7 @@ int load_configuration(char *config_file)
         // Strip leading whitespaces from the start of the value.
         while (*value == ' ' || *value == '\t') value++;
 
-        if (process_configuration_option(key, value, line_number) != 0) {
+        if (process_configuration_option(config, key, value, line_number) != 0) {
             fclose(file);
             return -1;
         }
@@ -155,16 +449,16 @@ int load_configuration(char *config_file)
 
     fclose(file);
 
-    if (configuration.ssl_key_file == NULL) {
+    if (config->ssl_key_file == NULL) {
         fprintf(stderr, "your configuration file must specify a 'SSL key file'\n");
         return -1;
     }
-    if (configuration.ssl_cert_file == NULL) {
+    if (config->ssl_cert_file == NULL) {
         fprintf(stderr, "your configuration file must specify a 'SSL cert file'\n");
         return -1;
     }
 
-    struct user_configuration_t *user = configuration.head_user;
+    struct user_configuration_t *user = config->head_user;
     if (user == NULL) {
         fprintf(stderr, "at least one user must be specified in the configuration file\n");
         return -1;
@@ -178,6 +472,10 @@ int load_configuration(char *config_file)
             fprintf(stderr, "no 'user repository' specified for user '%s' in configuration file\n", user->username);
             return -1;
         }
+        if (user->deduplication_enabled && user->compression_level) {
+            fprintf(stderr, "user '%s' can't have both deduplication and compression enabled\n", user->username);
+            return -1;
+        }
 
         user = user->next;
     }
@@ -185,6 +483,35 @@ int load_configuration(char *config_file)
     return 0;
 }
 
+// Creates the repository directories for a list of users, and the chunk
+// store if any of them deduplicate. Used at startup and again whenever the
+// configuration is reloaded.
+int make_user_directories(struct user_configuration_t *user)
+{
+    char *path;
+    int n, deduplication_enabled = 0;
+
+    while (user) {
+        n = asprintf(&path, "%s/%s", configuration.repository_root, user->repository);
+        if (n == -1 || path == NULL) return -1;
+        if (mkdir_p(path) != 0) {
+            fprintf(stderr, "error while trying to create directory %s\n", path);
+            free(path);
+            return -1;
+        }
+        free(path);
+        deduplication_enabled |= user->deduplication_enabled;
+        user = user->next;
+    }
+
+    if (deduplication_enabled && make_chunk_directories(configuration.repository_root) != 0) {
+        fprintf(stderr, "error while trying to create the chunk store in %s/chunks\n", configuration.repository_root);
+        return -1;
+    }
+
+    return 0;
+}
+
 void make_directories(void)
 {
     char *path;
@@ -198,16 +525,5 @@ void make_directories(void)
     }
     free(path);
 
-    struct user_configuration_t *user = configuration.head_user;
-    while (user) {
-        n = asprintf(&path, "%s/%s", configuration.repository_root, user->repository);
-        assert(n != -1 && path);
-        if (mkdir_p(path) != 0) {
-            fprintf(stderr, "error while trying to create directory %s\n", path);
-            exit(1);
-        }
-        free(path);
-        user = user->next;
-    }
+    if (make_user_directories(configuration.head_user) != 0) exit(1);
 }
-
@@ -1,13 +1,26 @@
 #ifndef __CONFIGURATION_H
 #define __CONFIGURATION_H
 
+#include "constants.h"
+
 struct user_configuration_t
 {
     char *username;
     char *password;
     char *repository;
     int versioning_enabled;
+    int deduplication_enabled;
+    int compression_level;
+    int keep_versions;
+    int keep_daily;
+    int keep_weekly;
+    int rate_limit;
+    int disk_weight;
+    char *replica_password;
+    struct bufferevent_rate_limit_group *rate_group;
     struct user_configuration_t *next;
+    struct user_configuration_t *hash_next;
+    struct user_table_t *table;
 };
 
 struct configuration_t
@@ -17,14 +30,37 @@ struct configuration_t
     char *repository_root;
     char *ssl_key_file;
     char *ssl_cert_file;
+    int ssl_session_cache_size;
+    int ssl_session_timeout;
+    int ssl_ticket_key_lifetime;
+    int worker_threads;
+    int zero_copy_uploads;
+    int zero_copy_downloads;
+    int resume_timeout;
+    int metrics_port;
+    int compression_threads;
+    int io_uring;
+    int disk_threads;
+    int durable_saves;
+    int uncached_uploads;
+    int group_commit_window;
+    int retention_interval;
+    int retention_rate;
+    int rate_limit;
+    long long session_buffer_budget;
+    long long memory_budget;
+    char *replicas[MAX_REPLICAS];
+    int replica_count;
+    char *replica_ca_file;
     struct user_configuration_t *head_user;
     struct user_configuration_t *tail_user;
 };
 
 extern struct configuration_t configuration;
 
-int process_configuration_option(const char *key, const char *value, int line_number);
-int load_configuration(char *config_file);
+int process_configuration_option(struct configuration_t *config, const char *key, const char *value, int line_number);
+int load_configuration(struct configuration_t *config, char *config_file);
+int make_user_directories(struct user_configuration_t *user);
 void make_directories(void);
 
 #endif
@@ -1,3 +1,8 @@
 #define SALT_LENGTH 8
 #define MAX_FILENAME_LENGTH 128
 #define MAX_BLOCK_SIZE 10485760
+#define MAX_USERNAME_LENGTH 128
+#define MAX_COMMAND_LENGTH 1024
+#define MAX_STREAMS 64
+#define MAX_STREAM_ID 999999999
+#define MAX_REPLICAS 8
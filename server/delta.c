@@ -0,0 +1,298 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <openssl/evp.h>
+
+#include "chunk_store.h"
+#include "compress.h"
+#include "configuration.h"
+#include "delta.h"
+#include "utils.h"
+
+uint32_t delta_block_size(unsigned long long length)
+{
+    uint32_t block_size = DELTA_MIN_BLOCK_SIZE;
+
+    while (block_size < DELTA_MAX_BLOCK_SIZE && (unsigned long long)block_size * block_size < length) block_size <<= 1;
+    return block_size;
+}
+
+uint32_t rolling_checksum(const unsigned char *data, size_t length)
+{
+    uint32_t a = 0, b = 0;
+    size_t i;
+
+    for (i = 0; i < length; i++) {
+        a += data[i];
+        b += (uint32_t)(length - i) * data[i];
+    }
+    return (a & 0xffff) | (b << 16);
+}
+
+static void put_be32(unsigned char *p, uint32_t n)
+{
+    p[0] = n >> 24;
+    p[1] = n >> 16;
+    p[2] = n >> 8;
+    p[3] = n;
+}
+
+static uint64_t get_be(const unsigned char *p, int length)
+{
+    uint64_t n = 0;
+
+    while (length-- > 0) n = (n << 8) | *(p++);
+    return n;
+}
+
+// Opens a version for reading its contents from any offset. Compressed
+// versions and manifests are written out whole to an unnamed temporary
+// file first. Returns -1 with errno set if that can't be done.
+int open_version(const char *path, unsigned long long *length)
+{
+    char temp_path[PATH_MAX];
+    struct stat st;
+    int fd, n, error;
+
+    int manifest = is_manifest(path);
+    if (!manifest && !is_compressed(path, NULL)) {
+        if ((fd = open(path, O_RDONLY | O_CLOEXEC)) == -1) return -1;
+        if (fstat(fd, &st) != 0) {
+            error = errno;
+            close(fd);
+            errno = error;
+            return -1;
+        }
+        *length = st.st_size;
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL); // ignore result
+        return fd;
+    }
+
+    if (build_path(temp_path, "%s/tmp", configuration.repository_root) != 0) return -1;
+    if ((fd = open(temp_path, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600)) == -1) return -1;
+
+    n = manifest ? materialize_manifest(configuration.repository_root, path, fd) : decompress_file(path, fd);
+    if (n != 0 || fstat(fd, &st) != 0) {
+        error = errno;
+        close(fd);
+        errno = error ? error : EIO;
+        return -1;
+    }
+    *length = st.st_size;
+    return fd;
+}
+
+struct signature_t *signature_new(const char *repository_path, const char *filename, const char *version)
+{
+    struct signature_t *signature = (struct signature_t *)calloc(1, sizeof(struct signature_t));
+    if (signature == NULL) return NULL;
+
+    if ((signature->data = evbuffer_new()) == NULL) {
+        free(signature);
+        return NULL;
+    }
+
+    strcpy(signature->repository_path, repository_path);
+    strcpy(signature->filename, filename);
+    if (version) strcpy(signature->version, version);
+    return signature;
+}
+
+void signature_free(struct signature_t *signature)
+{
+    evbuffer_free(signature->data);
+    free(signature);
+}
+
+// Signs a version block by block into `data`.
+static int sign_version(int fd, unsigned long long length, uint32_t block_size, struct evbuffer *data)
+{
+    unsigned char entry[DELTA_ENTRY_LENGTH], md[EVP_MAX_MD_SIZE];
+    unsigned long long offset = 0;
+    unsigned int md_length;
+    int n = -1;
+
+    unsigned char *buffer = (unsigned char *)malloc(DELTA_READ_SIZE);
+    EVP_MD_CTX *digest = EVP_MD_CTX_new();
+    if (buffer == NULL || digest == NULL) goto done;
+
+    while (offset < length) {
+        size_t size = length - offset < DELTA_READ_SIZE ? length - offset : DELTA_READ_SIZE, i;
+        if (read_fully(fd, buffer, size, offset) != 0) goto done;
+
+        for (i = 0; i < size; i += block_size) {
+            size_t block_length = size - i < block_size ? size - i : block_size;
+            put_be32(entry, rolling_checksum(buffer + i, block_length));
+            if (!EVP_DigestInit_ex(digest, EVP_sha256(), NULL) || !EVP_DigestUpdate(digest, buffer + i, block_length) || !EVP_DigestFinal_ex(digest, md, &md_length)) goto done;
+            memcpy(entry + 4, md, DELTA_STRONG_LENGTH);
+            if (evbuffer_add(data, entry, sizeof(entry)) != 0) goto done;
+        }
+        offset += size;
+    }
+    n = 0;
+
+done:
+    free(buffer);
+    if (digest) EVP_MD_CTX_free(digest);
+    return n;
+}
+
+// Keeps a signature for next time. Failing to is no great loss.
+static void cache_signature(const char *repository_path, const char *cache_path, struct evbuffer *data)
+{
+    char directory[PATH_MAX], temp_path[PATH_MAX];
+    struct evbuffer_iovec vec[64];
+    int fd, i, count, failed = 0;
+
+    if (build_path(directory, "%s/%s", repository_path, DELTA_SIGNATURES) != 0) return;
+    if (mkdir(directory, 0750) != 0 && errno != EEXIST) return;
+
+    if (build_path(temp_path, "%s/tmp/%d.%d.signature", configuration.repository_root, getpid(), (int)gettid()) != 0) return;
+    if ((fd = open(temp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0640)) == -1) return;
+
+    struct evbuffer_ptr ptr;
+    evbuffer_ptr_set(data, &ptr, 0, EVBUFFER_PTR_SET);
+    size_t remaining = evbuffer_get_length(data);
+    while (remaining > 0 && !failed) {
+        count = evbuffer_peek(data, remaining, &ptr, vec, 64);
+        if (count > 64) count = 64;
+        for (i = 0; i < count && !failed; i++) {
+            size_t length = vec[i].iov_len < remaining ? vec[i].iov_len : remaining;
+            failed = write(fd, vec[i].iov_base, length) != (ssize_t)length;
+            evbuffer_ptr_set(data, &ptr, length, EVBUFFER_PTR_ADD);
+            remaining -= length;
+        }
+    }
+
+    if (close(fd) != 0 || failed || rename(temp_path, cache_path) != 0) unlink(temp_path); // ignore result
+}
+
+// Works out the signature of the version a SIGNATURE asked for, or of the
+// current version, as a DISK_CALL. Signatures are cached, since a file that
+// changes a little each night is signed against the previous night's
+// version each time. Returns -errno on failure.
+int signature_build(void *arg)
+{
+    struct signature_t *signature = (struct signature_t *)arg;
+    char path[PATH_MAX], target[PATH_MAX], cache_path[PATH_MAX], *name;
+    struct stat st;
+    ssize_t n;
+    int fd;
+
+    if (!*signature->version) {
+        if (build_path(path, "%s/current.%s", signature->repository_path, signature->filename) != 0) return -ENAMETOOLONG;
+        if ((n = readlink(path, target, sizeof(target) - 1)) == -1) return -errno;
+        target[n] = 0;
+
+        name = strrchr(target, '/') ? strrchr(target, '/') + 1 : target;
+        n = strlen(name) - strlen(signature->filename) - 1;
+        if (n <= 0 || n >= (ssize_t)sizeof(signature->version) || strcmp(name + n + 1, signature->filename)) return -EINVAL;
+        memcpy(signature->version, name, n);
+        signature->version[n] = 0;
+    }
+
+    if (build_path(path, "%s/%s.%s", signature->repository_path, signature->version, signature->filename) != 0 ||
+            build_path(cache_path, "%s/%s/%s.%s", signature->repository_path, DELTA_SIGNATURES, signature->version, signature->filename) != 0) return -ENAMETOOLONG;
+
+    if ((fd = open_version(path, &signature->length)) == -1) return -errno;
+    signature->block_size = delta_block_size(signature->length);
+    size_t size = (signature->length + signature->block_size - 1) / signature->block_size * DELTA_ENTRY_LENGTH;
+
+    int cached = open(cache_path, O_RDONLY | O_CLOEXEC);
+    if (cached != -1 && fstat(cached, &st) == 0 && (size_t)st.st_size == size && evbuffer_add_file(signature->data, cached, 0, size) == 0) {
+        close(fd);
+        return 0;
+    }
+    if (cached != -1) close(cached);
+
+    n = sign_version(fd, signature->length, signature->block_size, signature->data);
+    close(fd);
+    if (n != 0) return -EIO;
+
+    cache_signature(signature->repository_path, cache_path, signature->data);
+    return 0;
+}
+
+struct delta_t *delta_new(const char *repository_path, const char *filename, const char *version)
+{
+    struct delta_t *delta = (struct delta_t *)calloc(1, sizeof(struct delta_t));
+    if (delta == NULL) return NULL;
+
+    delta->base_fd = -1;
+    delta->pending = evbuffer_new();
+    delta->read = evbuffer_new();
+    if (delta->pending == NULL || delta->read == NULL || build_path(delta->base_path, "%s/%s.%s", repository_path, version, filename) != 0) {
+        delta_free(delta);
+        return NULL;
+    }
+    return delta;
+}
+
+void delta_free(struct delta_t *delta)
+{
+    if (delta->base_fd != -1) close(delta->base_fd);
+    if (delta->pending) evbuffer_free(delta->pending);
+    if (delta->read) evbuffer_free(delta->read);
+    free(delta);
+}
+
+// Opens the version the delta is against. Runs on a disk thread, and
+// returns -errno on failure.
+int delta_open_base(struct delta_t *delta)
+{
+    if ((delta->base_fd = open_version(delta->base_path, &delta->base_length)) == -1) return -errno;
+    delta->block_size = delta_block_size(delta->base_length);
+    return 0;
+}
+
+// Takes the next instruction off the front of the pending delta. Returns 1
+// if there was one, 0 if it hasn't all arrived yet, and -1, marking the
+// delta as failed, if it makes no sense.
+int delta_next_instruction(struct delta_t *delta)
+{
+    unsigned char instruction[DELTA_INSTRUCTION_LENGTH];
+    unsigned long long blocks = (delta->base_length + delta->block_size - 1) / delta->block_size, first, count, end;
+
+    if (evbuffer_copyout(delta->pending, instruction, sizeof(instruction)) < (ssize_t)sizeof(instruction)) return 0;
+    evbuffer_drain(delta->pending, sizeof(instruction));
+
+    delta->opcode = instruction[0];
+    switch (delta->opcode) {
+    case DELTA_COPY:
+        first = get_be(instruction + 1, 4);
+        count = get_be(instruction + 5, 4);
+        if (count == 0 || first >= blocks || count > blocks - first) break;
+
+        delta->offset = first * delta->block_size;
+        end = (first + count) * delta->block_size;
+        delta->remaining = (end < delta->base_length ? end : delta->base_length) - delta->offset;
+        return 1;
+
+    case DELTA_LITERAL:
+        delta->remaining = get_be(instruction + 1, 8);
+        return 1;
+    }
+
+    delta->failed = 1;
+    return -1;
+}
+
+// Reads the next piece of the current copy into `read`, as a DISK_CALL.
+// Returns the number of bytes read, or -1.
+int delta_read_base(struct delta_t *delta)
+{
+    struct evbuffer_iovec vec;
+    size_t length = delta->remaining < DELTA_READ_SIZE ? delta->remaining : DELTA_READ_SIZE;
+
+    if (evbuffer_reserve_space(delta->read, length, &vec, 1) != 1) return -1;
+    if (read_fully(delta->base_fd, (unsigned char *)vec.iov_base, length, delta->offset) != 0) return -1;
+    vec.iov_len = length;
+    if (evbuffer_commit_space(delta->read, &vec, 1) != 0) return -1;
+    return length;
+}
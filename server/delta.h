@@ -0,0 +1,87 @@
+#ifndef __DELTA_H
+#define __DELTA_H
+
+#include <limits.h>
+#include <stdint.h>
+#include <event2/buffer.h>
+#include "constants.h"
+
+// A version is signed in blocks of a power of two bytes, about the square
+// root of its length, between these sizes.
+#define DELTA_MIN_BLOCK_SIZE 2048
+#define DELTA_MAX_BLOCK_SIZE (128 * 1024)
+
+// Each block's signature is its rolling checksum as 4 bytes, followed by
+// the first DELTA_STRONG_LENGTH bytes of its SHA-256. The rolling checksum
+// of bytes x[0..n-1] is a + (b << 16), where a is the sum of the x[i] and b
+// the sum of (n - i) * x[i], both mod 2^16. The last block may be short.
+#define DELTA_STRONG_LENGTH 16
+#define DELTA_ENTRY_LENGTH (4 + DELTA_STRONG_LENGTH)
+
+// Signatures are cached in this directory of the repository, under the
+// version's own name.
+#define DELTA_SIGNATURES "signatures"
+
+// A delta is a stream of 9-byte instructions, numbers big-endian:
+//   'C' <first block:4> <blocks:4>   copy blocks of the base
+//   'L' <length:8> <data>            literal data
+#define DELTA_COPY 'C'
+#define DELTA_LITERAL 'L'
+#define DELTA_INSTRUCTION_LENGTH 9
+
+// Copies are read from the base this much at a time.
+#define DELTA_READ_SIZE (1024 * 1024)
+
+// Stop reading from a client once this much of its delta is waiting to be
+// applied, and start again once it's down to the low water mark.
+#define DELTA_LOW_WATER (2 * 1024 * 1024)
+#define DELTA_HIGH_WATER (8 * 1024 * 1024)
+
+// A SIGNATURE request, worked out on a disk thread. A request whose session
+// ends before the answer is ready is freed when the work completes.
+struct signature_t
+{
+    struct client_data_t *client;
+    char repository_path[PATH_MAX];
+    char filename[MAX_FILENAME_LENGTH + 1];
+    char version[36];
+    unsigned long long length;
+    uint32_t block_size;
+    struct evbuffer *data;
+};
+
+// A delta upload's base and how far through its instructions it has got.
+// `pending` is delta received but not yet applied; `remaining` is what is
+// left of the current instruction, copying from `offset` in the base.
+struct delta_t
+{
+    char base_path[PATH_MAX];
+    int base_fd;
+    unsigned long long base_length;
+    uint32_t block_size;
+    struct evbuffer *pending;
+    struct evbuffer *read;
+    unsigned long long received;
+    int opcode;
+    unsigned long long offset;
+    unsigned long long remaining;
+    int reading;
+    int applied;
+    int failed;
+};
+
+int open_version(const char *path, unsigned long long *length);
+uint32_t delta_block_size(unsigned long long length);
+uint32_t rolling_checksum(const unsigned char *data, size_t length);
+
+struct signature_t *signature_new(const char *repository_path, const char *filename, const char *version);
+void signature_free(struct signature_t *signature);
+int signature_build(void *arg);
+
+struct delta_t *delta_new(const char *repository_path, const char *filename, const char *version);
+void delta_free(struct delta_t *delta);
+int delta_open_base(struct delta_t *delta);
+int delta_next_instruction(struct delta_t *delta);
+int delta_read_base(struct delta_t *delta);
+
+#endif
@@ -0,0 +1,74 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/xattr.h>
+#include <unistd.h>
+
+#include <openssl/evp.h>
+
+#include "digest.h"
+#include "utils.h"
+
+// Versions carry the SHA-256 of their content in this extended attribute,
+// so that a PUT of an unchanged file can be answered without reading it.
+#define DIGEST_XATTR "user.boat.sha256"
+
+int valid_digest(const char *hex)
+{
+    int i;
+
+    for (i = 0; i < DIGEST_HEX_LENGTH; i++) {
+        if ((hex[i] < '0' || hex[i] > '9') && (hex[i] < 'a' || hex[i] > 'f') && (hex[i] < 'A' || hex[i] > 'F')) return 0;
+    }
+    return hex[i] == 0;
+}
+
+// Computes the SHA-256 of a file's content into hex, which must have room
+// for DIGEST_HEX_LENGTH + 1 characters.
+int digest_file(const char *path, char *hex)
+{
+    unsigned char buffer[65536], digest[EVP_MAX_MD_SIZE];
+    unsigned int digest_length;
+    ssize_t n;
+
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) return -1;
+
+    EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+    if (ctx == NULL || !EVP_DigestInit_ex(ctx, EVP_sha256(), NULL)) {
+        EVP_MD_CTX_free(ctx);
+        close(fd);
+        return -1;
+    }
+
+    while ((n = read(fd, buffer, sizeof(buffer))) > 0) EVP_DigestUpdate(ctx, buffer, n);
+    close(fd);
+
+    if (n == -1 || !EVP_DigestFinal_ex(ctx, digest, &digest_length)) {
+        EVP_MD_CTX_free(ctx);
+        return -1;
+    }
+    EVP_MD_CTX_free(ctx);
+
+    char *out = binary_to_hex(digest, digest_length);
+    if (out == NULL) return -1;
+    strcpy(hex, out);
+    free(out);
+    return 0;
+}
+
+// Reads the digest recorded for a version. Symlinks are followed, so this
+// works on current.* directly. Returns -1 if none has been recorded.
+int read_cached_digest(const char *path, char *hex)
+{
+    ssize_t n = getxattr(path, DIGEST_XATTR, hex, DIGEST_HEX_LENGTH);
+    if (n != DIGEST_HEX_LENGTH) return -1;
+    hex[n] = 0;
+    return valid_digest(hex) ? 0 : -1;
+}
+
+int write_cached_digest(const char *path, const char *hex)
+{
+    return setxattr(path, DIGEST_XATTR, hex, DIGEST_HEX_LENGTH, 0);
+}
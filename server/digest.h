@@ -0,0 +1,13 @@
+#ifndef __DIGEST_H
+#define __DIGEST_H
+
+#include <openssl/sha.h>
+
+#define DIGEST_HEX_LENGTH (SHA256_DIGEST_LENGTH * 2)
+
+int valid_digest(const char *hex);
+int digest_file(const char *path, char *hex);
+int read_cached_digest(const char *path, char *hex);
+int write_cached_digest(const char *path, const char *hex);
+
+#endif
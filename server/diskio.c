@@ -0,0 +1,643 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include "diskio.h"
+#include "metrics.h"
+#include "replication.h"
+
+#define RING_ENTRIES 256
+#define MAX_FREE_OPS 256
+
+// Runs the operations the ring can't: everything when io_uring isn't
+// available, and DISK_CALL always.
+struct pool_t disk_pool = POOL_INITIALIZER;
+
+static const unsigned char ring_opcodes[DISK_CALL] = {
+    [DISK_OPEN] = IORING_OP_OPENAT,
+    [DISK_WRITE] = IORING_OP_WRITEV,
+    [DISK_CLOSE] = IORING_OP_CLOSE,
+    [DISK_RENAME] = IORING_OP_RENAMEAT,
+    [DISK_UNLINK] = IORING_OP_UNLINKAT,
+    [DISK_SYMLINK] = IORING_OP_SYMLINKAT,
+    [DISK_STAT] = IORING_OP_STATX,
+    [DISK_FSYNC] = IORING_OP_FSYNC,
+    [DISK_FALLOCATE] = IORING_OP_FALLOCATE,
+};
+
+// There is no liburing here, so talk to the kernel directly.
+static int sys_io_uring_setup(unsigned int entries, struct io_uring_params *params)
+{
+    return syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int sys_io_uring_enter(int fd, unsigned int to_submit, unsigned int min_complete, unsigned int flags)
+{
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int sys_io_uring_register(int fd, unsigned int opcode, void *arg, unsigned int nr_args)
+{
+    return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static void unmap_ring(struct disk_t *disk)
+{
+    if (disk->sqes) munmap(disk->sqes, disk->entries * sizeof(struct io_uring_sqe));
+    if (disk->cq_ring && disk->cq_ring != disk->sq_ring) munmap(disk->cq_ring, disk->cq_ring_size);
+    if (disk->sq_ring) munmap(disk->sq_ring, disk->sq_ring_size);
+    if (disk->ring_fd != -1) close(disk->ring_fd);
+    disk->sqes = NULL;
+    disk->sq_ring = disk->cq_ring = NULL;
+    disk->ring_fd = -1;
+}
+
+static void *map_ring(int fd, size_t size, off_t offset)
+{
+    void *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, offset);
+    return p == MAP_FAILED ? NULL : p;
+}
+
+// Sets up the ring, has it raise event_fd whenever something completes and
+// finds out which of our operations this kernel can do through it.
+static int setup_ring(struct disk_t *disk)
+{
+    struct io_uring_params params;
+    struct io_uring_probe *probe;
+    int i;
+
+    memset(&params, 0, sizeof(params));
+    disk->ring_fd = sys_io_uring_setup(RING_ENTRIES, &params);
+    if (disk->ring_fd == -1) return -1;
+
+    disk->entries = params.sq_entries;
+    disk->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+    disk->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (disk->cq_ring_size > disk->sq_ring_size) disk->sq_ring_size = disk->cq_ring_size;
+        disk->cq_ring_size = disk->sq_ring_size;
+    }
+
+    disk->sq_ring = map_ring(disk->ring_fd, disk->sq_ring_size, IORING_OFF_SQ_RING);
+    if (disk->sq_ring == NULL) goto error;
+    if (params.features & IORING_FEAT_SINGLE_MMAP) disk->cq_ring = disk->sq_ring;
+    else if ((disk->cq_ring = map_ring(disk->ring_fd, disk->cq_ring_size, IORING_OFF_CQ_RING)) == NULL) goto error;
+    disk->sqes = map_ring(disk->ring_fd, params.sq_entries * sizeof(struct io_uring_sqe), IORING_OFF_SQES);
+    if (disk->sqes == NULL) goto error;
+
+    disk->sq_tail = (unsigned int *)((char *)disk->sq_ring + params.sq_off.tail);
+    disk->sq_mask = (unsigned int *)((char *)disk->sq_ring + params.sq_off.ring_mask);
+    disk->sq_array = (unsigned int *)((char *)disk->sq_ring + params.sq_off.array);
+    disk->cq_head = (unsigned int *)((char *)disk->cq_ring + params.cq_off.head);
+    disk->cq_tail = (unsigned int *)((char *)disk->cq_ring + params.cq_off.tail);
+    disk->cq_mask = (unsigned int *)((char *)disk->cq_ring + params.cq_off.ring_mask);
+    disk->cqes = (struct io_uring_cqe *)((char *)disk->cq_ring + params.cq_off.cqes);
+
+    if (sys_io_uring_register(disk->ring_fd, IORING_REGISTER_EVENTFD, &disk->event_fd, 1) == -1) goto error;
+
+    probe = (struct io_uring_probe *)calloc(1, sizeof(struct io_uring_probe) + IORING_OP_LAST * sizeof(struct io_uring_probe_op));
+    if (probe == NULL) goto error;
+    if (sys_io_uring_register(disk->ring_fd, IORING_REGISTER_PROBE, probe, IORING_OP_LAST) == -1) {
+        free(probe);
+        goto error;
+    }
+    for (i = 0; i < DISK_CALL; i++) {
+        disk->supported[i] = ring_opcodes[i] <= probe->last_op && (probe->ops[ring_opcodes[i]].flags & IO_URING_OP_SUPPORTED);
+    }
+    free(probe);
+
+    return 0;
+
+error:
+    unmap_ring(disk);
+    return -1;
+}
+
+// Points the iovec at as much of the data still to be written as it will
+// hold; a write covering more buffer chains than that goes in pieces.
+static void prepare_write(struct disk_op_t *op)
+{
+    struct evbuffer_iovec vec[DISK_MAX_IOV];
+    int i, count = evbuffer_peek(op->data, -1, NULL, vec, DISK_MAX_IOV);
+
+    if (count > DISK_MAX_IOV) count = DISK_MAX_IOV;
+    for (i = 0; i < count; i++) {
+        op->iov[i].iov_base = vec[i].iov_base;
+        op->iov[i].iov_len = vec[i].iov_len;
+    }
+    op->iov_count = count;
+}
+
+static void push_to_ring(struct disk_t *disk, struct disk_op_t *op)
+{
+    unsigned int tail = *disk->sq_tail;
+    unsigned int index = tail & *disk->sq_mask;
+    struct io_uring_sqe *sqe = &disk->sqes[index];
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = ring_opcodes[op->opcode];
+    sqe->user_data = (uintptr_t)op;
+
+    switch (op->opcode) {
+    case DISK_OPEN:
+        sqe->fd = AT_FDCWD;
+        sqe->addr = (uintptr_t)op->path;
+        sqe->len = op->mode;
+        sqe->open_flags = op->flags;
+        break;
+    case DISK_WRITE:
+        prepare_write(op);
+        sqe->fd = op->fd;
+        sqe->addr = (uintptr_t)op->iov;
+        sqe->len = op->iov_count;
+        sqe->off = op->offset + op->written;
+        break;
+    case DISK_CLOSE:
+        sqe->fd = op->fd;
+        break;
+    case DISK_RENAME:
+        sqe->fd = AT_FDCWD;
+        sqe->addr = (uintptr_t)op->path;
+        sqe->len = (unsigned int)AT_FDCWD;
+        sqe->addr2 = (uintptr_t)op->path2;
+        break;
+    case DISK_UNLINK:
+        sqe->fd = AT_FDCWD;
+        sqe->addr = (uintptr_t)op->path;
+        break;
+    case DISK_SYMLINK:
+        sqe->fd = AT_FDCWD;
+        sqe->addr = (uintptr_t)op->path;
+        sqe->addr2 = (uintptr_t)op->path2;
+        break;
+    case DISK_STAT:
+        sqe->fd = AT_FDCWD;
+        sqe->addr = (uintptr_t)op->path;
+        sqe->len = STATX_BASIC_STATS;
+        sqe->off = (uintptr_t)&op->stx;
+        break;
+    case DISK_FSYNC:
+        sqe->fd = op->fd;
+        sqe->fsync_flags = (op->flags & DISK_DATASYNC) ? IORING_FSYNC_DATASYNC : 0;
+        break;
+    case DISK_FALLOCATE:
+        sqe->fd = op->fd;
+        sqe->off = op->offset;
+        sqe->addr = op->length;
+        sqe->len = op->flags;
+        break;
+    case DISK_CALL:
+    case DISK_COMMIT:
+        break;
+    }
+
+    disk->sq_array[index] = index;
+    __atomic_store_n(disk->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    disk->in_ring++;
+    disk->unsubmitted++;
+}
+
+// Hands newly queued entries to the kernel. Anything it won't take right now
+// stays in the submission queue and goes with the next call.
+static void enter_ring(struct disk_t *disk)
+{
+    while (disk->unsubmitted > 0) {
+        int n = sys_io_uring_enter(disk->ring_fd, disk->unsubmitted, 0, 0);
+        if (n == -1 && errno == EINTR) continue;
+        if (n <= 0) return;
+        disk->unsubmitted -= n;
+    }
+}
+
+static void free_op(struct disk_t *disk, struct disk_op_t *op)
+{
+    if (op->data) evbuffer_drain(op->data, evbuffer_get_length(op->data));
+
+    if (disk->free_op_count >= MAX_FREE_OPS) {
+        if (op->data) evbuffer_free(op->data);
+        free(op);
+        return;
+    }
+
+    op->next = disk->free_ops;
+    disk->free_ops = op;
+    disk->free_op_count++;
+}
+
+static void schedule_writes(struct disk_t *disk);
+
+static void finish_op(struct disk_op_t *op)
+{
+    struct disk_t *disk = op->disk;
+    int scheduled = op->flow != NULL;
+
+    if (scheduled) disk->writes_in_flight -= op->length;
+    op->done(op);
+    free_op(disk, op);
+    if (scheduled) schedule_writes(disk);
+}
+
+// Queues an operation that has been carried out on another thread for its
+// disk's event loop.
+static void finished_elsewhere(struct disk_op_t *op)
+{
+    struct disk_t *disk = op->disk;
+    uint64_t one = 1;
+
+    pthread_mutex_lock(&disk->lock);
+    op->next = disk->finished;
+    disk->finished = op;
+    pthread_mutex_unlock(&disk->lock);
+
+    if (write(disk->event_fd, &one, sizeof(one)) == -1) {
+        // The counter can only be full if the loop has a wakeup pending
+        // already.
+    }
+}
+
+// Runs an operation the blocking way on a disk thread.
+static void run_job(struct pool_job_t *job)
+{
+    struct disk_op_t *op = (struct disk_op_t *)job;
+    int n = 0;
+
+    switch (op->opcode) {
+    case DISK_OPEN:
+        n = open(op->path, op->flags, op->mode);
+        break;
+    case DISK_WRITE:
+        while (n != -1 && evbuffer_get_length(op->data) > 0) {
+            prepare_write(op);
+            ssize_t written = pwritev(op->fd, op->iov, op->iov_count, op->offset + op->written);
+            if (written == -1) {
+                if (errno != EINTR) n = -1;
+                continue;
+            }
+            evbuffer_drain(op->data, written);
+            op->written += written;
+        }
+        if (n != -1) n = op->written;
+        break;
+    case DISK_CLOSE:
+        n = close(op->fd);
+        break;
+    case DISK_RENAME:
+        n = rename(op->path, op->path2);
+        break;
+    case DISK_UNLINK:
+        n = unlink(op->path);
+        break;
+    case DISK_SYMLINK:
+        n = symlink(op->path, op->path2);
+        break;
+    case DISK_STAT:
+        n = statx(AT_FDCWD, op->path, 0, STATX_BASIC_STATS, &op->stx);
+        break;
+    case DISK_FSYNC:
+        n = (op->flags & DISK_DATASYNC) ? fdatasync(op->fd) : fsync(op->fd);
+        break;
+    case DISK_FALLOCATE:
+        n = fallocate(op->fd, op->flags, op->offset, op->length);
+        break;
+    case DISK_CALL:
+        n = op->call(op->arg);
+        break;
+    case DISK_COMMIT:
+        break;
+    }
+    op->result = (n == -1 && op->opcode != DISK_CALL) ? -errno : n;
+
+    finished_elsewhere(op);
+}
+
+// Durable saves need their directory synced once the new version and its
+// symlink are in place. Saves tend to finish in bunches, so rather than
+// each syncing on its own, DISK_COMMIT operations from every worker queue
+// up here and a single thread syncs each directory once for the lot. The
+// window gives saves that are just behind a chance to join in.
+static pthread_mutex_t commit_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t commit_ready = PTHREAD_COND_INITIALIZER;
+static struct disk_op_t *commit_head = NULL, *commit_tail = NULL;
+static int commit_window_us;
+
+static int sync_path(const char *path, int filesystem)
+{
+    int fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd == -1) return -errno;
+
+    int n = filesystem ? syncfs(fd) : fsync(fd);
+    int error = errno;
+    close(fd);
+    return n == -1 ? -error : 0;
+}
+
+static void *commit_thread(void *arg)
+{
+    struct disk_op_t *batch, *op, *other, *next;
+    int saves, filesystem_synced;
+
+    for (;;) {
+        pthread_mutex_lock(&commit_lock);
+        while (commit_head == NULL) pthread_cond_wait(&commit_ready, &commit_lock);
+        pthread_mutex_unlock(&commit_lock);
+
+        if (commit_window_us > 0) usleep(commit_window_us);
+
+        pthread_mutex_lock(&commit_lock);
+        batch = commit_head;
+        commit_head = commit_tail = NULL;
+        pthread_mutex_unlock(&commit_lock);
+
+        uint64_t started = metrics_now();
+        saves = 0;
+        filesystem_synced = 0;
+
+        // The saves' versions are already in the replication log.
+        replication_sync();
+
+        // Syncing the whole filesystem covers every directory, so when a
+        // save needs that, do it first.
+        for (op = batch; op; op = op->next) {
+            if ((op->flags & DISK_SYNC_FILESYSTEM) && !filesystem_synced) {
+                if ((op->result = sync_path(op->path, 1)) == 0) filesystem_synced = 1;
+            }
+        }
+
+        for (op = batch; op; op = op->next) {
+            saves++;
+            if (op->result < 0) continue;
+            for (other = batch; other != op; other = other->next) {
+                if (!strcmp(other->path, op->path)) break;
+            }
+            op->result = other != op ? other->result : sync_path(op->path, 0);
+        }
+
+        METRIC_INC(group_commits);
+        METRIC_ADD(group_committed_saves, saves);
+        METRIC_OBSERVE(group_commit, metrics_now() - started);
+
+        for (op = batch; op; op = next) {
+            next = op->next;
+            finished_elsewhere(op);
+        }
+    }
+
+    return NULL;
+}
+
+int disk_start_group_commit(int window_ms)
+{
+    pthread_t thread;
+
+    commit_window_us = window_ms * 1000;
+    if (pthread_create(&thread, NULL, commit_thread, NULL) != 0) return -1;
+    pthread_detach(thread);
+    return 0;
+}
+
+static void submit_commit(struct disk_op_t *op)
+{
+    op->next = NULL;
+
+    pthread_mutex_lock(&commit_lock);
+    if (commit_tail) commit_tail->next = op;
+    else commit_head = op;
+    commit_tail = op;
+    pthread_cond_signal(&commit_ready);
+    pthread_mutex_unlock(&commit_lock);
+}
+
+// Sends an operation to the ring, or the disk threads if the ring can't do
+// it, queueing it while the ring is full.
+static void dispatch(struct disk_t *disk, struct disk_op_t *op)
+{
+    if (disk->ring_fd == -1 || op->opcode == DISK_CALL || !disk->supported[op->opcode]) {
+        pool_submit(&disk_pool, &op->job);
+        return;
+    }
+
+    if (disk->in_ring >= disk->entries) {
+        op->next = NULL;
+        if (disk->backlog_tail) disk->backlog_tail->next = op;
+        else disk->backlog = op;
+        disk->backlog_tail = op;
+        return;
+    }
+
+    push_to_ring(disk, op);
+    enter_ring(disk);
+}
+
+// Lets queued writes go while the window has room. The flow at the front
+// writes while its deficit covers its next write; when it doesn't, the flow
+// goes to the back with another quantum to spend next time, and a flow
+// whose queue empties leaves the round with nothing saved up.
+static void schedule_writes(struct disk_t *disk)
+{
+    struct disk_flow_t *flow;
+    struct disk_op_t *op;
+
+    while ((flow = disk->flows) && disk->writes_in_flight < DISK_WRITE_WINDOW) {
+        op = flow->head;
+        if ((long)op->length > flow->deficit) {
+            flow->deficit += (long)DISK_WRITE_QUANTUM * flow->weight;
+            if (flow->next) {
+                disk->flows = flow->next;
+                disk->flows_tail->next = flow;
+                disk->flows_tail = flow;
+                flow->next = NULL;
+            }
+            continue;
+        }
+
+        flow->deficit -= op->length;
+        if ((flow->head = op->next) == NULL) {
+            flow->tail = NULL;
+            flow->queued = 0;
+            flow->deficit = 0;
+            if ((disk->flows = flow->next) == NULL) disk->flows_tail = NULL;
+            flow->next = NULL;
+        }
+
+        disk->writes_in_flight += op->length;
+        dispatch(disk, op);
+    }
+}
+
+static void reap_ring(struct disk_t *disk)
+{
+    struct disk_op_t *op;
+    unsigned int head;
+
+    while ((head = *disk->cq_head) != __atomic_load_n(disk->cq_tail, __ATOMIC_ACQUIRE)) {
+        struct io_uring_cqe *cqe = &disk->cqes[head & *disk->cq_mask];
+        op = (struct disk_op_t *)(uintptr_t)cqe->user_data;
+        op->result = cqe->res;
+        __atomic_store_n(disk->cq_head, head + 1, __ATOMIC_RELEASE);
+        disk->in_ring--;
+
+        // A short write carries on from where it stopped.
+        if (op->opcode == DISK_WRITE && op->result >= 0) {
+            evbuffer_drain(op->data, op->result);
+            op->written += op->result;
+            if (evbuffer_get_length(op->data) > 0) {
+                if (op->result > 0) {
+                    dispatch(disk, op);
+                    continue;
+                }
+                op->result = -EIO;
+            }
+            else {
+                op->result = op->written;
+            }
+        }
+
+        finish_op(op);
+    }
+
+    while (disk->backlog && disk->in_ring < disk->entries) {
+        op = disk->backlog;
+        disk->backlog = op->next;
+        if (disk->backlog == NULL) disk->backlog_tail = NULL;
+        push_to_ring(disk, op);
+    }
+    enter_ring(disk);
+}
+
+static void disk_cb(evutil_socket_t fd, short what, void *arg)
+{
+    struct disk_t *disk = (struct disk_t *)arg;
+    struct disk_op_t *op, *next, *finished = NULL;
+    uint64_t count;
+
+    if (read(disk->event_fd, &count, sizeof(count)) == -1 && errno != EAGAIN) return;
+
+    if (disk->ring_fd != -1) reap_ring(disk);
+
+    pthread_mutex_lock(&disk->lock);
+    op = disk->finished;
+    disk->finished = NULL;
+    pthread_mutex_unlock(&disk->lock);
+
+    // The disk threads push onto the front, so turn the list around to
+    // complete things in the order they finished.
+    for (; op; op = next) {
+        next = op->next;
+        op->next = finished;
+        finished = op;
+    }
+    while ((op = finished)) {
+        finished = op->next;
+        finish_op(op);
+    }
+}
+
+// Returns 0 once `disk` is ready, whether or not it got an io_uring, or -1.
+int disk_init(struct disk_t *disk, struct event_base *evbase, int use_io_uring)
+{
+    memset(disk, 0, sizeof(struct disk_t));
+    disk->evbase = evbase;
+    disk->ring_fd = -1;
+    pthread_mutex_init(&disk->lock, NULL);
+
+    disk->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (disk->event_fd == -1) return -1;
+
+    disk->event = event_new(evbase, disk->event_fd, EV_READ | EV_PERSIST, disk_cb, disk);
+    if (disk->event == NULL || event_add(disk->event, NULL) != 0) return -1;
+
+    if (use_io_uring) setup_ring(disk); // falls back to the disk threads
+    return 0;
+}
+
+void disk_free(struct disk_t *disk)
+{
+    struct disk_op_t *op;
+
+    unmap_ring(disk);
+    if (disk->event) event_free(disk->event);
+    close(disk->event_fd);
+    while ((op = disk->free_ops)) {
+        disk->free_ops = op->next;
+        if (op->data) evbuffer_free(op->data);
+        free(op);
+    }
+    pthread_mutex_destroy(&disk->lock);
+}
+
+// Operations are recycled through a free list on their disk, which only its
+// own event loop touches.
+struct disk_op_t *disk_op_new(struct disk_t *disk, enum disk_opcode opcode, void (*done)(struct disk_op_t *op), void *arg)
+{
+    struct disk_op_t *op = disk->free_ops;
+    struct evbuffer *data = NULL;
+
+    if (op) {
+        disk->free_ops = op->next;
+        disk->free_op_count--;
+        data = op->data;
+    }
+    else if ((op = (struct disk_op_t *)malloc(sizeof(struct disk_op_t))) == NULL) {
+        return NULL;
+    }
+
+    memset(op, 0, sizeof(struct disk_op_t));
+    op->job.run = run_job;
+    op->opcode = opcode;
+    op->fd = -1;
+    op->data = data;
+    op->done = done;
+    op->arg = arg;
+    op->disk = disk;
+
+    if (opcode == DISK_WRITE && op->data == NULL && (op->data = evbuffer_new()) == NULL) {
+        free(op);
+        return NULL;
+    }
+
+    return op;
+}
+
+// Starts an operation. Its `done` callback runs on the disk's event loop,
+// never from inside this call.
+void disk_submit(struct disk_op_t *op)
+{
+    struct disk_t *disk = op->disk;
+
+    if (op->opcode == DISK_COMMIT) {
+        submit_commit(op);
+        return;
+    }
+
+    if (op->flow) {
+        struct disk_flow_t *flow = op->flow;
+
+        op->next = NULL;
+        if (flow->tail) flow->tail->next = op;
+        else flow->head = op;
+        flow->tail = op;
+
+        if (!flow->queued) {
+            flow->queued = 1;
+            flow->deficit = (long)DISK_WRITE_QUANTUM * flow->weight;
+            flow->next = NULL;
+            if (disk->flows_tail) disk->flows_tail->next = flow;
+            else disk->flows = flow;
+            disk->flows_tail = flow;
+        }
+
+        schedule_writes(disk);
+        return;
+    }
+
+    dispatch(disk, op);
+}
@@ -0,0 +1,131 @@
+#ifndef __DISKIO_H
+#define __DISKIO_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <linux/stat.h>
+#include <event2/buffer.h>
+#include <event2/event.h>
+
+#include "pool.h"
+
+// Stop reading from a client once this much of its upload is waiting to be
+// written, and start again once it's down to the low water mark.
+#define DISK_WRITE_LOW_WATER (2 * 1024 * 1024)
+#define DISK_WRITE_HIGH_WATER (8 * 1024 * 1024)
+
+#define DISK_MAX_IOV 16
+
+// Writes that belong to a flow are scheduled fairly: each disk engine keeps
+// at most DISK_WRITE_WINDOW bytes of them in flight, and while more are
+// waiting the flows take turns, each writing DISK_WRITE_QUANTUM bytes a
+// round for every unit of its weight (deficit round robin). A small upload
+// waits for its turn rather than for everything a large one has queued.
+#define DISK_WRITE_WINDOW (4 * 1024 * 1024)
+#define DISK_WRITE_QUANTUM (256 * 1024)
+
+enum disk_opcode { DISK_OPEN, DISK_WRITE, DISK_CLOSE, DISK_RENAME, DISK_UNLINK, DISK_SYMLINK, DISK_STAT, DISK_FSYNC, DISK_FALLOCATE, DISK_CALL, DISK_COMMIT };
+
+// Flags for DISK_FSYNC and DISK_COMMIT.
+#define DISK_DATASYNC 1
+#define DISK_SYNC_FILESYSTEM 2
+
+// One stream of writes, normally an upload's, and its place in the round.
+struct disk_flow_t
+{
+    unsigned int weight;
+    long deficit;
+    struct disk_op_t *head, *tail;
+    struct disk_flow_t *next;
+    int queued;
+};
+
+// One file operation, submitted from an event loop and completed back on
+// the same loop by calling `done`. `result` is what the system call
+// returned, or -errno if it failed. Paths are not copied, so they must stay
+// put until the operation is done.
+struct disk_op_t
+{
+    struct pool_job_t job;
+    enum disk_opcode opcode;
+    int fd;
+    const char *path;
+    const char *path2;
+    int flags;
+    mode_t mode;
+
+    // DISK_WRITE writes all of `data` at `offset`, waiting its turn in
+    // `flow` if it has one; `length` is how much data there is.
+    // DISK_FALLOCATE allocates `length` bytes at `offset`, with `flags` as
+    // its mode.
+    struct disk_flow_t *flow;
+    off_t offset;
+    struct evbuffer *data;
+    size_t length;
+    size_t written;
+    struct iovec iov[DISK_MAX_IOV];
+    int iov_count;
+
+    // DISK_STAT fills this in.
+    struct statx stx;
+
+    // DISK_CALL runs `call(arg)` on a disk thread and returns its result,
+    // for work that has no system call of its own. DISK_COMMIT makes the
+    // directory `path` durable along with whatever else is in the same
+    // group commit; see disk_start_group_commit().
+    int (*call)(void *arg);
+
+    void (*done)(struct disk_op_t *op);
+    void *arg;
+    int result;
+    uint64_t started;
+
+    struct disk_t *disk;
+    struct disk_op_t *next;
+};
+
+// Each worker has its own disk engine. Operations go to the kernel through
+// an io_uring where it supports them, and to the disk threads otherwise;
+// either way completions are signalled on `event_fd` and handled on the
+// worker's event loop.
+struct disk_t
+{
+    struct event_base *evbase;
+    int event_fd;
+    struct event *event;
+
+    int ring_fd;
+    unsigned char supported[DISK_CALL];
+    unsigned int entries;
+    unsigned int *sq_tail, *sq_mask, *sq_array;
+    unsigned int *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ring, *cq_ring;
+    size_t sq_ring_size, cq_ring_size;
+    unsigned int in_ring;
+    unsigned int unsubmitted;
+    struct disk_op_t *backlog, *backlog_tail;
+
+    // Flows with writes waiting, in the order they get their turns.
+    struct disk_flow_t *flows, *flows_tail;
+    size_t writes_in_flight;
+
+    pthread_mutex_t lock;
+    struct disk_op_t *finished;
+
+    struct disk_op_t *free_ops;
+    int free_op_count;
+};
+
+extern struct pool_t disk_pool;
+
+int disk_init(struct disk_t *disk, struct event_base *evbase, int use_io_uring);
+void disk_free(struct disk_t *disk);
+struct disk_op_t *disk_op_new(struct disk_t *disk, enum disk_opcode opcode, void (*done)(struct disk_op_t *op), void *arg);
+void disk_submit(struct disk_op_t *op);
+int disk_start_group_commit(int window_ms);
+
+#endif
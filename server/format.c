@@ -0,0 +1,32 @@
+#include <string.h>
+#include <sys/xattr.h>
+
+#include "format.h"
+
+#define FORMAT_XATTR "user.boat.format"
+
+static const char *format_names[] = { "plain", "manifest", "gzip" };
+
+// Marks the version being written to `fd`. Plain versions carry no mark.
+int set_version_format(int fd, enum version_format format)
+{
+    if (format == FORMAT_PLAIN) return 0;
+    return fsetxattr(fd, FORMAT_XATTR, format_names[format], strlen(format_names[format]), 0);
+}
+
+// Symlinks are followed, so this works on current.* directly. A version
+// without a mark, or one that can't be read, is plain.
+enum version_format version_format(const char *path)
+{
+    char name[16];
+    size_t i;
+
+    ssize_t n = getxattr(path, FORMAT_XATTR, name, sizeof(name) - 1);
+    if (n <= 0) return FORMAT_PLAIN;
+    name[n] = 0;
+
+    for (i = 0; i < sizeof(format_names) / sizeof(format_names[0]); i++) {
+        if (!strcmp(name, format_names[i])) return (enum version_format)i;
+    }
+    return FORMAT_PLAIN;
+}
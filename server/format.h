@@ -0,0 +1,12 @@
+#ifndef __FORMAT_H
+#define __FORMAT_H
+
+// How a version's content is stored. It is recorded in an extended
+// attribute as the version is written, never guessed from the content,
+// which is whatever the client sent.
+enum version_format { FORMAT_PLAIN = 0, FORMAT_MANIFEST, FORMAT_COMPRESSED };
+
+int set_version_format(int fd, enum version_format format);
+enum version_format version_format(const char *path);
+
+#endif
@@ -0,0 +1,89 @@
+// libFuzzer target for boatd's command parser:
+//
+//   make fuzz && ./fuzz_parser -max_len=4096
+//
+// The first byte of the input picks a buffer chain size and the rest is
+// split into chains of that size, so that lines straddle chains the way
+// they do off the network. Each command read_command() takes off the
+// buffer must match what copying the line out whole with
+// read_command_line() gives, and every argument is run through
+// parse_number() and checked against a plain reference.
+#include <limits.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <event2/buffer.h>
+
+#include "constants.h"
+#include "parser.h"
+
+static void add_chained(struct evbuffer *buffer, const uint8_t *data, size_t size, size_t chain_size)
+{
+    size_t offset;
+
+    for (offset = 0; offset < size; offset += chain_size) {
+        evbuffer_add_reference(buffer, data + offset, size - offset < chain_size ? size - offset : chain_size, NULL, NULL);
+    }
+}
+
+static int reference_number(const char *value, unsigned long long max, unsigned long long *result)
+{
+    unsigned long long n = 0;
+    const char *p;
+
+    if (*value == 0) return -1;
+    for (p = value; *p; p++) {
+        if (*p < '0' || *p > '9') return -1;
+        if (__builtin_mul_overflow(n, 10, &n) || __builtin_add_overflow(n, *p - '0', &n)) return -1;
+    }
+    if (n > max) return -1;
+
+    *result = n;
+    return 0;
+}
+
+static void check_number(const char *value, unsigned long long max)
+{
+    unsigned long long parsed = 0, expected = 0;
+    int n = parse_number(value, max, &parsed);
+
+    if (n != reference_number(value, max, &expected) || (n == 0 && parsed != expected)) abort();
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    char line[MAX_COMMAND_LENGTH + 1], whole[MAX_COMMAND_LENGTH + 1], *args, *space;
+    enum command command;
+    int n, m;
+
+    if (size < 1) return 0;
+    size_t chain_size = data[0] + 1;
+    data++;
+    size--;
+
+    struct evbuffer *in = evbuffer_new(), *copy = evbuffer_new();
+    if (in == NULL || copy == NULL) abort();
+    add_chained(in, data, size, chain_size);
+    add_chained(copy, data, size, size ? size : 1);
+
+    for (;;) {
+        n = read_command(in, line, sizeof(line), &command, &args);
+        m = read_command_line(copy, whole, sizeof(whole));
+        if (n != m) abort();
+        if (n != 1) break;
+
+        size_t length = strlen(whole);
+        space = memchr(whole, ' ', length);
+        if (command != lookup_command(whole, space ? (size_t)(space - whole) : length)) abort();
+        if (strcmp(args, space ? space + 1 : "")) abort();
+
+        check_number(args, ULLONG_MAX);
+        check_number(args, MAX_BLOCK_SIZE);
+        check_number(args, MAX_STREAM_ID);
+    }
+
+    evbuffer_free(in);
+    evbuffer_free(copy);
+    return 0;
+}
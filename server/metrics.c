@@ -0,0 +1,191 @@
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <event2/buffer.h>
+#include <event2/http.h>
+
+#include "budget.h"
+#include "configuration.h"
+#include "metrics.h"
+#include "replication.h"
+#include "worker.h"
+
+// Anything recorded outside a worker thread lands here.
+static struct metrics_t unowned_metrics;
+__thread struct metrics_t *thread_metrics = &unowned_metrics;
+
+static struct worker_t *metrics_workers;
+static int metrics_worker_count;
+
+uint64_t metrics_now(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+void histogram_observe(struct histogram_t *histogram, uint64_t microseconds)
+{
+    int i = microseconds ? 64 - __builtin_clzll(microseconds) : 0;
+    if (i >= HISTOGRAM_BUCKETS) i = HISTOGRAM_BUCKETS - 1;
+
+    metric_add(&histogram->buckets[i], 1);
+    metric_add(&histogram->count, 1);
+    metric_add(&histogram->sum, microseconds);
+}
+
+#define LOAD(field) __atomic_load_n(&(field), __ATOMIC_RELAXED)
+
+static void sum_histogram(struct histogram_t *total, const struct histogram_t *histogram)
+{
+    int i;
+    for (i = 0; i < HISTOGRAM_BUCKETS; i++) total->buckets[i] += LOAD(histogram->buckets[i]);
+    total->count += LOAD(histogram->count);
+    total->sum += LOAD(histogram->sum);
+}
+
+static void sum_metrics(struct metrics_t *total, const struct metrics_t *metrics)
+{
+    total->connections_accepted += LOAD(metrics->connections_accepted);
+    total->connections_closed += LOAD(metrics->connections_closed);
+    total->handshake_failures += LOAD(metrics->handshake_failures);
+    total->handshakes_full += LOAD(metrics->handshakes_full);
+    total->handshakes_resumed += LOAD(metrics->handshakes_resumed);
+    total->auth_successes += LOAD(metrics->auth_successes);
+    total->auth_failures += LOAD(metrics->auth_failures);
+    total->bytes_received += LOAD(metrics->bytes_received);
+    total->blocks_received += LOAD(metrics->blocks_received);
+    total->bytes_sent += LOAD(metrics->bytes_sent);
+    total->files_saved += LOAD(metrics->files_saved);
+    total->files_unchanged += LOAD(metrics->files_unchanged);
+    total->hash_mismatches += LOAD(metrics->hash_mismatches);
+    total->system_errors += LOAD(metrics->system_errors);
+    total->disk_write_microseconds += LOAD(metrics->disk_write_microseconds);
+    total->group_commits += LOAD(metrics->group_commits);
+    total->group_committed_saves += LOAD(metrics->group_committed_saves);
+    total->batches_received += LOAD(metrics->batches_received);
+    total->versions_expired += LOAD(metrics->versions_expired);
+    total->retention_busy_passes += LOAD(metrics->retention_busy_passes);
+    total->chunks_removed += LOAD(metrics->chunks_removed);
+    total->memory_waits += LOAD(metrics->memory_waits);
+    total->versions_replicated += LOAD(metrics->versions_replicated);
+    total->replicated_bytes += LOAD(metrics->replicated_bytes);
+    sum_histogram(&total->handshake, &metrics->handshake);
+    sum_histogram(&total->pass, &metrics->pass);
+    sum_histogram(&total->block_per_mb, &metrics->block_per_mb);
+    sum_histogram(&total->save, &metrics->save);
+    sum_histogram(&total->save_commit, &metrics->save_commit);
+    sum_histogram(&total->save_sync, &metrics->save_sync);
+    sum_histogram(&total->group_commit, &metrics->group_commit);
+    sum_histogram(&total->batch, &metrics->batch);
+    sum_histogram(&total->retention_pass, &metrics->retention_pass);
+}
+
+static void print_counter(struct evbuffer *out, const char *name, const char *help, uint64_t value)
+{
+    evbuffer_add_printf(out, "# HELP %s %s\n# TYPE %s counter\n%s %llu\n", name, help, name, name, (unsigned long long)value);
+}
+
+static void print_histogram(struct evbuffer *out, const char *name, const char *help, const struct histogram_t *histogram)
+{
+    uint64_t cumulative = 0;
+    int i;
+
+    evbuffer_add_printf(out, "# HELP %s %s\n# TYPE %s histogram\n", name, help, name);
+    for (i = 0; i < HISTOGRAM_BUCKETS - 1; i++) {
+        cumulative += histogram->buckets[i];
+        evbuffer_add_printf(out, "%s_bucket{le=\"%.6f\"} %llu\n", name, (double)(1ULL << i) / 1e6, (unsigned long long)cumulative);
+    }
+    evbuffer_add_printf(out, "%s_bucket{le=\"+Inf\"} %llu\n", name, (unsigned long long)histogram->count);
+    evbuffer_add_printf(out, "%s_sum %.6f\n", name, (double)histogram->sum / 1e6);
+    evbuffer_add_printf(out, "%s_count %llu\n", name, (unsigned long long)histogram->count);
+}
+
+static void metrics_cb(struct evhttp_request *request, void *arg)
+{
+    struct metrics_t total;
+    struct evbuffer *out;
+    int i;
+
+    if (strcmp(evhttp_request_get_uri(request), "/metrics")) {
+        evhttp_send_error(request, HTTP_NOTFOUND, NULL);
+        return;
+    }
+
+    memset(&total, 0, sizeof(total));
+    sum_metrics(&total, &unowned_metrics);
+    for (i = 0; i < metrics_worker_count; i++) sum_metrics(&total, &metrics_workers[i].metrics);
+
+    out = evbuffer_new();
+    if (out == NULL) {
+        evhttp_send_error(request, HTTP_INTERNAL, NULL);
+        return;
+    }
+
+    print_counter(out, "boat_connections_accepted_total", "Connections accepted.", total.connections_accepted);
+    evbuffer_add_printf(out, "# HELP boat_connections_open Connections currently open.\n# TYPE boat_connections_open gauge\nboat_connections_open %llu\n",
+            (unsigned long long)(total.connections_accepted - total.connections_closed));
+    print_counter(out, "boat_handshake_failures_total", "Connections that dropped before completing the TLS handshake.", total.handshake_failures);
+    print_counter(out, "boat_handshakes_full_total", "TLS handshakes that set up a new session.", total.handshakes_full);
+    print_counter(out, "boat_handshakes_resumed_total", "TLS handshakes that resumed a session from the cache or a ticket.", total.handshakes_resumed);
+    print_counter(out, "boat_auth_successes_total", "Successful logins.", total.auth_successes);
+    print_counter(out, "boat_auth_failures_total", "Failed logins.", total.auth_failures);
+    print_counter(out, "boat_received_bytes_total", "File data received in BLOCKs.", total.bytes_received);
+    print_counter(out, "boat_blocks_received_total", "BLOCKs received.", total.blocks_received);
+    print_counter(out, "boat_sent_bytes_total", "File data sent in reply to GET.", total.bytes_sent);
+    print_counter(out, "boat_files_saved_total", "New versions saved.", total.files_saved);
+    print_counter(out, "boat_files_unchanged_total", "PUTs skipped because the file was unchanged.", total.files_unchanged);
+    print_counter(out, "boat_hash_mismatches_total", "SAVEs rejected because the data didn't match the client's hash.", total.hash_mismatches);
+    print_counter(out, "boat_system_errors_total", "Sessions ended by a server-side error.", total.system_errors);
+    evbuffer_add_printf(out, "# HELP boat_disk_write_seconds_total Time spent writing received data to disk.\n# TYPE boat_disk_write_seconds_total counter\nboat_disk_write_seconds_total %.6f\n",
+            (double)total.disk_write_microseconds / 1e6);
+    print_counter(out, "boat_group_commits_total", "Group commits run for durable saves.", total.group_commits);
+    print_counter(out, "boat_group_committed_saves_total", "Durable saves made durable by group commits.", total.group_committed_saves);
+    print_counter(out, "boat_batches_received_total", "MPUT batches received.", total.batches_received);
+    print_counter(out, "boat_versions_expired_total", "Old versions removed by retention policies.", total.versions_expired);
+    print_counter(out, "boat_retention_busy_passes_total", "Retention passes that stopped waiting for uploads to finish and went on at a reduced rate.", total.retention_busy_passes);
+    print_counter(out, "boat_chunks_removed_total", "Deduplicated chunks removed because no version used them any more.", total.chunks_removed);
+    evbuffer_add_printf(out, "# HELP boat_buffered_bytes Client data held in memory, waiting to be processed or written.\n# TYPE boat_buffered_bytes gauge\nboat_buffered_bytes %lld\n",
+            (long long)atomic_load(&buffered_bytes));
+    print_counter(out, "boat_memory_waits_total", "Times a session stopped reading because the server was over its memory budget.", total.memory_waits);
+    print_counter(out, "boat_versions_replicated_total", "Saved versions sent to replicas.", total.versions_replicated);
+    print_counter(out, "boat_replicated_bytes_total", "File data sent to replicas.", total.replicated_bytes);
+    evbuffer_add_printf(out, "# HELP boat_replication_backlog Saved versions the replica furthest behind has yet to be sent.\n# TYPE boat_replication_backlog gauge\nboat_replication_backlog %llu\n",
+            (unsigned long long)replication_backlog());
+    print_histogram(out, "boat_handshake_seconds", "TLS handshake time, from accept to handshake complete.", &total.handshake);
+    print_histogram(out, "boat_pass_seconds", "Time to check a password.", &total.pass);
+    print_histogram(out, "boat_block_seconds_per_megabyte", "Time to receive a BLOCK, scaled to one megabyte.", &total.block_per_mb);
+    print_histogram(out, "boat_save_seconds", "Time to complete a SAVE.", &total.save);
+    print_histogram(out, "boat_save_commit_seconds", "Time SAVE spends renaming the version into place and updating the current symlink.", &total.save_commit);
+    print_histogram(out, "boat_save_sync_seconds", "Time a durable SAVE waits for its group commit, including the batching window.", &total.save_sync);
+    print_histogram(out, "boat_group_commit_seconds", "Time a group commit spends syncing directories.", &total.group_commit);
+    print_histogram(out, "boat_batch_seconds", "Time from MPUT to its reply, including receiving the files.", &total.batch);
+    print_histogram(out, "boat_retention_pass_seconds", "Time a retention pass takes over every repository, including waiting for uploads.", &total.retention_pass);
+
+    evhttp_add_header(evhttp_request_get_output_headers(request), "Content-Type", "text/plain; version=0.0.4");
+    evhttp_send_reply(request, HTTP_OK, "OK", out);
+    evbuffer_free(out);
+}
+
+// Serves the metrics in Prometheus text format over HTTP on the loopback
+// interface only; there is no authentication, so it must not be reachable
+// from outside the host.
+int metrics_listen(struct event_base *base, struct worker_t *workers, int worker_count)
+{
+    struct evhttp *http;
+
+    metrics_workers = workers;
+    metrics_worker_count = worker_count;
+
+    http = evhttp_new(base);
+    if (http == NULL) return -1;
+
+    evhttp_set_allowed_methods(http, EVHTTP_REQ_GET);
+    evhttp_set_gencb(http, metrics_cb, NULL);
+    if (evhttp_bind_socket(http, "127.0.0.1", configuration.metrics_port) != 0) {
+        evhttp_free(http);
+        return -1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,78 @@
+#ifndef __METRICS_H
+#define __METRICS_H
+
+#include <stdint.h>
+#include <event2/event.h>
+
+// Latencies are recorded in microseconds into power-of-two buckets: bucket
+// i counts observations below 2^i us, the last one everything else.
+#define HISTOGRAM_BUCKETS 28
+
+struct histogram_t
+{
+    uint64_t buckets[HISTOGRAM_BUCKETS];
+    uint64_t count;
+    uint64_t sum;
+};
+
+// One of these per worker. Only the owning thread writes to it, with plain
+// relaxed stores, so the hot path takes no locks and no locked instructions;
+// the metrics listener sums the workers' copies when it is scraped.
+struct metrics_t
+{
+    uint64_t connections_accepted;
+    uint64_t connections_closed;
+    uint64_t handshake_failures;
+    uint64_t handshakes_full;
+    uint64_t handshakes_resumed;
+    uint64_t auth_successes;
+    uint64_t auth_failures;
+    uint64_t bytes_received;
+    uint64_t blocks_received;
+    uint64_t bytes_sent;
+    uint64_t files_saved;
+    uint64_t files_unchanged;
+    uint64_t hash_mismatches;
+    uint64_t system_errors;
+    uint64_t disk_write_microseconds;
+    uint64_t group_commits;
+    uint64_t group_committed_saves;
+    uint64_t batches_received;
+    uint64_t versions_expired;
+    uint64_t retention_busy_passes;
+    uint64_t chunks_removed;
+    uint64_t memory_waits;
+    uint64_t versions_replicated;
+    uint64_t replicated_bytes;
+    struct histogram_t handshake;
+    struct histogram_t pass;
+    struct histogram_t block_per_mb;
+    struct histogram_t save;
+    struct histogram_t save_commit;
+    struct histogram_t save_sync;
+    struct histogram_t group_commit;
+    struct histogram_t batch;
+    struct histogram_t retention_pass;
+};
+
+// Threads other than the workers share a set; the group commit and
+// retention threads each write only their own fields of it, as do the
+// replica threads between them, under the replication log's lock.
+extern __thread struct metrics_t *thread_metrics;
+
+static inline void metric_add(uint64_t *counter, uint64_t n)
+{
+    __atomic_store_n(counter, *counter + n, __ATOMIC_RELAXED);
+}
+
+#define METRIC_ADD(name, n) metric_add(&thread_metrics->name, (n))
+#define METRIC_INC(name) metric_add(&thread_metrics->name, 1)
+#define METRIC_OBSERVE(name, us) histogram_observe(&thread_metrics->name, (us))
+
+uint64_t metrics_now(void);
+void histogram_observe(struct histogram_t *histogram, uint64_t microseconds);
+
+struct worker_t;
+int metrics_listen(struct event_base *base, struct worker_t *workers, int worker_count);
+
+#endif
@@ -0,0 +1,121 @@
+// Microbenchmark for boatd's command parser. Builds a synthetic stream of
+// the commands a busy session sends, mostly PUT, BLOCK and SAVE with the
+// odd GET, LIST and so on, and parses it over and over for a fixed time the
+// way ssl_readcb does: reading each command off an evbuffer, looking it up
+// and parsing BLOCK's size. Reports commands per second:
+//
+//   ./parsebench -d 5 -n 100000 -c 4096
+//
+// -c splits the stream into buffer chains of that many bytes, so that some
+// lines straddle two of them.
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <event2/buffer.h>
+
+#include "constants.h"
+#include "parser.h"
+
+static const char *stream_commands[] = {
+    "PUT backups/host%d/var-lib-postgresql.tar.zst",
+    "BLOCK 262144",
+    "BLOCK 262144",
+    "BLOCK 262144",
+    "BLOCK 131072",
+    "save",
+    "PUT 3 nightly/%d.img 6f1ed002ab5595859014ebf0951522d9f8f6f1e9f3b2c3a5d8e0f4a7b6c5d4e3 1073741824",
+    "BLOCK 3 1048576",
+    "SAVE 3",
+    "GET backups/host%d/etc.tar 0 65536",
+    "LIST backups/",
+    "MPUT 16",
+};
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [-d seconds] [-n commands] [-c chain size]\n", name);
+}
+
+int main(int argc, char **argv)
+{
+    char line[MAX_COMMAND_LENGTH + 1], *args, *stream;
+    unsigned long long commands = 0, bytes = 0, size;
+    size_t stream_length = 0, chain_size = 0, offset;
+    int duration = 5, count = 100000, c, i, n;
+    enum command command;
+
+    while ((c = getopt(argc, argv, "d:n:c:h")) != -1) {
+        switch (c) {
+            case 'd': duration = atoi(optarg); break;
+            case 'n': count = atoi(optarg); break;
+            case 'c': chain_size = strtoull(optarg, NULL, 10); break;
+            default:
+                usage(argv[0]);
+                return c == 'h' ? 0 : 2;
+        }
+    }
+    if (duration < 1 || count < 1) {
+        usage(argv[0]);
+        return 2;
+    }
+
+    if ((stream = (char *)malloc((size_t)count * (MAX_COMMAND_LENGTH + 2))) == NULL) {
+        perror("malloc");
+        return 1;
+    }
+    for (i = 0; i < count; i++) {
+        stream_length += sprintf(stream + stream_length, stream_commands[i % (sizeof(stream_commands) / sizeof(stream_commands[0]))], i);
+        stream_length += sprintf(stream + stream_length, i % 2 ? "\r\n" : "\n");
+    }
+    if (chain_size == 0) chain_size = stream_length;
+
+    struct evbuffer *in = evbuffer_new();
+    if (in == NULL) return 1;
+
+    uint64_t started = now_ns(), deadline = started + (uint64_t)duration * 1000000000;
+    while (now_ns() < deadline) {
+        for (offset = 0; offset < stream_length; offset += chain_size) {
+            evbuffer_add_reference(in, stream + offset, stream_length - offset < chain_size ? stream_length - offset : chain_size, NULL, NULL);
+        }
+
+        while ((n = read_command(in, line, sizeof(line), &command, &args)) == 1) {
+            if (command == COMMAND_UNKNOWN) {
+                fprintf(stderr, "unknown command in the stream\n");
+                return 1;
+            }
+            if (command == COMMAND_BLOCK) {
+                char *p = strrchr(args, ' ');
+                if (parse_number(p ? p + 1 : args, MAX_BLOCK_SIZE, &size) != 0) {
+                    fprintf(stderr, "invalid block size in the stream\n");
+                    return 1;
+                }
+            }
+            commands++;
+        }
+        if (n == -1 || evbuffer_get_length(in) > 0) {
+            fprintf(stderr, "the stream didn't parse\n");
+            return 1;
+        }
+        bytes += stream_length;
+    }
+    double elapsed = (now_ns() - started) / 1e9;
+
+    printf("%llu commands in %.2f s: %.0f commands/s, %.1f MB/s\n", commands, elapsed, commands / elapsed, bytes / elapsed / 1e6);
+
+    evbuffer_free(in);
+    free(stream);
+    return 0;
+}
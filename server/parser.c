@@ -0,0 +1,127 @@
+#include <string.h>
+#include <strings.h>
+
+#include "parser.h"
+
+// The commands, busiest first.
+static const struct
+{
+    const char *name;
+    size_t length;
+    enum command command;
+} commands[] = {
+    { "BLOCK", 5, COMMAND_BLOCK },
+    { "PUT", 3, COMMAND_PUT },
+    { "SAVE", 4, COMMAND_SAVE },
+    { "MPUT", 4, COMMAND_MPUT },
+    { "GET", 3, COMMAND_GET },
+    { "RESUME", 6, COMMAND_RESUME },
+    { "DELTA", 5, COMMAND_DELTA },
+    { "SIGNATURE", 9, COMMAND_SIGNATURE },
+    { "LIST", 4, COMMAND_LIST },
+    { "VERSIONS", 8, COMMAND_VERSIONS },
+    { "USER", 4, COMMAND_USER },
+    { "PASS", 4, COMMAND_PASS },
+    { "PIPELINE", 8, COMMAND_PIPELINE },
+    { "MULTIPLEX", 9, COMMAND_MULTIPLEX },
+    { "QUIT", 4, COMMAND_QUIT },
+};
+
+// Commands are case insensitive. `name` needn't be NUL-terminated.
+enum command lookup_command(const char *name, size_t length)
+{
+    size_t i;
+
+    for (i = 0; i < sizeof(commands) / sizeof(commands[0]); i++) {
+        if (commands[i].length == length && !strncasecmp(name, commands[i].name, length)) return commands[i].command;
+    }
+    return COMMAND_UNKNOWN;
+}
+
+// Copies the next line out of the input buffer without allocating. Returns
+// 1 if there was a complete line, 0 if there isn't one yet, or -1 if the
+// client has sent more than `size` - 1 bytes without a line ending. Only a
+// single CRLF or LF ends the line: a pipelined BLOCK's payload follows
+// straight on and may itself start with one.
+int read_command_line(struct evbuffer *in, char *line, size_t size)
+{
+    size_t eol_length;
+    struct evbuffer_ptr eol = evbuffer_search_eol(in, NULL, &eol_length, EVBUFFER_EOL_CRLF);
+
+    if (eol.pos == -1) return evbuffer_get_length(in) >= size ? -1 : 0;
+    if ((size_t)eol.pos >= size) return -1;
+
+    evbuffer_remove(in, line, eol.pos);
+    line[eol.pos] = 0;
+    evbuffer_drain(in, eol_length);
+    return 1;
+}
+
+// Takes the next command off the input buffer, without allocating, setting
+// `command` and pointing `args` at its arguments, NUL-terminated, in `line`.
+// A line that lies in one piece in the buffer, as nearly all do, has its
+// command looked up where it is and only the arguments copied out; one
+// that doesn't is copied out whole first. Returns the same as
+// read_command_line().
+int read_command(struct evbuffer *in, char *line, size_t size, enum command *command, char **args)
+{
+    struct evbuffer_iovec vec;
+    const char *start, *eol, *space, *nul;
+    size_t length;
+    int n;
+
+    if (evbuffer_peek(in, -1, NULL, &vec, 1) < 1) return 0;
+    start = (const char *)vec.iov_base;
+
+    if ((eol = memchr(start, '\n', vec.iov_len <= size ? vec.iov_len : size + 1)) == NULL) {
+        if (vec.iov_len > size) return -1;
+        if ((n = read_command_line(in, line, size)) != 1) return n;
+
+        length = strlen(line);
+        space = memchr(line, ' ', length);
+        *command = lookup_command(line, space ? (size_t)(space - line) : length);
+        *args = space ? (char *)space + 1 : line + length;
+        return 1;
+    }
+
+    length = eol - start;
+    if (length > 0 && eol[-1] == '\r') length--;
+    if (length >= size) return -1;
+
+    // A NUL ends the line early, as it does for one copied out whole.
+    if ((nul = memchr(start, 0, length))) length = nul - start;
+
+    if ((space = memchr(start, ' ', length)) == NULL) {
+        *command = lookup_command(start, length);
+        *line = 0;
+    }
+    else {
+        *command = lookup_command(start, space - start);
+        length -= space + 1 - start;
+        memcpy(line, space + 1, length);
+        line[length] = 0;
+    }
+
+    *args = line;
+    evbuffer_drain(in, eol + 1 - start);
+    return 1;
+}
+
+// Parses the whole of `value` as a decimal number no bigger than `max`, in
+// a single pass. Returns -1 if it isn't one.
+int parse_number(const char *value, unsigned long long max, unsigned long long *result)
+{
+    unsigned long long n = 0;
+    const char *p = value;
+
+    if (*p < '0' || *p > '9') return -1;
+    for (; *p >= '0' && *p <= '9'; p++) {
+        unsigned int digit = *p - '0';
+        if (n > (max - digit) / 10) return -1;
+        n = n * 10 + digit;
+    }
+    if (*p) return -1;
+
+    *result = n;
+    return 0;
+}
@@ -0,0 +1,15 @@
+#ifndef __PARSER_H
+#define __PARSER_H
+
+#include <stddef.h>
+#include <event2/buffer.h>
+
+enum command { COMMAND_UNKNOWN = 0, COMMAND_QUIT, COMMAND_USER, COMMAND_PASS, COMMAND_PIPELINE, COMMAND_MULTIPLEX, COMMAND_PUT, COMMAND_MPUT,
+    COMMAND_GET, COMMAND_LIST, COMMAND_VERSIONS, COMMAND_DELTA, COMMAND_SIGNATURE, COMMAND_RESUME, COMMAND_BLOCK, COMMAND_SAVE, COMMAND_COUNT };
+
+enum command lookup_command(const char *name, size_t length);
+int read_command(struct evbuffer *in, char *line, size_t size, enum command *command, char **args);
+int read_command_line(struct evbuffer *in, char *line, size_t size);
+int parse_number(const char *value, unsigned long long max, unsigned long long *result);
+
+#endif
@@ -0,0 +1,52 @@
+#include <pthread.h>
+#include <stdio.h>
+
+#include "pool.h"
+
+static void *pool_thread(void *arg)
+{
+    struct pool_t *pool = (struct pool_t *)arg;
+    struct pool_job_t *job;
+
+    for (;;) {
+        pthread_mutex_lock(&pool->lock);
+        while (pool->head_job == NULL) pthread_cond_wait(&pool->ready, &pool->lock);
+        job = pool->head_job;
+        pool->head_job = job->next;
+        if (pool->head_job == NULL) pool->tail_job = NULL;
+        pthread_mutex_unlock(&pool->lock);
+
+        job->next = NULL;
+        job->run(job);
+    }
+
+    return NULL;
+}
+
+int pool_start(struct pool_t *pool, int threads)
+{
+    pthread_t thread;
+    int i;
+
+    for (i = 0; i < threads; i++) {
+        if (pthread_create(&thread, NULL, pool_thread, pool) != 0) {
+            fprintf(stderr, "could not start pool thread %d\n", i);
+            return -1;
+        }
+        pthread_detach(thread);
+    }
+
+    return 0;
+}
+
+void pool_submit(struct pool_t *pool, struct pool_job_t *job)
+{
+    job->next = NULL;
+
+    pthread_mutex_lock(&pool->lock);
+    if (pool->tail_job) pool->tail_job->next = job;
+    else pool->head_job = job;
+    pool->tail_job = job;
+    pthread_cond_signal(&pool->ready);
+    pthread_mutex_unlock(&pool->lock);
+}
@@ -0,0 +1,30 @@
+#ifndef __POOL_H
+#define __POOL_H
+
+#include <pthread.h>
+
+// A fixed set of threads for work that mustn't run on the event loops. Jobs
+// are embedded in whatever they work on and run in the order they were
+// submitted; a job is free to resubmit itself.
+struct pool_job_t
+{
+    void (*run)(struct pool_job_t *job);
+    struct pool_job_t *next;
+};
+
+// Each kind of work gets a pool of its own so that, say, a backlog of
+// compression can't hold up a rename.
+struct pool_t
+{
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    struct pool_job_t *head_job;
+    struct pool_job_t *tail_job;
+};
+
+#define POOL_INITIALIZER { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, NULL, NULL }
+
+int pool_start(struct pool_t *pool, int threads);
+void pool_submit(struct pool_t *pool, struct pool_job_t *job);
+
+#endif
@@ -0,0 +1,96 @@
+#include <pthread.h>
+#include <openssl/ssl.h>
+#include <event2/bufferevent.h>
+#include <event2/bufferevent_ssl.h>
+#include <event2/bufferevent_struct.h>
+
+#include "ratelimit.h"
+#include "worker.h"
+
+// Buckets are topped up this often, so a limited session moves in steps of
+// a tenth of its rate rather than a second's worth at a time.
+#define RATE_LIMIT_TICK_MS 100
+
+// Sessions are shaped with libevent's rate limit groups: each user with a
+// 'user rate limit' has a group of their own, created at their first login
+// and shared by all their sessions on every worker, and everyone else
+// shares one group under 'rate limit'. A session can only be in one group,
+// so a user's own limit takes the place of the global one. All the groups
+// are topped up from the first worker's loop.
+static struct event_base *group_base;
+static struct bufferevent_rate_limit_group *shared_group;
+static pthread_mutex_t groups_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Limits reads and writes alike to `rate` bytes a second.
+static struct bufferevent_rate_limit_group *new_group(int rate)
+{
+    struct timeval tick = { 0, RATE_LIMIT_TICK_MS * 1000 };
+    size_t per_tick = rate / (1000 / RATE_LIMIT_TICK_MS);
+    if (per_tick == 0) per_tick = 1;
+
+    struct ev_token_bucket_cfg *cfg = ev_token_bucket_cfg_new(per_tick, per_tick, per_tick, per_tick, &tick);
+    if (cfg == NULL) return NULL;
+
+    // The group keeps a copy of the configuration.
+    struct bufferevent_rate_limit_group *group = bufferevent_rate_limit_group_new(group_base, cfg);
+    ev_token_bucket_cfg_free(cfg);
+    return group;
+}
+
+int rate_limit_init(struct event_base *base)
+{
+    group_base = base;
+    if (configuration.rate_limit && (shared_group = new_group(configuration.rate_limit)) == NULL) return -1;
+    return 0;
+}
+
+// libevent stops reading a limited session wherever its bucket runs out,
+// which may be part way through a record OpenSSL has already taken off the
+// socket, and when the group lets it go again it only waits on the socket.
+// A client that has sent everything and is waiting for a reply would never
+// be heard from, so each tick this reads on from whatever OpenSSL holds.
+static void rate_limit_tick_cb(evutil_socket_t fd, short what, void *arg)
+{
+    struct bufferevent *bev = (struct bufferevent *)arg;
+    SSL *ssl = bufferevent_openssl_get_ssl(bev);
+
+    if (ssl && SSL_pending(ssl) > 0 && (bufferevent_get_enabled(bev) & EV_READ)) event_active(&bev->ev_read, EV_READ, 1);
+}
+
+// Puts a session that has just logged in under its user's limit, or the
+// global one. Returns -1 if that couldn't be set up.
+int rate_limit_session(struct client_data_t *client_data)
+{
+    struct user_configuration_t *user = client_data->user;
+    struct bufferevent_rate_limit_group *group = shared_group;
+    struct timeval tick = { 0, RATE_LIMIT_TICK_MS * 1000 };
+
+    if (user->rate_limit) {
+        pthread_mutex_lock(&groups_lock);
+        if (user->rate_group == NULL) user->rate_group = new_group(user->rate_limit);
+        group = user->rate_group;
+        pthread_mutex_unlock(&groups_lock);
+        if (group == NULL) return -1;
+    }
+    if (group == NULL) return 0;
+
+    client_data->rate_event = event_new(client_data->worker->evbase, -1, EV_PERSIST, rate_limit_tick_cb, client_data->bev);
+    if (client_data->rate_event == NULL || event_add(client_data->rate_event, &tick) != 0) return -1;
+    return bufferevent_add_to_rate_limit_group(client_data->bev, group);
+}
+
+// Takes a session out of its group before it lets go of its user, whose
+// group may be freed with the user table.
+void rate_limit_end(struct client_data_t *client_data)
+{
+    if (client_data->rate_event) event_free(client_data->rate_event);
+    client_data->rate_event = NULL;
+    bufferevent_remove_from_rate_limit_group(client_data->bev);
+}
+
+// Whether a user's sessions are shaped, in which case their data has to go
+// through the bufferevent rather than around it.
+int rate_limited(struct user_configuration_t *user)
+{
+    return user->rate_limit || configuration.rate_limit;
+}
@@ -0,0 +1,17 @@
+#ifndef __RATELIMIT_H
+#define __RATELIMIT_H
+
+#include <event2/bufferevent.h>
+#include <event2/event.h>
+#include "client_data.h"
+#include "configuration.h"
+
+// Files sent to a rate limited session are queued in pieces of this size.
+#define RATE_LIMIT_PIECE (64 * 1024)
+
+int rate_limit_init(struct event_base *base);
+int rate_limit_session(struct client_data_t *client_data);
+void rate_limit_end(struct client_data_t *client_data);
+int rate_limited(struct user_configuration_t *user);
+
+#endif
@@ -0,0 +1,510 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+#include <openssl/x509v3.h>
+
+#include "delta.h"
+#include "metrics.h"
+#include "replication.h"
+#include "users.h"
+#include "utils.h"
+
+// Room in front of each block's data for its BLOCK line, so that the two go
+// out in one write.
+#define BLOCK_LINE_ROOM 32
+
+// A connection to a replica, logged in as the user whose versions it is
+// being sent, with PIPELINE on.
+struct replica_session_t
+{
+    int fd;
+    SSL *ssl;
+    char username[MAX_USERNAME_LENGTH + 1];
+    char input[MAX_COMMAND_LENGTH + 1];
+    size_t input_length;
+};
+
+// One 'replica' and how far through the log it has got: `position` is the
+// index of the next record to send. It is kept in a file of the replica's
+// own in the replication directory, so a restart carries on from there.
+struct replica_t
+{
+    char name[300];
+    char host[256];
+    char port[8];
+    int state_fd;
+    uint64_t position;
+    struct replica_session_t session;
+    unsigned char *buffer;
+};
+
+static struct replica_t replicas[MAX_REPLICAS];
+static int replica_count;
+static SSL_CTX *replica_ctx;
+
+// The log of saved versions, appended to by the disk threads and read by
+// each replica's thread, under `log_lock`.
+static pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t log_grown = PTHREAD_COND_INITIALIZER;
+static int log_fd = -1;
+static uint64_t log_count;
+static int log_unsynced;
+
+static off_t record_offset(uint64_t index)
+{
+    return (off_t)(index + 1) * REPLICATION_RECORD_SIZE;
+}
+
+// Adds a saved version to the log for the replicas to pick up. Called on a
+// disk thread as the save records its digest, so it is in the log before
+// the client hears the version is saved; with 'durable saves' the group
+// commit syncs the log along with the repository directory. Only users
+// with a 'user replica password' are replicated.
+void replication_add(const struct user_configuration_t *user, const char *version_name, const char *filename, unsigned long long size, const char *hash)
+{
+    struct replication_record_t record;
+
+    if (log_fd == -1 || user->replica_password == NULL) return;
+
+    memset(&record, 0, sizeof(record));
+    record.size = size;
+    snprintf(record.username, sizeof(record.username), "%s", user->username);
+    snprintf(record.version_name, sizeof(record.version_name), "%s", version_name);
+    snprintf(record.filename, sizeof(record.filename), "%s", filename);
+    snprintf(record.hash, sizeof(record.hash), "%s", hash);
+
+    pthread_mutex_lock(&log_lock);
+    if (pwrite(log_fd, &record, sizeof(record), record_offset(log_count)) == sizeof(record)) {
+        log_count++;
+        log_unsynced = 1;
+        pthread_cond_broadcast(&log_grown);
+    }
+    else {
+        fprintf(stderr, "could not add %s to the replication log: %s\n", version_name, strerror(errno));
+    }
+    pthread_mutex_unlock(&log_lock);
+}
+
+// Makes the versions added to the log so far durable. Called by the group
+// commit thread before it syncs the directories the saves went to.
+void replication_sync(void)
+{
+    pthread_mutex_lock(&log_lock);
+    int unsynced = log_unsynced;
+    log_unsynced = 0;
+    pthread_mutex_unlock(&log_lock);
+
+    if (unsynced && fdatasync(log_fd) != 0) fprintf(stderr, "could not sync the replication log: %s\n", strerror(errno));
+}
+
+// How many versions the replica furthest behind has still to be sent.
+uint64_t replication_backlog(void)
+{
+    uint64_t backlog = 0;
+    int i;
+
+    pthread_mutex_lock(&log_lock);
+    for (i = 0; i < replica_count; i++) {
+        if (log_count - replicas[i].position > backlog) backlog = log_count - replicas[i].position;
+    }
+    pthread_mutex_unlock(&log_lock);
+    return backlog;
+}
+
+static void save_position(struct replica_t *replica)
+{
+    char text[24];
+    int n = snprintf(text, sizeof(text), "%020llu\n", (unsigned long long)replica->position);
+
+    if (pwrite(replica->state_fd, text, n, 0) != n) fprintf(stderr, "could not record replica %s's position: %s\n", replica->name, strerror(errno));
+}
+
+// Moves a replica on past the version it has just been sent. Once every
+// replica has caught up the log is emptied; the positions go back to the
+// start first, so that a crash part way through can only mean sending
+// some versions again, which the replicas answer with 258.
+static void advance(struct replica_t *replica)
+{
+    int i;
+
+    replica->position++;
+    save_position(replica);
+
+    for (i = 0; i < replica_count; i++) {
+        if (replicas[i].position < log_count) return;
+    }
+    for (i = 0; i < replica_count; i++) {
+        replicas[i].position = 0;
+        save_position(&replicas[i]);
+    }
+    if (ftruncate(log_fd, REPLICATION_RECORD_SIZE) == 0) log_count = 0;
+}
+
+static void disconnect(struct replica_session_t *session)
+{
+    if (session->ssl) SSL_free(session->ssl);
+    if (session->fd != -1) close(session->fd);
+    session->ssl = NULL;
+    session->fd = -1;
+    *session->username = 0;
+    session->input_length = 0;
+}
+
+// Reads the next line from the replica, without its line ending. Returns
+// -1 if the connection fails.
+static int read_line(struct replica_session_t *session, char *line, size_t size)
+{
+    char *eol;
+    int n;
+
+    while ((eol = memchr(session->input, '\n', session->input_length)) == NULL) {
+        if (session->input_length == sizeof(session->input)) return -1;
+        if ((n = SSL_read(session->ssl, session->input + session->input_length, sizeof(session->input) - session->input_length)) <= 0) return -1;
+        session->input_length += n;
+    }
+
+    size_t length = eol - session->input;
+    if (length >= size) return -1;
+    memcpy(line, session->input, length);
+    line[length] = 0;
+    session->input_length -= length + 1;
+    memmove(session->input, eol + 1, session->input_length);
+    return 0;
+}
+
+static int send_data(struct replica_session_t *session, const void *data, size_t length)
+{
+    return SSL_write(session->ssl, data, length) == (int)length ? 0 : -1;
+}
+
+// Sends a command and reads the reply into `reply`. Returns the reply's
+// code, or -1 if the connection fails.
+static int command(struct replica_session_t *session, const char *command, char *reply, size_t size)
+{
+    char line[MAX_COMMAND_LENGTH + 2];
+    int n = snprintf(line, sizeof(line), "%s\n", command);
+
+    if (n >= (int)sizeof(line) || send_data(session, line, n) != 0 || read_line(session, reply, size) != 0) return -1;
+    return atoi(reply);
+}
+
+// Connects to the replica and logs in as `username`. Its certificate must
+// check out against the 'replica ca file', or the system's CAs, and be for
+// the host it was asked for.
+static int connect_replica(struct replica_t *replica, const char *username, const char *password)
+{
+    struct replica_session_t *session = &replica->session;
+    struct addrinfo hints, *addresses, *address;
+    struct timeval timeout = { 60, 0 };
+    unsigned char ip[sizeof(struct in6_addr)];
+    char line[MAX_COMMAND_LENGTH + 1];
+    int n;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_socktype = SOCK_STREAM;
+    if ((n = getaddrinfo(replica->host, replica->port, &hints, &addresses)) != 0) {
+        fprintf(stderr, "could not look up replica %s: %s\n", replica->name, gai_strerror(n));
+        return -1;
+    }
+    for (address = addresses; address; address = address->ai_next) {
+        if ((session->fd = socket(address->ai_family, address->ai_socktype | SOCK_CLOEXEC, address->ai_protocol)) == -1) continue;
+        if (connect(session->fd, address->ai_addr, address->ai_addrlen) == 0) break;
+        close(session->fd);
+        session->fd = -1;
+    }
+    freeaddrinfo(addresses);
+    if (session->fd == -1) {
+        fprintf(stderr, "could not connect to replica %s: %s\n", replica->name, strerror(errno));
+        return -1;
+    }
+
+    setsockopt(session->fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)); // ignore result
+    setsockopt(session->fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout)); // ignore result
+
+    if ((session->ssl = SSL_new(replica_ctx)) == NULL || SSL_set_fd(session->ssl, session->fd) != 1) return -1;
+    if (inet_pton(AF_INET, replica->host, ip) == 1 || inet_pton(AF_INET6, replica->host, ip) == 1) {
+        X509_VERIFY_PARAM_set1_ip_asc(SSL_get0_param(session->ssl), replica->host); // ignore result
+    }
+    else {
+        SSL_set_tlsext_host_name(session->ssl, replica->host); // ignore result
+        SSL_set1_host(session->ssl, replica->host); // ignore result
+    }
+    if (SSL_connect(session->ssl) != 1) {
+        fprintf(stderr, "TLS handshake with replica %s failed: %s\n", replica->name, ERR_reason_error_string(ERR_get_error()));
+        return -1;
+    }
+
+    if (read_line(session, line, sizeof(line)) != 0 || atoi(line) != 220) return -1;
+
+    snprintf(line, sizeof(line), "USER %s", username);
+    if (command(session, line, line, sizeof(line)) != 251) {
+        fprintf(stderr, "replica %s won't take user %s\n", replica->name, username);
+        return -1;
+    }
+    snprintf(line, sizeof(line), "PASS %s", password);
+    if (command(session, line, line, sizeof(line)) != 252) {
+        fprintf(stderr, "replica %s didn't accept the replica password for user %s\n", replica->name, username);
+        return -1;
+    }
+    if (command(session, "PIPELINE", line, sizeof(line)) != 262) return -1;
+
+    strcpy(session->username, username);
+    return 0;
+}
+
+// Streams a version to the replica in pipelined BLOCKs, keeping at most
+// REPLICATION_WINDOW bytes unacknowledged, and saves it there.
+static int send_version(struct replica_t *replica, int fd, unsigned long long length)
+{
+    struct replica_session_t *session = &replica->session;
+    unsigned long long sent = 0, acknowledged = 0;
+    char line[MAX_COMMAND_LENGTH + 1];
+
+    while (sent < length) {
+        size_t n = length - sent < REPLICATION_BLOCK_SIZE ? length - sent : REPLICATION_BLOCK_SIZE;
+        if (read_fully(fd, replica->buffer + BLOCK_LINE_ROOM, n, sent) != 0) return -1;
+
+        char block[BLOCK_LINE_ROOM];
+        int block_length = snprintf(block, sizeof(block), "BLOCK %zu\n", n);
+        memcpy(replica->buffer + BLOCK_LINE_ROOM - block_length, block, block_length);
+        if (send_data(session, replica->buffer + BLOCK_LINE_ROOM - block_length, block_length + n) != 0) return -1;
+        sent += n;
+
+        while (sent - acknowledged > REPLICATION_WINDOW) {
+            if (read_line(session, line, sizeof(line)) != 0 || sscanf(line, "257 %*u blocks received %llu", &acknowledged) != 1) return -1;
+        }
+    }
+
+    if (send_data(session, "SAVE\n", 5) != 0) return -1;
+    do {
+        if (read_line(session, line, sizeof(line)) != 0) return -1;
+    } while (!strncmp(line, "257 ", 4));
+
+    return atoi(line);
+}
+
+// Sends one version to the replica. Returns 1 once it has been sent, 0 if
+// it turns out not to be needed, and -1 if it should be tried again later.
+static int replicate(struct replica_t *replica, const struct replication_record_t *record, unsigned long long *length)
+{
+    struct replica_session_t *session = &replica->session;
+    struct user_configuration_t *user;
+    char path[PATH_MAX], password[MAX_COMMAND_LENGTH], line[MAX_COMMAND_LENGTH + 1];
+    int fd, code, n = -1;
+
+    // The user's settings come from the configuration as it is now. A user
+    // who has gone, or is no longer replicated, is skipped.
+    struct user_table_t *table = user_table_acquire();
+    if (table == NULL) return -1;
+    for (user = table->head_user; user && strcmp(user->username, record->username); user = user->next);
+    if (user && user->replica_password) {
+        snprintf(password, sizeof(password), "%s", user->replica_password);
+        if (build_path(path, "%s/%s/%s", configuration.repository_root, user->repository, record->version_name) != 0) user = NULL;
+    }
+    int replicated = user && user->replica_password;
+    user_table_release(table);
+    if (!replicated) return 0;
+
+    // Retention may have removed the version since.
+    if ((fd = open_version(path, length)) == -1) return errno == ENOENT ? 0 : -1;
+
+    if (session->ssl == NULL || strcmp(session->username, record->username)) {
+        disconnect(session);
+        if (connect_replica(replica, record->username, password) != 0) goto done;
+    }
+
+    snprintf(line, sizeof(line), "PUT %s %s %llu", record->filename, record->hash, *length);
+    switch ((code = command(session, line, line, sizeof(line)))) {
+    case 255:
+        code = send_version(replica, fd, *length);
+        if (code == 259) {
+            n = 1;
+        }
+        else if (code == 530) {
+            // Sending it again won't change what is on the disk here.
+            fprintf(stderr, "replica %s says %s doesn't match its hash; not replicating it\n", replica->name, path);
+            n = 0;
+        }
+        else if (code != -1) {
+            fprintf(stderr, "replica %s couldn't save %s (%d)\n", replica->name, path, code);
+        }
+        break;
+
+    // Already there: the same version was sent before a restart, or the
+    // user doesn't keep versions and has one already.
+    case 258:
+    case 520:
+        n = 0;
+        break;
+
+    case -1:
+        break;
+
+    // A request the replica finds invalid stays that way, but it may
+    // have room or be able to take the file later.
+    default:
+        fprintf(stderr, "replica %s refused %s: %s\n", replica->name, path, line);
+        if (code >= 510 && code < 520) n = 0;
+        break;
+    }
+
+done:
+    close(fd);
+    return n;
+}
+
+static void *replica_thread(void *arg)
+{
+    struct replica_t *replica = (struct replica_t *)arg;
+    struct replication_record_t record;
+    unsigned long long length;
+    int delay = 1, n;
+
+    for (;;) {
+        pthread_mutex_lock(&log_lock);
+        if (replica->position >= log_count && replica->session.ssl) {
+            // Caught up, so don't hold the connection open.
+            pthread_mutex_unlock(&log_lock);
+            send_data(&replica->session, "QUIT\n", 5); // ignore result
+            disconnect(&replica->session);
+            continue;
+        }
+        while (replica->position >= log_count) pthread_cond_wait(&log_grown, &log_lock);
+        n = pread(log_fd, &record, sizeof(record), record_offset(replica->position)) == sizeof(record) ? 0 : -1;
+        pthread_mutex_unlock(&log_lock);
+
+        record.username[MAX_USERNAME_LENGTH] = 0;
+        record.version_name[sizeof(record.version_name) - 1] = 0;
+        record.filename[MAX_FILENAME_LENGTH] = 0;
+        record.hash[DIGEST_HEX_LENGTH] = 0;
+
+        if (n != 0 || (n = replicate(replica, &record, &length)) == -1) {
+            disconnect(&replica->session);
+            sleep(delay);
+            delay = delay * 2 < REPLICATION_MAX_RETRY_DELAY ? delay * 2 : REPLICATION_MAX_RETRY_DELAY;
+            continue;
+        }
+        delay = 1;
+
+        pthread_mutex_lock(&log_lock);
+        if (n == 1) {
+            METRIC_INC(versions_replicated);
+            METRIC_ADD(replicated_bytes, length);
+        }
+        advance(replica);
+        pthread_mutex_unlock(&log_lock);
+    }
+
+    return NULL;
+}
+
+static int open_log(const char *directory)
+{
+    char path[PATH_MAX], header[REPLICATION_RECORD_SIZE];
+    struct stat st;
+
+    if (build_path(path, "%s/%s", directory, REPLICATION_LOG) != 0) return -1;
+    if ((log_fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0640)) == -1 || fstat(log_fd, &st) != 0) {
+        fprintf(stderr, "could not open the replication log %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    if (st.st_size < REPLICATION_RECORD_SIZE) {
+        memset(header, 0, sizeof(header));
+        strcpy(header, REPLICATION_HEADER);
+        if (pwrite(log_fd, header, sizeof(header), 0) != sizeof(header)) return -1;
+        st.st_size = REPLICATION_RECORD_SIZE;
+    }
+    else if (pread(log_fd, header, sizeof(header), 0) != sizeof(header) || memcmp(header, REPLICATION_HEADER, sizeof(REPLICATION_HEADER) - 1)) {
+        fprintf(stderr, "%s is not a replication log\n", path);
+        return -1;
+    }
+
+    // A record cut short by a crash is written over by the next one.
+    log_count = st.st_size / REPLICATION_RECORD_SIZE - 1;
+    return 0;
+}
+
+static int open_replica(struct replica_t *replica, const char *directory, const char *name)
+{
+    char path[PATH_MAX], text[24];
+    ssize_t n;
+
+    snprintf(replica->name, sizeof(replica->name), "%s", name);
+    snprintf(replica->host, sizeof(replica->host), "%.*s", (int)(strrchr(name, ':') - name), name);
+    snprintf(replica->port, sizeof(replica->port), "%s", strrchr(name, ':') + 1);
+
+    // An IPv6 address is written in brackets.
+    size_t length = strlen(replica->host);
+    if (length > 1 && replica->host[0] == '[' && replica->host[length - 1] == ']') {
+        memmove(replica->host, replica->host + 1, length - 2);
+        replica->host[length - 2] = 0;
+    }
+
+    if (build_path(path, "%s/replica.%s", directory, name) != 0) return -1;
+    if ((replica->state_fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0640)) == -1) {
+        fprintf(stderr, "could not open %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    n = pread(replica->state_fd, text, sizeof(text) - 1, 0);
+    text[n > 0 ? n : 0] = 0;
+    replica->position = strtoull(text, NULL, 10);
+    if (replica->position > log_count) replica->position = log_count;
+
+    replica->session.fd = -1;
+    replica->buffer = (unsigned char *)malloc(BLOCK_LINE_ROOM + REPLICATION_BLOCK_SIZE);
+    return replica->buffer ? 0 : -1;
+}
+
+// Opens the replication log and starts a thread for each 'replica', which
+// picks up from wherever it had got to before a restart. Replicas are sent
+// versions in the order they were saved, each over its own connection,
+// and one that is down holds nothing else up.
+int replication_start(void)
+{
+    char directory[PATH_MAX];
+    pthread_t thread;
+    int i;
+
+    if (configuration.replica_count == 0) return 0;
+
+    if (build_path(directory, "%s/%s", configuration.repository_root, REPLICATION_DIRECTORY) != 0) return -1;
+    if (mkdir(directory, 0750) != 0 && errno != EEXIST) {
+        fprintf(stderr, "error while trying to create directory %s\n", directory);
+        return -1;
+    }
+    if (open_log(directory) != 0) return -1;
+
+    replica_ctx = SSL_CTX_new(TLS_client_method());
+    if (replica_ctx == NULL) return -1;
+    SSL_CTX_set_min_proto_version(replica_ctx, TLS1_2_VERSION);
+    SSL_CTX_set_verify(replica_ctx, SSL_VERIFY_PEER, NULL);
+    if ((configuration.replica_ca_file ? SSL_CTX_load_verify_locations(replica_ctx, configuration.replica_ca_file, NULL) : SSL_CTX_set_default_verify_paths(replica_ctx)) != 1) {
+        fprintf(stderr, "could not load the CA certificates for checking replicas\n");
+        return -1;
+    }
+
+    for (i = 0; i < configuration.replica_count; i++) {
+        if (open_replica(&replicas[i], directory, configuration.replicas[i]) != 0) return -1;
+    }
+    replica_count = configuration.replica_count;
+
+    for (i = 0; i < replica_count; i++) {
+        if (pthread_create(&thread, NULL, replica_thread, &replicas[i]) != 0) return -1;
+        pthread_detach(thread);
+    }
+    return 0;
+}
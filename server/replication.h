@@ -0,0 +1,40 @@
+#ifndef __REPLICATION_H
+#define __REPLICATION_H
+
+#include <stdint.h>
+#include "configuration.h"
+#include "constants.h"
+#include "digest.h"
+
+#define REPLICATION_DIRECTORY "replication"
+#define REPLICATION_LOG "log"
+#define REPLICATION_HEADER "boat-replication 1\n"
+#define REPLICATION_RECORD_SIZE 512
+
+// Each replica is sent a version in BLOCKs of this size, pipelined with at
+// most REPLICATION_WINDOW bytes of them not yet acknowledged.
+#define REPLICATION_BLOCK_SIZE (256 * 1024)
+#define REPLICATION_WINDOW (8 * 1024 * 1024)
+
+// A replica that can't be reached is tried again after a second, doubling
+// up to this many seconds.
+#define REPLICATION_MAX_RETRY_DELAY 60
+
+// One saved version waiting to be replicated. The log is these, after a
+// header of the same size.
+struct replication_record_t
+{
+    uint64_t size;
+    char username[MAX_USERNAME_LENGTH + 1];
+    char version_name[36 + MAX_FILENAME_LENGTH + 1];
+    char filename[MAX_FILENAME_LENGTH + 1];
+    char hash[DIGEST_HEX_LENGTH + 1];
+    char padding[REPLICATION_RECORD_SIZE - 8 - (MAX_USERNAME_LENGTH + 1) - (36 + MAX_FILENAME_LENGTH + 1) - (MAX_FILENAME_LENGTH + 1) - (DIGEST_HEX_LENGTH + 1)];
+};
+
+int replication_start(void);
+void replication_add(const struct user_configuration_t *user, const char *version_name, const char *filename, unsigned long long size, const char *hash);
+void replication_sync(void);
+uint64_t replication_backlog(void);
+
+#endif
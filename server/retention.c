@@ -0,0 +1,185 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/ioprio.h>
+
+#include "catalog.h"
+#include "chunk_store.h"
+#include "delta.h"
+#include "metrics.h"
+#include "retention.h"
+#include "upload.h"
+#include "users.h"
+#include "utils.h"
+
+#define SECONDS_PER_DAY 86400
+
+// A pass waits for uploads to finish for at most this many seconds in all,
+// then goes on regardless at a tenth of 'retention rate', so that a server
+// that is never idle still has its old versions removed.
+#define RETENTION_MAX_WAIT 300
+#define RETENTION_BUSY_SLOWDOWN 10
+
+// How long the pass under way has waited, and whether it has given up.
+static int pass_waited;
+static int pass_busy;
+
+static int has_policy(const struct user_configuration_t *user)
+{
+    return user->versioning_enabled && (user->keep_versions || user->keep_daily || user->keep_weekly);
+}
+
+// Holds off while anything is being uploaded, up to RETENTION_MAX_WAIT,
+// then paces removals to 'retention rate' a second, or a tenth of it if
+// uploads are still going.
+static void wait_for_quiet_disk(void)
+{
+    while (!pass_busy && uploads_in_progress > 0) {
+        if (pass_waited >= RETENTION_MAX_WAIT) {
+            pass_busy = 1;
+            METRIC_INC(retention_busy_passes);
+            break;
+        }
+        sleep(1);
+        pass_waited++;
+    }
+    usleep(1000000 / configuration.retention_rate * (pass_busy && uploads_in_progress > 0 ? RETENTION_BUSY_SLOWDOWN : 1));
+}
+
+// Marks the versions of one file that the user's policy keeps. Versions are
+// newest first. The newest is always kept, whatever the policy, as is the
+// one `current` points at, which may lag behind a save in progress.
+static void choose_versions(struct user_configuration_t *user, struct catalog_version_t *versions, int count,
+        const char *current, time_t now, unsigned char *keep)
+{
+    int64_t day, week, last_day = -1, last_week = -1;
+    int i;
+
+    for (i = 0; i < count; i++) {
+        day = versions[i].saved_at / SECONDS_PER_DAY;
+        week = (day + 3) / 7; // weeks start on Monday; the epoch was a Thursday
+
+        keep[i] = i == 0 || i < user->keep_versions || !strcmp(versions[i].version, current);
+        if (user->keep_daily && versions[i].saved_at > now - (int64_t)user->keep_daily * SECONDS_PER_DAY && day != last_day) keep[i] = 1;
+        if (user->keep_weekly && versions[i].saved_at > now - (int64_t)user->keep_weekly * 7 * SECONDS_PER_DAY && week != last_week) keep[i] = 1;
+
+        last_day = day;
+        last_week = week;
+    }
+}
+
+// Removes the versions in one repository that its user's policy no longer
+// keeps, file by file, from the catalog's snapshot of each file's history.
+// A version saved after the snapshot is newer than anything in it, so it
+// can't be removed by mistake.
+static void expire_repository(struct user_configuration_t *user, time_t now)
+{
+    char repository_path[PATH_MAX], current_path[PATH_MAX], target[PATH_MAX], version_path[PATH_MAX];
+    char filename[MAX_FILENAME_LENGTH + 1] = "", *current;
+    struct catalog_version_t *versions = NULL;
+    unsigned char *keep = NULL, *grown;
+    uint32_t capacity = 0, keep_capacity = 0;
+    ssize_t length;
+    int count, i;
+
+    struct catalog_t *catalog = catalog_open(user->repository);
+    if (catalog == NULL || build_path(repository_path, "%s/%s", configuration.repository_root, user->repository) != 0) return;
+
+    while ((count = catalog_next_file(catalog, filename, &versions, &capacity)) > 0) {
+        if (count == 1) continue;
+
+        if (keep_capacity < capacity) {
+            if ((grown = (unsigned char *)realloc(keep, capacity)) == NULL) break;
+            keep = grown;
+            keep_capacity = capacity;
+        }
+
+        // The symlink holds the full path of the version; only its
+        // <pid>.<counter>.<time> part is compared.
+        if (build_path(current_path, "%s/current.%s", repository_path, filename) != 0) continue;
+        if ((length = readlink(current_path, target, sizeof(target) - 1)) == -1) {
+            if (errno != ENOENT) continue;
+            length = 0;
+        }
+        target[length] = 0;
+        current = strrchr(target, '/') ? strrchr(target, '/') + 1 : target;
+        if (strlen(current) > strlen(filename)) current[strlen(current) - strlen(filename) - 1] = 0;
+
+        choose_versions(user, versions, count, current, now, keep);
+
+        for (i = 0; i < count; i++) {
+            if (keep[i]) continue;
+            wait_for_quiet_disk();
+
+            // The file goes first: if the server stops before the catalog
+            // catches up, the next pass finds it already gone.
+            if (build_path(version_path, "%s/%s.%s", repository_path, versions[i].version, filename) != 0) continue;
+            if (unlink(version_path) != 0 && errno != ENOENT) {
+                fprintf(stderr, "could not remove old version %s: %s\n", version_path, strerror(errno));
+                continue;
+            }
+            if (catalog_remove(catalog, filename, versions[i].index) == 0) METRIC_INC(versions_expired);
+
+            // Its delta signature, if one was ever asked for, goes too.
+            if (build_path(version_path, "%s/%s/%s.%s", repository_path, DELTA_SIGNATURES, versions[i].version, filename) == 0) unlink(version_path); // ignore result
+        }
+    }
+
+    free(versions);
+    free(keep);
+}
+
+static void *retention_thread(void *arg)
+{
+    struct user_configuration_t *user;
+    unsigned long long removed;
+
+    // The idle I/O class only gets the disk when nobody else wants it.
+    syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, IOPRIO_PRIO_VALUE(IOPRIO_CLASS_IDLE, 0)); // ignore result
+
+    for (;;) {
+        sleep(configuration.retention_interval);
+
+        // Policies are read afresh each pass, so a reload takes effect
+        // on the next one.
+        struct user_table_t *table = user_table_acquire();
+        if (table == NULL) continue;
+
+        uint64_t started = metrics_now();
+        pass_waited = 0;
+        pass_busy = 0;
+        for (user = table->head_user; user; user = user->next) {
+            if (has_policy(user)) expire_repository(user, time(NULL));
+        }
+
+        // Chunks that only expired or replaced versions used go too.
+        if (collect_chunks(configuration.repository_root, wait_for_quiet_disk, &removed) != 0) {
+            fprintf(stderr, "could not collect unused chunks: %s\n", strerror(errno));
+        }
+        METRIC_ADD(chunks_removed, removed);
+        METRIC_OBSERVE(retention_pass, metrics_now() - started);
+
+        user_table_release(table);
+    }
+
+    return NULL;
+}
+
+// Starts the thread that enforces retention policies, and removes the
+// chunks no version uses any more, every 'retention interval' seconds. It
+// runs at idle I/O priority and keeps off the disk while uploads are in
+// progress, for as long as it reasonably can.
+int retention_start(void)
+{
+    pthread_t thread;
+
+    if (pthread_create(&thread, NULL, retention_thread, NULL) != 0) return -1;
+    pthread_detach(thread);
+    return 0;
+}
@@ -0,0 +1,6 @@
+#ifndef __RETENTION_H
+#define __RETENTION_H
+
+int retention_start(void);
+
+#endif
@@ -0,0 +1,96 @@
+#include <pthread.h>
+#include <string.h>
+
+#include <openssl/core_names.h>
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+
+#include "tickets.h"
+
+#define TICKET_KEY_NAME_LENGTH 16
+
+struct ticket_key_t
+{
+    unsigned char name[TICKET_KEY_NAME_LENGTH];
+    unsigned char aes_key[32];
+    unsigned char hmac_key[32];
+};
+
+// New tickets are issued under keys[0]; keys[1] is the one before, which
+// is still accepted. Every worker's handshakes use the same keys.
+static struct ticket_key_t keys[2];
+static int key_count = 0;
+static pthread_mutex_t keys_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Called by OpenSSL to seal a new ticket, or to open one a client has
+// presented. Returns 0 for a ticket under a key that has been retired,
+// which makes for a full handshake, and 2 for one under the previous key,
+// which is accepted and replaced.
+static int ticket_key_cb(SSL *ssl, unsigned char *key_name, unsigned char *iv, EVP_CIPHER_CTX *cipher, EVP_MAC_CTX *mac, int encrypt)
+{
+    struct ticket_key_t key;
+    OSSL_PARAM params[3];
+    int i = 0, n = -1;
+
+    pthread_mutex_lock(&keys_lock);
+    if (!encrypt) {
+        while (i < key_count && memcmp(key_name, keys[i].name, TICKET_KEY_NAME_LENGTH)) i++;
+    }
+    if (i < key_count) key = keys[i];
+    pthread_mutex_unlock(&keys_lock);
+
+    if (i == key_count) return encrypt ? -1 : 0;
+
+    if (encrypt) {
+        memcpy(key_name, key.name, TICKET_KEY_NAME_LENGTH);
+        if (RAND_bytes(iv, EVP_CIPHER_get_iv_length(EVP_aes_256_cbc())) != 1) goto done;
+    }
+
+    params[0] = OSSL_PARAM_construct_octet_string(OSSL_MAC_PARAM_KEY, key.hmac_key, sizeof(key.hmac_key));
+    params[1] = OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST, (char *)"SHA256", 0);
+    params[2] = OSSL_PARAM_construct_end();
+    if (!EVP_MAC_CTX_set_params(mac, params)) goto done;
+
+    if (encrypt) {
+        if (!EVP_EncryptInit_ex(cipher, EVP_aes_256_cbc(), NULL, key.aes_key, iv)) goto done;
+    }
+    else if (!EVP_DecryptInit_ex(cipher, EVP_aes_256_cbc(), NULL, key.aes_key, iv)) {
+        goto done;
+    }
+    n = i == 0 ? 1 : 2;
+
+done:
+    OPENSSL_cleanse(&key, sizeof(key));
+    return n;
+}
+
+// Starts issuing tickets under a new key, and stops accepting the oldest.
+// A ticket is therefore good for between one and two 'ssl ticket key
+// lifetime's, and a stolen key is only of use for as long.
+int session_tickets_rotate(void)
+{
+    struct ticket_key_t key;
+    int n = -1;
+
+    if (RAND_bytes(key.name, sizeof(key.name)) == 1 && RAND_bytes(key.aes_key, sizeof(key.aes_key)) == 1 &&
+            RAND_bytes(key.hmac_key, sizeof(key.hmac_key)) == 1) {
+        pthread_mutex_lock(&keys_lock);
+        keys[1] = keys[0];
+        keys[0] = key;
+        if (key_count < 2) key_count++;
+        pthread_mutex_unlock(&keys_lock);
+        n = 0;
+    }
+
+    OPENSSL_cleanse(&key, sizeof(key));
+    return n;
+}
+
+// Has `ctx` issue tickets under our own keys rather than the ones OpenSSL
+// makes for each SSL_CTX and never changes.
+int session_tickets_init(SSL_CTX *ctx)
+{
+    if (session_tickets_rotate() != 0) return -1;
+    return SSL_CTX_set_tlsext_ticket_key_evp_cb(ctx, ticket_key_cb) == 1 ? 0 : -1;
+}
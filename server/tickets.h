@@ -0,0 +1,9 @@
+#ifndef __TICKETS_H
+#define __TICKETS_H
+
+#include <openssl/ssl.h>
+
+int session_tickets_init(SSL_CTX *ctx);
+int session_tickets_rotate(void);
+
+#endif
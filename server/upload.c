@@ -0,0 +1,343 @@
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <openssl/crypto.h>
+#include <openssl/rand.h>
+
+#include "budget.h"
+#include "chunk_store.h"
+#include "compress.h"
+#include "delta.h"
+#include "upload.h"
+#include "users.h"
+#include "utils.h"
+
+// Shared by all worker threads; used to make temporary and version filenames
+// unique within this process.
+static atomic_int upload_counter = 0;
+
+atomic_int uploads_in_progress = 0;
+
+static pthread_mutex_t parked_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct upload_t *parked_uploads = NULL;
+
+int next_upload_number(void)
+{
+    return upload_counter++;
+}
+
+// Versions saved before digests were recorded are hashed once and the
+// result cached. Manifests and compressed versions can't be hashed
+// directly, so they are simply treated as changed. Does file I/O, so runs
+// on a disk thread.
+int version_matches(const char *path, const char *hash)
+{
+    char current_hash[DIGEST_HEX_LENGTH + 1];
+    int n;
+
+    n = read_cached_digest(path, current_hash);
+    if (n != 0 && !is_manifest(path) && !is_compressed(path, NULL) && (n = digest_file(path, current_hash)) == 0) {
+        write_cached_digest(path, current_hash); // ignore result
+    }
+
+    return n == 0 && !strcasecmp(current_hash, hash);
+}
+
+// Finished uploads are kept on a per-thread free list, along with their
+// digest context and chunk buffer, rather than going back to the allocator.
+#define MAX_FREE_UPLOADS 64
+
+static __thread struct upload_t *free_uploads = NULL;
+static __thread int free_upload_count = 0;
+
+// Sets up an upload of `filename` without touching the disk; the caller
+// creates the temporary file through its disk engine and hands it over with
+// upload_open().
+struct upload_t *upload_new(struct user_configuration_t *user, const char *filename, const char *expected_hash)
+{
+    struct upload_t *upload = free_uploads;
+
+    if (upload) {
+        free_uploads = upload->next;
+        free_upload_count--;
+    }
+    else {
+        upload = (struct upload_t *)calloc(1, sizeof(struct upload_t));
+        if (upload == NULL) return NULL;
+    }
+
+    upload->user = user;
+    user_table_retain(user->table);
+    upload->next = NULL;
+    upload->fd = 0;
+    upload->opened = 0;
+    upload->received = 0;
+    upload->expected_size = 0;
+    upload->preallocated = 0;
+    upload->dropped = 0;
+    upload->dropping = 0;
+    upload->delta = NULL;
+    upload->digest_incomplete = 0;
+    upload->expires = 0;
+    upload->client = NULL;
+    upload->stream_id = 0;
+    upload->unacknowledged_blocks = 0;
+    upload->opening = 0;
+    upload->saving = 0;
+    upload->disk = NULL;
+    memset(&upload->flow, 0, sizeof(upload->flow));
+    upload->flow.weight = user->disk_weight;
+    upload->ops_in_flight = 0;
+    upload->bytes_in_flight = 0;
+    upload->buffered = 0;
+    upload->write_error = 0;
+    upload->orphaned = 0;
+    upload->active = 1;
+    upload->save_step = 0;
+    *upload->token = 0;
+    uploads_in_progress++;
+
+    if (strlen(filename) > MAX_FILENAME_LENGTH) goto error;
+    strcpy(upload->filename, filename);
+
+    if (build_path(upload->temp_path, "%s/tmp/%d.%d", configuration.repository_root, getpid(), next_upload_number()) != 0 ||
+            build_path(upload->repository_path, "%s/%s", configuration.repository_root, user->repository) != 0 ||
+            build_path(upload->current_path, "%s/current.%s", upload->repository_path, filename) != 0) {
+        *upload->temp_path = 0;
+        goto error;
+    }
+
+    if (expected_hash) strcpy(upload->expected_hash, expected_hash);
+    else *upload->expected_hash = 0;
+
+    if (upload->digest == NULL) upload->digest = EVP_MD_CTX_new();
+    if (upload->digest == NULL || !EVP_DigestInit_ex(upload->digest, EVP_sha256(), NULL)) goto error;
+
+    if (configuration.resume_timeout) {
+        unsigned char random[UPLOAD_TOKEN_LENGTH / 2];
+        if (RAND_bytes(random, sizeof(random)) != 1) goto error;
+        hex_encode(upload->token, random, sizeof(random));
+    }
+
+    return upload;
+
+error:
+    upload_free(upload);
+    return NULL;
+}
+
+// Takes over the newly created temporary file and gets ready for data.
+// Returns -1 if the upload can't go ahead; the caller still owns it.
+int upload_open(struct upload_t *upload, int fd)
+{
+    upload->fd = fd;
+    upload->opened = 1;
+
+    // For deduplicating users the temporary file becomes the version's
+    // manifest and the data itself goes to the chunk store.
+    // The data is chunked on a disk thread: see store_chunks().
+    if (upload->user->deduplication_enabled) {
+        if (upload->chunker) {
+            if (chunker_reset(upload->chunker, upload->fd) != 0) return -1;
+        }
+        else if ((upload->chunker = chunker_new(configuration.repository_root, upload->fd)) == NULL) {
+            return -1;
+        }
+        if (upload->chunk_pending == NULL && (upload->chunk_pending = evbuffer_new()) == NULL) return -1;
+        if (upload->chunk_data == NULL && (upload->chunk_data = evbuffer_new()) == NULL) return -1;
+        evbuffer_drain(upload->chunk_pending, evbuffer_get_length(upload->chunk_pending));
+        evbuffer_drain(upload->chunk_data, evbuffer_get_length(upload->chunk_data));
+        upload->chunking = 0;
+        upload->chunks_complete = 0;
+        upload->chunks_finishing = 0;
+    }
+    else if (upload->chunker) {
+        chunker_free(upload->chunker);
+        upload->chunker = NULL;
+    }
+
+    // Deduplicated data goes to the chunk store as is; compression only
+    // applies to versions stored whole.
+    if (!upload->user->deduplication_enabled && upload->user->compression_level) {
+        upload->compressor = compressor_new(upload->fd, upload->user->compression_level);
+        if (upload->compressor == NULL) return -1;
+    }
+
+    return 0;
+}
+
+// Takes what the upload was last counted as holding out of buffered_bytes.
+static void forget_buffered(struct upload_t *upload)
+{
+    buffered_add(-(long long)upload->buffered);
+    upload->buffered = 0;
+}
+
+// Closes the upload and throws away whatever has been received. A parked
+// upload's compressor may still be finishing off, but nobody is waiting on
+// it.
+void upload_free(struct upload_t *upload)
+{
+    forget_buffered(upload);
+    if (upload->fd) close(upload->fd);
+    upload->fd = 0;
+    if (upload->compressor) compressor_free(upload->compressor);
+    upload->compressor = NULL;
+    if (upload->delta) delta_free(upload->delta);
+    upload->delta = NULL;
+    if (*upload->temp_path) unlink(upload->temp_path); // ignore result
+    *upload->temp_path = 0;
+    if (upload->user) user_table_release(upload->user->table);
+    upload->user = NULL;
+    if (upload->active) uploads_in_progress--;
+    upload->active = 0;
+
+    if (free_upload_count >= MAX_FREE_UPLOADS) {
+        if (upload->chunker) chunker_free(upload->chunker);
+        if (upload->chunk_pending) evbuffer_free(upload->chunk_pending);
+        if (upload->chunk_data) evbuffer_free(upload->chunk_data);
+        if (upload->digest) EVP_MD_CTX_free(upload->digest);
+        free(upload);
+        return;
+    }
+
+    upload->next = free_uploads;
+    free_uploads = upload;
+    free_upload_count++;
+}
+
+// Keeps an interrupted upload around for 'resume timeout' seconds. The file
+// descriptor is closed while parked so that abandoned uploads don't pile up
+// open files.
+void upload_park(struct upload_t *upload)
+{
+    // Data that didn't make it to the file would leave a hole, so such an
+    // upload can't be resumed.
+    if (!configuration.resume_timeout || upload->write_error) {
+        upload_free(upload);
+        return;
+    }
+
+    forget_buffered(upload);
+    if (upload->fd) close(upload->fd);
+    upload->fd = 0;
+    upload->client = NULL;
+    upload->disk = NULL;
+    if (upload->compressor) compressor_set_notify(upload->compressor, NULL);
+    upload->expires = time(NULL) + configuration.resume_timeout;
+    upload->active = 0;
+    uploads_in_progress--;
+
+    pthread_mutex_lock(&parked_lock);
+    upload->next = parked_uploads;
+    parked_uploads = upload;
+    pthread_mutex_unlock(&parked_lock);
+}
+
+#define UPLOAD_FREE 1
+#define UPLOAD_PARK 2
+
+// Lets go of an upload when its session ends, parking it for a later RESUME
+// if `park` is set. If the disk engine still has operations in flight for
+// it, that is left to whichever of them completes last.
+void upload_release(struct upload_t *upload, int park)
+{
+    upload->client = NULL;
+    upload->orphaned = park ? UPLOAD_PARK : UPLOAD_FREE;
+    if (upload->compressor) compressor_set_notify(upload->compressor, NULL);
+    if (upload->ops_in_flight > 0) return;
+
+    if (park) upload_park(upload);
+    else upload_free(upload);
+}
+
+// Called as each disk operation on the upload completes. Returns 1 if its
+// session has gone, in which case the caller must leave the upload alone:
+// it may already have been parked or freed.
+int upload_op_done(struct upload_t *upload)
+{
+    upload->ops_in_flight--;
+    if (upload->client) return 0;
+
+    if (upload->ops_in_flight == 0) {
+        if (upload->orphaned == UPLOAD_PARK) upload_park(upload);
+        else upload_free(upload);
+    }
+    return 1;
+}
+
+// Hands a parked upload back to its user. The caller reopens the temporary
+// file and passes it to upload_reopen(). Returns NULL if there is no such
+// upload.
+struct upload_t *upload_resume(const char *token, struct user_configuration_t *user)
+{
+    struct upload_t *upload, **link;
+
+    if (strlen(token) != UPLOAD_TOKEN_LENGTH) return NULL;
+
+    pthread_mutex_lock(&parked_lock);
+    for (link = &parked_uploads; (upload = *link); link = &upload->next) {
+        // The configuration may have been reloaded since the upload was
+        // parked, so compare users by name rather than by record.
+        if (!CRYPTO_memcmp(upload->token, token, UPLOAD_TOKEN_LENGTH) &&
+                !strcmp(upload->user->username, user->username) &&
+                !strcmp(upload->user->repository, user->repository)) {
+            *link = upload->next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&parked_lock);
+
+    if (upload == NULL) return NULL;
+    upload->next = NULL;
+    upload->orphaned = 0;
+    upload->active = 1;
+    uploads_in_progress++;
+
+    return upload;
+}
+
+// Carries on with a resumed upload in its reopened temporary file, ready to
+// take more data at offset `received`. Data is written at explicit offsets,
+// but a deduplicating upload's manifest is appended to.
+int upload_reopen(struct upload_t *upload, int fd)
+{
+    upload->fd = fd;
+    if (upload->chunker) {
+        if (lseek(upload->fd, 0, SEEK_END) == -1) return -1;
+        upload->chunker->manifest_fd = upload->fd;
+    }
+    return 0;
+}
+
+void expire_parked_uploads(void)
+{
+    struct upload_t *upload, **link, *expired = NULL;
+    time_t now = time(NULL);
+
+    pthread_mutex_lock(&parked_lock);
+    link = &parked_uploads;
+    while ((upload = *link)) {
+        if (upload->expires <= now) {
+            *link = upload->next;
+            upload->next = expired;
+            expired = upload;
+        }
+        else {
+            link = &upload->next;
+        }
+    }
+    pthread_mutex_unlock(&parked_lock);
+
+    // Unlinking can be slow, so do it outside the lock.
+    while ((upload = expired)) {
+        expired = upload->next;
+        upload_free(upload);
+    }
+}
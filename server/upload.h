@@ -0,0 +1,96 @@
+#ifndef __UPLOAD_H
+#define __UPLOAD_H
+
+#include <limits.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+#include <openssl/evp.h>
+#include "configuration.h"
+#include "constants.h"
+#include "digest.h"
+#include "diskio.h"
+
+#define UPLOAD_TOKEN_LENGTH 32
+
+// With 'uncached uploads', data is seen out of the page cache this much at
+// a time as it is written.
+#define UNCACHED_WINDOW (8 * 1024 * 1024)
+
+// A file being uploaded, from PUT until SAVE. When resumable uploads are
+// enabled an upload outlives a dropped connection: it is parked with its
+// temporary file, byte count and running hash until the client comes back
+// with RESUME <token> or the janitor expires it.
+//
+// File operations on an upload go through its session's disk engine and
+// each one holds the upload until it completes, so a session that ends with
+// operations in flight leaves the parking or freeing to the last of them.
+struct upload_t
+{
+    char token[UPLOAD_TOKEN_LENGTH + 1];
+    struct user_configuration_t *user;
+    char filename[MAX_FILENAME_LENGTH + 1];
+    char temp_path[PATH_MAX];
+    char repository_path[PATH_MAX];
+    char current_path[PATH_MAX];
+    char version_path[PATH_MAX];
+    int fd;
+    int opened;
+    unsigned long long received;
+    struct chunker_t *chunker;
+    struct evbuffer *chunk_pending;
+    struct evbuffer *chunk_data;
+    int chunking;
+    int chunks_complete;
+    int chunks_finishing;
+    struct compressor_t *compressor;
+    struct delta_t *delta;
+    EVP_MD_CTX *digest;
+    int digest_incomplete;
+    char expected_hash[DIGEST_HEX_LENGTH + 1];
+    unsigned long long expected_size;
+    unsigned long long preallocated;
+    unsigned long long dropped;
+    unsigned long long drop_offset;
+    unsigned long long drop_length;
+    int dropping;
+    char hash[DIGEST_HEX_LENGTH + 1];
+    time_t expires;
+    struct upload_t *next;
+
+    struct client_data_t *client;
+    unsigned int stream_id;
+    unsigned int unacknowledged_blocks;
+    int opening;
+    int saving;
+    struct disk_t *disk;
+    struct disk_flow_t flow;
+    unsigned int ops_in_flight;
+    size_t bytes_in_flight;
+    size_t buffered;
+    int write_error;
+    int orphaned;
+    int active;
+    int save_step;
+    uint64_t save_started;
+    uint64_t commit_started;
+};
+
+// Uploads and batches being received or saved, for background work that
+// should keep off the disk while there are any.
+extern atomic_int uploads_in_progress;
+
+int next_upload_number(void);
+int version_matches(const char *path, const char *hash);
+struct upload_t *upload_new(struct user_configuration_t *user, const char *filename, const char *expected_hash);
+int upload_open(struct upload_t *upload, int fd);
+void upload_free(struct upload_t *upload);
+void upload_park(struct upload_t *upload);
+void upload_release(struct upload_t *upload, int park);
+int upload_op_done(struct upload_t *upload);
+struct upload_t *upload_resume(const char *token, struct user_configuration_t *user);
+int upload_reopen(struct upload_t *upload, int fd);
+void expire_parked_uploads(void);
+
+#endif
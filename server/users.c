@@ -0,0 +1,149 @@
+#include <assert.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <event2/bufferevent.h>
+#include <event2/event.h>
+
+#include "users.h"
+
+// Tables retired by a reload wait here until every worker has been back to
+// its event loop, at which point no callback can still be holding the old
+// pointer without a reference.
+struct retired_table_t
+{
+    struct user_table_t *table;
+    atomic_int pending_workers;
+};
+
+static _Atomic(struct user_table_t *) current_table = NULL;
+
+// Held while the current table is swapped, so that threads outside the
+// workers can take a reference without waiting for a grace period.
+static pthread_mutex_t current_table_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned int hash_username(const char *username)
+{
+    unsigned int hash = 2166136261u;
+
+    while (*username) {
+        hash ^= (unsigned char)*(username++);
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+// Builds a table owning the given list of users.
+struct user_table_t *user_table_new(struct user_configuration_t *head_user)
+{
+    struct user_configuration_t *user;
+    unsigned int count = 0, buckets = 16;
+
+    for (user = head_user; user; user = user->next) count++;
+    while (buckets < count * 2) buckets <<= 1;
+
+    struct user_table_t *table = (struct user_table_t *)malloc(sizeof(struct user_table_t));
+    assert(table);
+    atomic_init(&table->references, 1);
+    table->head_user = head_user;
+    table->bucket_mask = buckets - 1;
+    table->buckets = (struct user_configuration_t **)calloc(buckets, sizeof(struct user_configuration_t *));
+    assert(table->buckets);
+
+    for (user = head_user; user; user = user->next) {
+        unsigned int bucket = hash_username(user->username) & table->bucket_mask;
+        user->hash_next = table->buckets[bucket];
+        user->table = table;
+        table->buckets[bucket] = user;
+    }
+
+    return table;
+}
+
+void user_table_retain(struct user_table_t *table)
+{
+    table->references++;
+}
+
+void user_table_release(struct user_table_t *table)
+{
+    if (--table->references > 0) return;
+
+    struct user_configuration_t *user = table->head_user, *next;
+    while (user) {
+        next = user->next;
+        // Its sessions all left the rate limit group before letting go.
+        if (user->rate_group) bufferevent_rate_limit_group_free(user->rate_group);
+        free(user->username);
+        free(user->password);
+        free(user->replica_password);
+        free(user->repository);
+        free(user);
+        user = next;
+    }
+    free(table->buckets);
+    free(table);
+}
+
+static void grace_period_cb(evutil_socket_t fd, short what, void *arg)
+{
+    struct retired_table_t *retired = (struct retired_table_t *)arg;
+
+    if (--retired->pending_workers > 0) return;
+
+    user_table_release(retired->table);
+    free(retired);
+}
+
+// Publishes a new table for logins to use. The table being replaced loses
+// its own reference only after a grace period: a callback is queued on every
+// worker, and callbacks never interleave on a worker, so once all of them
+// have run nobody can still be between loading the old pointer and taking a
+// reference on it.
+void install_user_table(struct user_table_t *table, struct worker_t *workers, int worker_count)
+{
+    pthread_mutex_lock(&current_table_lock);
+    struct user_table_t *old = atomic_exchange(&current_table, table);
+    pthread_mutex_unlock(&current_table_lock);
+    if (old == NULL) return;
+
+    struct retired_table_t *retired = (struct retired_table_t *)malloc(sizeof(struct retired_table_t));
+    assert(retired);
+    retired->table = old;
+    atomic_init(&retired->pending_workers, worker_count);
+
+    int i;
+    for (i = 0; i < worker_count; i++) {
+        event_base_once(workers[i].evbase, -1, EV_TIMEOUT, grace_period_cb, retired, NULL);
+    }
+}
+
+// Looks a user up in the current table. The caller gets a reference on the
+// table that must be dropped with user_table_release(user->table). Must be
+// called from a worker's event loop.
+struct user_configuration_t *find_user(const char *username)
+{
+    struct user_table_t *table = atomic_load(&current_table);
+    struct user_configuration_t *user;
+
+    if (table == NULL) return NULL;
+
+    user = table->buckets[hash_username(username) & table->bucket_mask];
+    while (user && strcmp(user->username, username)) user = user->hash_next;
+
+    if (user) user_table_retain(table);
+    return user;
+}
+
+// Returns the current table with a reference held, which the caller drops
+// with user_table_release(). Safe to call from any thread.
+struct user_table_t *user_table_acquire(void)
+{
+    pthread_mutex_lock(&current_table_lock);
+    struct user_table_t *table = atomic_load(&current_table);
+    if (table) user_table_retain(table);
+    pthread_mutex_unlock(&current_table_lock);
+
+    return table;
+}
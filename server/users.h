@@ -0,0 +1,27 @@
+#ifndef __USERS_H
+#define __USERS_H
+
+#include <stdatomic.h>
+#include "configuration.h"
+#include "worker.h"
+
+// An immutable hash index over one generation of the configured users.
+// Sessions and uploads hold a reference to the table their user record came
+// from, so a reload never pulls a user_configuration_t out from under them;
+// the old table is freed when the last of them lets go.
+struct user_table_t
+{
+    atomic_int references;
+    struct user_configuration_t *head_user;
+    unsigned int bucket_mask;
+    struct user_configuration_t **buckets;
+};
+
+struct user_table_t *user_table_new(struct user_configuration_t *head_user);
+void user_table_retain(struct user_table_t *table);
+void user_table_release(struct user_table_t *table);
+struct user_table_t *user_table_acquire(void);
+void install_user_table(struct user_table_t *table, struct worker_t *workers, int worker_count);
+struct user_configuration_t *find_user(const char *username);
+
+#endif
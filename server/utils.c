@@ -1,7 +1,11 @@
 #include <sys/stat.h>
 #include <errno.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <unistd.h>
 
 #include "utils.h"
 
@@ -19,25 +23,43 @@ int valid_filename(const char *filename)
     return 1;
 }
 
-char *binary_to_hex(const unsigned char *input, int length)
+// Writes length * 2 hex digits and a terminating NUL to out.
+void hex_encode(char *out, const unsigned char *input, int length)
 {
-    char *out, *p;
     const char *hex = "0123456789abcdef";
 
+    while (length-- > 0) {
+        *(out++) = hex[*input >> 4];
+        *(out++) = hex[*(input++) & 0xf];
+    }
+    *out = 0;
+}
+
+char *binary_to_hex(const unsigned char *input, int length)
+{
+    char *out;
+
     if (length <= 0) return NULL;
 
-    out = p = (char *)malloc(length * 2 + 1);
+    out = (char *)malloc(length * 2 + 1);
     if (out == NULL) return NULL;
 
-    while (length--) {
-        *(p++) = hex[*input >> 4];
-        *(p++) = hex[*(input++) & 0xf];
-    }
-    *p = 0;
-
+    hex_encode(out, input, length);
     return out;
 }
 
+// Formats a path into a PATH_MAX buffer, failing rather than truncating.
+int build_path(char *path, const char *format, ...)
+{
+    va_list args;
+
+    va_start(args, format);
+    int n = vsnprintf(path, PATH_MAX, format, args);
+    va_end(args);
+
+    return (n < 0 || n >= PATH_MAX) ? -1 : 0;
+}
+
 int mkdir_p(const char *path)
 {
     if (mkdir(path, 0770) == 0) return 0;
@@ -58,9 +80,36 @@ int bufferevent_write0(struct bufferevent *bufev, const char *data)
     return bufferevent_write(bufev, data, strlen(data));
 }
 
-void system_error(struct bufferevent *bufev, struct client_data_t *client_data)
+// Writes all of `data` to `fd`, carrying on after short writes and
+// interruptions.
+int write_all(int fd, const unsigned char *data, size_t length)
 {
-    bufferevent_write0(bufev, "599 system error occurred, disconnecting\n");
-    free_client_data(client_data);
-    bufferevent_free(bufev);
+    while (length > 0) {
+        ssize_t n = write(fd, data, length);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        data += n;
+        length -= n;
+    }
+    return 0;
+}
+
+// Reads exactly `length` bytes from `offset`. Running into the end of the
+// file first fails with EIO.
+int read_fully(int fd, unsigned char *buffer, size_t length, off_t offset)
+{
+    size_t done = 0;
+
+    while (done < length) {
+        ssize_t n = pread(fd, buffer + done, length - done, offset + done);
+        if (n == -1 && errno == EINTR) continue;
+        if (n <= 0) {
+            if (n == 0) errno = EIO;
+            return -1;
+        }
+        done += n;
+    }
+    return 0;
 }
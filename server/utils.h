@@ -2,7 +2,10 @@
 #include "client_data.h"
 
 int valid_filename(const char *filename);
+void hex_encode(char *out, const unsigned char *input, int length);
 char *binary_to_hex(const unsigned char *input, int length);
+int build_path(char *path, const char *format, ...) __attribute__((format(printf, 2, 3)));
 int mkdir_p(const char *path);
-void system_error(struct bufferevent *bufev, struct client_data_t *client_data);
 int bufferevent_write0(struct bufferevent *bufev, const char *data);
+int write_all(int fd, const unsigned char *data, size_t length);
+int read_fully(int fd, unsigned char *buffer, size_t length, off_t offset);
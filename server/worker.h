@@ -0,0 +1,26 @@
+#ifndef __WORKER_H
+#define __WORKER_H
+
+#include <pthread.h>
+#include <openssl/ssl.h>
+#include <event2/event.h>
+#include <event2/listener.h>
+#include "diskio.h"
+#include "metrics.h"
+
+// Each worker thread owns an event base and a listener bound to the shared
+// listen address with SO_REUSEPORT, so the kernel spreads incoming
+// connections across threads. A connection never leaves the worker that
+// accepted it.
+struct worker_t
+{
+    int id;
+    pthread_t thread;
+    struct event_base *evbase;
+    struct evconnlistener *listener;
+    SSL_CTX *ssl_ctx;
+    struct disk_t disk;
+    struct metrics_t metrics;
+};
+
+#endif
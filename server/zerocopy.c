@@ -0,0 +1,224 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <openssl/ssl.h>
+#include <event2/buffer.h>
+#include <event2/event.h>
+
+#include "commands.h"
+#include "configuration.h"
+#include "ratelimit.h"
+#include "utils.h"
+#include "worker.h"
+#include "zerocopy.h"
+
+#define SPLICE_CHUNK_SIZE 65536
+
+// Throws away whatever is left in the client's pipe by closing it. The
+// next splice makes a new one.
+static void discard_pipe(struct client_data_t *client_data)
+{
+    close(client_data->pipe_fds[0]);
+    close(client_data->pipe_fds[1]);
+    client_data->pipe_fds[0] = client_data->pipe_fds[1] = 0;
+}
+
+// Moves up to `length` bytes of BLOCK payload from the socket into the
+// upload file through the client's pipe. The kernel has already decrypted
+// the records, so the data never enters userspace. Returns the number of
+// bytes taken off the socket, 0 at end of stream, or -1 with errno set if
+// none could be. Bytes that then can't be written out set the upload's
+// write_error, and only those that were written count as received.
+static ssize_t splice_block(struct client_data_t *client_data, size_t length)
+{
+    struct upload_t *upload = client_data->upload;
+
+    ssize_t n = splice(client_data->sock, NULL, client_data->pipe_fds[1], NULL, length, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (n <= 0) return n;
+
+    // Write at an explicit offset, as the disk engine does for data that
+    // came the ordinary way.
+    loff_t offset = upload->received;
+    ssize_t remaining = n;
+    while (remaining > 0) {
+        ssize_t m = splice(client_data->pipe_fds[0], NULL, upload->fd, &offset, remaining, SPLICE_F_MOVE);
+        if (m <= 0) {
+            upload->write_error = m == 0 ? EIO : errno;
+            discard_pipe(client_data);
+            break;
+        }
+        remaining -= m;
+    }
+
+    upload->received = offset;
+    return n;
+}
+
+static void splice_readcb(evutil_socket_t sock, short what, void *data)
+{
+    struct bufferevent *bev = (struct bufferevent *)data;
+    struct client_data_t *client_data;
+
+    bufferevent_getcb(bev, NULL, NULL, NULL, (void **)&client_data);
+
+    while (client_data->incoming_data_size > 0) {
+        size_t length = client_data->incoming_data_size;
+        if (length > SPLICE_CHUNK_SIZE) length = SPLICE_CHUNK_SIZE;
+
+        ssize_t n = splice_block(client_data, length);
+        if (n == 0) {
+            // The peer went away mid-block; nothing else will notice as the
+            // bufferevent is not reading.
+            park_client_data(client_data);
+            bufferevent_free(bev);
+            return;
+        }
+        if (n == -1) {
+            if (errno == EAGAIN) return;
+
+            // A non-data TLS record (an alert or key update) is next on the
+            // socket, or the kernel refused the splice. Nothing has been
+            // taken off the socket, so OpenSSL can deal with the rest of the
+            // block the ordinary way.
+            if (errno == EINVAL || errno == EIO) {
+                zerocopy_stop(client_data);
+                bufferevent_enable(bev, EV_READ);
+                return;
+            }
+
+            system_error(bev, client_data);
+            return;
+        }
+
+        client_data->incoming_data_size -= n;
+        if (client_data->upload->write_error) {
+            zerocopy_stop(client_data);
+            system_error(bev, client_data);
+            return;
+        }
+    }
+
+    zerocopy_stop(client_data);
+    block_received(client_data, bev);
+    send_block_acknowledgement(client_data, bev);
+    bufferevent_enable(bev, EV_READ);
+}
+
+// Switches the rest of the current BLOCK payload to the splice path when
+// 'zero copy uploads' is enabled and the kernel is doing TLS receive for
+// this connection. That is only safe once everything libevent and OpenSSL
+// have already read off the socket has been written out, so the caller
+// must have drained the input buffer. Returns 1 if splicing has started.
+int zerocopy_start(struct client_data_t *client_data, struct bufferevent *bev)
+{
+    if (!configuration.zero_copy_uploads || client_data->upload == NULL || client_data->upload->chunker || client_data->upload->compressor ||
+            client_data->upload->delta || rate_limited(client_data->user)) return 0;
+
+    SSL *ssl = bufferevent_openssl_get_ssl(bev);
+    if (ssl == NULL || !BIO_get_ktls_recv(SSL_get_rbio(ssl)) || SSL_pending(ssl) > 0) return 0;
+    if (evbuffer_get_length(bufferevent_get_input(bev)) > 0) return 0;
+
+    if (client_data->pipe_fds[0] == 0 && pipe2(client_data->pipe_fds, O_NONBLOCK | O_CLOEXEC) == -1) return 0;
+
+    client_data->splice_event = event_new(client_data->worker->evbase, client_data->sock, EV_READ | EV_PERSIST, splice_readcb, bev);
+    if (client_data->splice_event == NULL) return 0;
+
+    bufferevent_disable(bev, EV_READ);
+    event_add(client_data->splice_event, NULL);
+    client_data->upload->digest_incomplete = 1;
+    return 1;
+}
+
+#define SENDFILE_CHUNK_SIZE 1048576
+
+static void sendfile_writecb(evutil_socket_t sock, short what, void *data)
+{
+    struct bufferevent *bev = (struct bufferevent *)data;
+    struct client_data_t *client_data;
+    SSL *ssl = bufferevent_openssl_get_ssl(bev);
+
+    bufferevent_getcb(bev, NULL, NULL, NULL, (void **)&client_data);
+
+    while (client_data->send_remaining > 0) {
+        size_t length = client_data->send_remaining;
+        if (length > SENDFILE_CHUNK_SIZE) length = SENDFILE_CHUNK_SIZE;
+
+        ossl_ssize_t n = SSL_sendfile(ssl, client_data->send_fd, client_data->send_offset, length, 0);
+        if (n <= 0) {
+            if (SSL_get_error(ssl, n) == SSL_ERROR_WANT_WRITE) return;
+
+            // The length has already been promised to the client, so the only
+            // way to report a failure is to hang up.
+            close_client(bev, client_data);
+            return;
+        }
+
+        client_data->send_offset += n;
+        client_data->send_remaining -= n;
+    }
+
+    zerocopy_stop(client_data);
+    client_data->state = STATE_AUTHENTICATED;
+    bufferevent_enable(bev, EV_READ);
+    if (evbuffer_get_length(bufferevent_get_input(bev)) > 0) bufferevent_trigger(bev, EV_READ, BEV_TRIG_DEFER_CALLBACKS);
+}
+
+// Runs once the bufferevent has flushed everything queued ahead of the file.
+static void sendfile_flushedcb(struct bufferevent *bev, void *data)
+{
+    struct client_data_t *client_data = (struct client_data_t *)data;
+    bufferevent_data_cb readcb;
+    bufferevent_event_cb eventcb;
+
+    bufferevent_getcb(bev, &readcb, NULL, &eventcb, NULL);
+    bufferevent_setcb(bev, readcb, NULL, eventcb, client_data);
+    event_add(client_data->sendfile_event, NULL);
+}
+
+// Sends `length` bytes of fd from `offset` straight from the page cache with
+// SSL_sendfile() when 'zero copy downloads' is enabled and the kernel is
+// doing TLS transmit for this connection. Takes ownership of fd and returns 1
+// if it has started; otherwise the caller should queue the file on the
+// bufferevent itself. Reading is paused until the file has been sent so that
+// later responses can't overtake it.
+int zerocopy_send_file(struct client_data_t *client_data, struct bufferevent *bev, int fd, off_t offset, size_t length)
+{
+    bufferevent_data_cb readcb;
+    bufferevent_event_cb eventcb;
+
+    if (!configuration.zero_copy_downloads || length == 0 || rate_limited(client_data->user)) return 0;
+
+    SSL *ssl = bufferevent_openssl_get_ssl(bev);
+    if (ssl == NULL || !BIO_get_ktls_send(SSL_get_wbio(ssl))) return 0;
+
+    client_data->sendfile_event = event_new(client_data->worker->evbase, client_data->sock, EV_WRITE | EV_PERSIST, sendfile_writecb, bev);
+    if (client_data->sendfile_event == NULL) return 0;
+
+    client_data->send_fd = fd;
+    client_data->send_offset = offset;
+    client_data->send_remaining = length;
+    client_data->state = STATE_SENDING;
+
+    bufferevent_disable(bev, EV_READ);
+    bufferevent_getcb(bev, &readcb, NULL, &eventcb, NULL);
+    bufferevent_setcb(bev, readcb, sendfile_flushedcb, eventcb, client_data);
+    if (evbuffer_get_length(bufferevent_get_output(bev)) == 0) sendfile_flushedcb(bev, client_data);
+
+    return 1;
+}
+
+void zerocopy_stop(struct client_data_t *client_data)
+{
+    if (client_data->splice_event) {
+        event_free(client_data->splice_event);
+        client_data->splice_event = NULL;
+    }
+    if (client_data->sendfile_event) {
+        event_free(client_data->sendfile_event);
+        client_data->sendfile_event = NULL;
+        close(client_data->send_fd);
+        client_data->send_fd = 0;
+    }
+}
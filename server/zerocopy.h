@@ -0,0 +1,12 @@
+#ifndef __ZEROCOPY_H
+#define __ZEROCOPY_H
+
+#include <sys/types.h>
+#include <event2/bufferevent_ssl.h>
+#include "client_data.h"
+
+int zerocopy_start(struct client_data_t *client_data, struct bufferevent *bev);
+int zerocopy_send_file(struct client_data_t *client_data, struct bufferevent *bev, int fd, off_t offset, size_t length);
+void zerocopy_stop(struct client_data_t *client_data);
+
+#endif